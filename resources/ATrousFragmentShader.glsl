@@ -0,0 +1,192 @@
+#version 330 core
+out vec4 FragColor;
+
+in vec2 TexCoords;
+
+// Edge-avoiding a-trous wavelet filter of SVGF (Schied et al. 2017). The
+// estimateVariance pass writes the color of the ray tracer with its variance
+// in alpha; every following pass is one 5x5 a-trous iteration of stepWidth
+// 1, 2, 4, ... over the output of the previous one. The taps are weighted by
+// the B3 spline kernel and stop at depth, normal and luminance edges.
+// With direction 1 or 2 an iteration is split into a horizontal and a
+// vertical pass of 5 taps, 8 taps instead of 24. The split is not exact: a
+// diagonal tap is stopped at the edges of the pixel the first pass
+// gathered it into, not at those of the centre.
+uniform bool estimateVariance;
+uniform int stepWidth;
+// 0 for the 5x5 taps, 1 for the horizontal pass, 2 for the vertical one
+uniform int direction;
+// Prefilter the variance with 4 bilinear fetches, inputTexture is linearly filtered
+uniform bool linearVariance;
+uniform float sigmaDepth;
+uniform float sigmaNormal;
+uniform float sigmaLuminance;
+
+// Frame of the ray tracer
+uniform sampler2D screenTexture;
+uniform sampler2D depthTexture;
+uniform sampler2D normalTexture;
+uniform isampler2D countTexture;
+uniform sampler2D luminance1Texture;
+uniform sampler2D luminance2Texture;
+// Color and variance of the previous iteration
+uniform sampler2D inputTexture;
+
+float kernel[3] = float[](3.0/8.0, 1.0/4.0, 1.0/16.0);
+
+ivec2 screenSize;
+
+ivec2 clampPixel(ivec2 p) {
+	return clamp(p, ivec2(0), screenSize - 1);
+}
+
+float luminance(vec3 c) {
+	return c.x*0.30+c.y*0.59+c.z*0.11;
+}
+
+// Depth change per pixel at p, the smaller one sided difference so that it
+// does not jump across an edge
+vec2 depthGradient(ivec2 p, float depth) {
+	float dx = min(abs(texelFetch(depthTexture, clampPixel(p + ivec2(1, 0)), 0).r - depth),
+		abs(depth - texelFetch(depthTexture, clampPixel(p - ivec2(1, 0)), 0).r));
+	float dy = min(abs(texelFetch(depthTexture, clampPixel(p + ivec2(0, 1)), 0).r - depth),
+		abs(depth - texelFetch(depthTexture, clampPixel(p - ivec2(0, 1)), 0).r));
+	return vec2(dx, dy);
+}
+
+// Edge-stopping weight of the geometry, a miss only matches another miss
+float geometryWeight(float depthP, vec3 normalP, vec2 gradP, ivec2 offset, float depthQ, vec3 normalQ) {
+	bool missP = dot(normalP, normalP) == 0.0;
+	bool missQ = dot(normalQ, normalQ) == 0.0;
+	if (missP || missQ) {
+		return missP && missQ ? 1.0 : 0.0;
+	}
+	float wDepth = exp(-abs(depthP - depthQ) / (sigmaDepth * dot(gradP, abs(vec2(offset))) + 1e-4));
+	float wNormal = pow(max(0.0, dot(normalP, normalQ)), sigmaNormal);
+	return wDepth * wNormal;
+}
+
+// Variance of the mean of a pixel, from its luminance moments
+float temporalVariance(ivec2 p) {
+	float m1 = texelFetch(luminance1Texture, p, 0).r;
+	float m2 = texelFetch(luminance2Texture, p, 0).r;
+	int count = max(1, texelFetch(countTexture, p, 0).r);
+	return max(0.0, m2 - m1 * m1) / float(count);
+}
+
+// With fewer than 4 frames of history the moments of a pixel say little, so
+// its variance comes from the moments of the 7x7 neighbours on the same surface
+vec4 estimate(ivec2 p) {
+	vec3 color = texelFetch(screenTexture, p, 0).rgb;
+	int count = texelFetch(countTexture, p, 0).r;
+	if (count >= 4) {
+		return vec4(color, temporalVariance(p));
+	}
+	float depthP = texelFetch(depthTexture, p, 0).r;
+	vec3 normalP = texelFetch(normalTexture, p, 0).rgb;
+	vec2 gradP = depthGradient(p, depthP);
+	float weightSum = 0.0;
+	vec2 moments = vec2(0.0);
+	for (int y = -3; y <= 3; y++) {
+		for (int x = -3; x <= 3; x++) {
+			ivec2 q = clampPixel(p + ivec2(x, y));
+			float w = geometryWeight(depthP, normalP, gradP, ivec2(x, y),
+				texelFetch(depthTexture, q, 0).r, texelFetch(normalTexture, q, 0).rgb);
+			if (x == 0 && y == 0) w = 1.0;
+			moments += w * vec2(texelFetch(luminance1Texture, q, 0).r, texelFetch(luminance2Texture, q, 0).r);
+			weightSum += w;
+		}
+	}
+	moments /= weightSum;
+	return vec4(color, max(0.0, moments.y - moments.x * moments.x) / float(max(1, count)));
+}
+
+// 3x3 Gaussian of the variance, steadier for the luminance weight
+float filteredVariance(ivec2 p) {
+	float var = 0.0;
+	for (int y = -1; y <= 1; y++) {
+		for (int x = -1; x <= 1; x++) {
+			float w = (x == 0 ? 0.5 : 0.25) * (y == 0 ? 0.5 : 0.25);
+			var += w * texelFetch(inputTexture, clampPixel(p + ivec2(x, y)), 0).a;
+		}
+	}
+	return var;
+}
+
+// Same 3x3 Gaussian from 4 bilinear fetches at the corners of p, each the
+// mean of the 2x2 texels around it. The edge clamp of the texture is the
+// clampPixel() of the texel fetches.
+float filteredVarianceLinear(ivec2 p) {
+	vec2 texel = 1.0 / vec2(screenSize);
+	vec2 center = (vec2(p) + 0.5) * texel;
+	float var = 0.0;
+	for (int i = 0; i < 4; i++) {
+		vec2 corner = vec2(i & 1, i >> 1) - 0.5;
+		var += texture(inputTexture, center + corner * texel).a;
+	}
+	return 0.25 * var;
+}
+
+// Centre pixel of the iteration and the sums of its taps
+ivec2 pixel;
+float depthP;
+vec3 normalP;
+vec2 gradP;
+float luminanceP;
+float luminanceScale;
+float weightSum;
+vec3 color;
+float var;
+
+// Adds the tap at offset from the centre with kernel weight k
+void addTap(ivec2 offset, float k) {
+	ivec2 q = pixel + offset;
+	if (any(lessThan(q, ivec2(0))) || any(greaterThanEqual(q, screenSize))) return;
+	vec4 sampleQ = texelFetch(inputTexture, q, 0);
+	float w = geometryWeight(depthP, normalP, gradP, offset,
+		texelFetch(depthTexture, q, 0).r, texelFetch(normalTexture, q, 0).rgb);
+	w *= exp(-abs(luminanceP - luminance(sampleQ.rgb)) / luminanceScale);
+	float h = k * w;
+	weightSum += h;
+	color += h * sampleQ.rgb;
+	var += h * h * sampleQ.a;
+}
+
+void main() {
+	screenSize = textureSize(depthTexture, 0);
+	ivec2 p = ivec2(gl_FragCoord.xy);
+	if (estimateVariance) {
+		FragColor = estimate(p);
+		return;
+	}
+
+	pixel = p;
+	vec4 center = texelFetch(inputTexture, p, 0);
+	depthP = texelFetch(depthTexture, p, 0).r;
+	normalP = texelFetch(normalTexture, p, 0).rgb;
+	gradP = depthGradient(p, depthP);
+	luminanceP = luminance(center.rgb);
+	luminanceScale = sigmaLuminance * sqrt(linearVariance ? filteredVarianceLinear(p) : filteredVariance(p)) + 1e-6;
+
+	// The centre tap always counts in full
+	float h0 = direction == 0 ? kernel[0] * kernel[0] : kernel[0];
+	weightSum = h0;
+	color = h0 * center.rgb;
+	var = h0 * h0 * center.a;
+	if (direction == 0) {
+		for (int y = -2; y <= 2; y++) {
+			for (int x = -2; x <= 2; x++) {
+				if (x == 0 && y == 0) continue;
+				addTap(ivec2(x, y) * stepWidth, kernel[abs(x)] * kernel[abs(y)]);
+			}
+		}
+	}
+	else {
+		ivec2 axis = direction == 1 ? ivec2(1, 0) : ivec2(0, 1);
+		for (int i = -2; i <= 2; i++) {
+			if (i == 0) continue;
+			addTap(axis * (i * stepWidth), kernel[abs(i)]);
+		}
+	}
+	FragColor = vec4(color / weightSum, var / (weightSum * weightSum));
+}
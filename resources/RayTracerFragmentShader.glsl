@@ -8,13 +8,9 @@ out float luminance2;
 
 in vec2 TexCoords;
 
-#define MAX_SPHERE 10
 uniform int screenWidth;
 uniform int screenHeight;
-uniform bool temporalDenoiser;
-uniform bool spatialDenoiser;
-uniform int sphereNum;
-uniform float globalLight;
+uniform bool accumulate;
 
 struct Camera {
 	vec3 camPos;
@@ -26,7 +22,7 @@ struct Camera {
 	vec3 leftbottom;
 	int LoopNum;
 };
-uniform struct Camera camera;
+uniform Camera camera;
 
 struct Ray {
 	vec3 origin;
@@ -46,7 +42,24 @@ struct Sphere {
 	vec3 albedo;
 	int materialIndex;
 };
-uniform Sphere sphere[MAX_SPHERE];
+// Uploaded by SceneBuffer.h, std140 so that the layout is fixed
+layout(std140) uniform SceneBlock {
+	int sphereNum;
+	float globalLight;
+};
+// Sphere BVH: nodes as in bvhNodeTexture, spheres as two texels,
+// (center, radius) and (albedo, materialIndex), in leaf order
+uniform samplerBuffer sphereNodeTexture;
+uniform samplerBuffer sphereTexture;
+
+// Triangle mesh, the NodeArray and MeshArray of a BVHTree (see BVHBuffer.h).
+// A node is 9 floats: pMin, pMax, nPrimitives, axis, childOffset. A triangle
+// is 24 floats: 3 positions, 3 normals and padding.
+uniform samplerBuffer bvhNodeTexture;
+uniform samplerBuffer bvhMeshTexture;
+uniform int meshNum;
+uniform vec3 meshAlbedo;
+uniform int meshMaterialIndex;
 
 struct hitRecord {
 	vec3 Normal;
@@ -58,14 +71,13 @@ hitRecord rec;
 
 // ֵray򽻵ľ
 float hitSphere(Sphere s, Ray r);
+bool hitSpheres(Ray r, inout float tMax, out int sphereId);
+bool hitMesh(Ray r, inout float tMax, out int primId, out vec2 uv);
 bool hitWorld(Ray r);
 vec3 shading(Ray r);
 
 // ʷ֡
 uniform sampler2D historyTexture;
-uniform sampler2D historyDepthTexture;
-uniform sampler2D historyNormalTexture;
-uniform isampler2D historyCountTexture;
 uniform sampler2D historyluminance1Texture;
 uniform sampler2D historyluminance2Texture;
 float curDepth;
@@ -80,9 +92,6 @@ void main() {
 
 	// ȡʷ֡Ϣ
 	vec3 hist = texture(historyTexture, TexCoords).rgb;
-	float histDepth = texture(historyDepthTexture, TexCoords).r;
-	vec3 histNormal = texture(historyNormalTexture, TexCoords).rgb;
-	int histCount = texture(historyCountTexture, TexCoords).r;
 	float histLuminance1 = texture(historyluminance1Texture, TexCoords).r;
 	float histLuminance2 = texture(historyluminance2Texture, TexCoords).r;
 
@@ -91,22 +100,29 @@ void main() {
 	cameraRay.direction = normalize(camera.leftbottom + (TexCoords.x * 2.0 * camera.halfW) * camera.right + (TexCoords.y * 2.0 * camera.halfH) * camera.up);
 
 	vec3 curColor = shading(cameraRay);
-	if(temporalDenoiser){
-		// curColor = (1.0 / float(camera.LoopNum))*curColor + (float(camera.LoopNum - 1) / float(camera.LoopNum))*hist;
-		float dif1 = abs(curDepth - histDepth) / curDepth;
-		float dif2 = 1 - dot(curNormal, histNormal);
+	int histCount = 0;
+	if(accumulate){
+		// Running mean of the frames since the camera last moved, and of the
+		// luminance and its square for the variance of the mean
 		float luminance = curColor.x*0.30+curColor.y*0.59+curColor.z*0.11;
-		if(camera.LoopNum > 1 && dif1<0.001 && dif2<0.001){
-			curColor = 0.2*curColor + 0.8*hist;
+		histCount = camera.LoopNum - 1;
+		if(histCount > 0){
+			curColor = (1.0 / float(camera.LoopNum))*curColor + (float(histCount) / float(camera.LoopNum))*hist;
 			luminance1 = (luminance + histCount * histLuminance1) / (histCount + 1);
 			luminance2 = (luminance * luminance + histCount * histLuminance2) / (histCount + 1);
 		}
 		else{
-			histCount = 0;
 			luminance1 = luminance;
 			luminance2 = luminance * luminance;
 		}
 	}
+	else{
+		// Moments of this frame alone, so that the AOVs are always defined; the
+		// temporal denoiser blends them with the history in its resolve pass
+		float luminance = curColor.x*0.30+curColor.y*0.59+curColor.z*0.11;
+		luminance1 = luminance;
+		luminance2 = luminance * luminance;
+	}
 	FragColor = vec4(curColor, 1.0);
 	FragCount = histCount + 1;
 
@@ -144,24 +160,178 @@ float hitSphere(Sphere s, Ray r) {
 	else return -1.0;
 }
 
+// Slab test, same as IntersectBox in Geometry.h
+bool hitBox(vec3 pMin, vec3 pMax, Ray r, vec3 invDir, float tMax) {
+	vec3 tA = (pMin - r.origin) * invDir;
+	vec3 tB = (pMax - r.origin) * invDir;
+	vec3 tNear = min(tA, tB);
+	vec3 tFar = max(tA, tB);
+	float t0 = max(max(tNear.x, tNear.y), tNear.z);
+	float t1 = min(min(tFar.x, tFar.y), tFar.z) * 1.0000004;
+	return t0 <= t1 && t1 > 0.0 && t0 < tMax;
+}
+
+// Moller-Trumbore, same as hitTriangle in Geometry.h
+bool hitTriangle(vec3 v0, vec3 v1, vec3 v2, Ray r, float tMax, out float t, out vec2 uv) {
+	vec3 e1 = v1 - v0;
+	vec3 e2 = v2 - v0;
+	vec3 p = cross(r.direction, e2);
+	float det = dot(e1, p);
+	if (abs(det) < 1e-8) return false;
+	float invDet = 1.0 / det;
+	vec3 s = r.origin - v0;
+	uv.x = dot(s, p) * invDet;
+	if (uv.x < 0.0 || uv.x > 1.0) return false;
+	vec3 q = cross(s, e1);
+	uv.y = dot(r.direction, q) * invDet;
+	if (uv.y < 0.0 || uv.x + uv.y > 1.0) return false;
+	t = dot(e2, q) * invDet;
+	return t > 0.0 && t < tMax;
+}
+
+vec3 fetchVec3(samplerBuffer buffer, int offset) {
+	return vec3(texelFetch(buffer, offset).r, texelFetch(buffer, offset + 1).r, texelFetch(buffer, offset + 2).r);
+}
+
+Sphere fetchSphere(int i) {
+	vec4 a = texelFetch(sphereTexture, 2 * i);
+	vec4 b = texelFetch(sphereTexture, 2 * i + 1);
+	Sphere s;
+	s.center = a.xyz;
+	s.radius = a.w;
+	s.albedo = b.xyz;
+	s.materialIndex = int(b.w);
+	return s;
+}
+
+struct BVHNode {
+	vec3 pMin;
+	vec3 pMax;
+	int nPrimitives;
+	int axis;
+	int childOffset;
+};
+
+// Node i of a NodeArray
+BVHNode fetchNode(samplerBuffer nodes, int i) {
+	int p = i * 9;
+	BVHNode node;
+	node.pMin = fetchVec3(nodes, p);
+	node.pMax = fetchVec3(nodes, p + 3);
+	node.nPrimitives = int(texelFetch(nodes, p + 6).r);
+	node.axis = int(texelFetch(nodes, p + 7).r);
+	node.childOffset = int(texelFetch(nodes, p + 8).r);
+	return node;
+}
+
+// Primitives in the leaves of a BVH
+const int LEAF_SPHERES = 0;
+const int LEAF_TRIANGLES = 1;
+
+// Tests primitive i of the leaves. On a hit closer than tMax, tMax is the
+// distance and, for a triangle, uv its barycentric coordinates.
+bool hitPrimitive(int leafType, int i, Ray r, inout float tMax, inout vec2 uv) {
+	if (leafType == LEAF_TRIANGLES) {
+		int m = i * 24;
+		float t;
+		vec2 triUV;
+		if (!hitTriangle(fetchVec3(bvhMeshTexture, m), fetchVec3(bvhMeshTexture, m + 3),
+			fetchVec3(bvhMeshTexture, m + 6), r, tMax, t, triUV)) return false;
+		tMax = t;
+		uv = triUV;
+		return true;
+	}
+	float dis_t = hitSphere(fetchSphere(i), r);
+	if (dis_t > 0 && dis_t < tMax) {
+		tMax = dis_t;
+		return true;
+	}
+	return false;
+}
+
+// Closest primitive closer than tMax, the traversal of traverseBVH in BVHTree.h.
+// On a hit tMax is the distance, primId the primitive and uv as in hitPrimitive.
+bool traverseBVH(samplerBuffer nodes, int leafType, Ray r, inout float tMax, out int primId, out vec2 uv) {
+	bool hit = false;
+	vec3 invDir = 1.0 / r.direction;
+	int nodesToVisit[64];
+	int toVisitOffset = 0;
+	int currentNodeIndex = 0;
+	while (true) {
+		BVHNode node = fetchNode(nodes, currentNodeIndex);
+		if (hitBox(node.pMin, node.pMax, r, invDir, tMax)) {
+			if (node.nPrimitives > 0) {
+				for (int i = 0; i < node.nPrimitives; ++i) {
+					if (hitPrimitive(leafType, node.childOffset + i, r, tMax, uv)) {
+						hit = true;
+						primId = node.childOffset + i;
+					}
+				}
+				if (toVisitOffset == 0) break;
+				currentNodeIndex = nodesToVisit[--toVisitOffset];
+			}
+			else {
+				// Visit the near child first
+				if (invDir[node.axis] < 0.0) {
+					nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
+					currentNodeIndex = node.childOffset;
+				}
+				else {
+					nodesToVisit[toVisitOffset++] = node.childOffset;
+					currentNodeIndex = currentNodeIndex + 1;
+				}
+			}
+		}
+		else {
+			if (toVisitOffset == 0) break;
+			currentNodeIndex = nodesToVisit[--toVisitOffset];
+		}
+	}
+	return hit;
+}
+
+// Closest triangle closer than tMax
+bool hitMesh(Ray r, inout float tMax, out int primId, out vec2 uv) {
+	return traverseBVH(bvhNodeTexture, LEAF_TRIANGLES, r, tMax, primId, uv);
+}
+
+// Closest sphere closer than tMax
+bool hitSpheres(Ray r, inout float tMax, out int sphereId) {
+	vec2 uv;
+	return traverseBVH(sphereNodeTexture, LEAF_SPHERES, r, tMax, sphereId, uv);
+}
+
 // ֵray򽻵ľ
 bool hitWorld(Ray r, int index) {
 	float dis = 100000;
-	bool hitAnything = false;
 	int hitSphereIndex;
-	for (int i = 0; i < sphereNum; i++) {
-		float dis_t = hitSphere(sphere[i], r);
-		if (dis_t > 0 && dis_t < dis) {
-			dis = dis_t;
-			hitSphereIndex = i;
-			hitAnything = true;
-		}
+	bool hitAnything = sphereNum > 0 && hitSpheres(r, dis, hitSphereIndex);
+	int primId;
+	vec2 uv;
+	bool meshHit = meshNum > 0 && hitMesh(r, dis, primId, uv);
+	if (meshHit) {
+		// Interpolated normal facing the ray. The hit point is moved off the
+		// surface so that the next ray does not hit the same triangle again.
+		int m = primId * 24;
+		vec3 v0 = fetchVec3(bvhMeshTexture, m);
+		vec3 geoNormal = normalize(cross(fetchVec3(bvhMeshTexture, m + 3) - v0, fetchVec3(bvhMeshTexture, m + 6) - v0));
+		vec3 n = (1.0 - uv.x - uv.y) * fetchVec3(bvhMeshTexture, m + 9) + uv.x * fetchVec3(bvhMeshTexture, m + 12)
+			+ uv.y * fetchVec3(bvhMeshTexture, m + 15);
+		rec.Normal = length(n) > 0.0 ? normalize(n) : geoNormal;
+		if (dot(rec.Normal, r.direction) > 0.0) rec.Normal = -rec.Normal;
+		if (dot(geoNormal, r.direction) > 0.0) geoNormal = -geoNormal;
+		rec.Pos = r.origin + dis * r.direction + 1e-4 * geoNormal;
+		rec.albedo = meshAlbedo;
+		rec.materialIndex = meshMaterialIndex;
 	}
-	if (hitAnything) {
+	else if (hitAnything) {
+		Sphere s = fetchSphere(hitSphereIndex);
 		rec.Pos = r.origin + dis * r.direction;
-		rec.Normal = normalize(r.origin + dis * r.direction - sphere[hitSphereIndex].center);
-		rec.albedo = sphere[hitSphereIndex].albedo;
-		rec.materialIndex = sphere[hitSphereIndex].materialIndex;
+		rec.Normal = normalize(r.origin + dis * r.direction - s.center);
+		rec.albedo = s.albedo;
+		rec.materialIndex = s.materialIndex;
+	}
+	if (meshHit || hitAnything) {
 		if(index == 0){
 			FragDepth = dis;
 			FragNormal = rec.Normal;
@@ -0,0 +1,130 @@
+#version 330 core
+layout(location = 0) out vec4 FragColor;
+layout(location = 1) out int FragCount;
+layout(location = 2) out float luminance1;
+layout(location = 3) out float luminance2;
+
+in vec2 TexCoords;
+
+// Temporal resolve of the temporal denoiser. The history of every pixel is
+// reprojected from the last frame, clamped to the color distribution of the
+// 3x3 neighbourhood of the new samples so that stale history cannot linger
+// as ghosts, and blended with the new sample by 1 / n, n the history length
+// of the pixel up to maxHistory: a plain mean of the first maxHistory
+// frames, then an exponential moving average.
+struct Camera {
+	vec3 camPos;
+	vec3 front;
+	vec3 right;
+	vec3 up;
+	float halfH;
+	float halfW;
+	vec3 leftbottom;
+	int LoopNum;
+};
+uniform Camera camera;
+// Camera of the last frame, the history. historyValid is false until a frame
+// has been rendered.
+uniform Camera prevCamera;
+uniform bool historyValid;
+uniform int maxHistory;
+// Width of the clamping box in standard deviations of the neighbourhood
+uniform float clampGamma;
+
+// Frame of the ray tracer
+uniform sampler2D sampleTexture;
+uniform sampler2D depthTexture;
+uniform sampler2D normalTexture;
+// Last frame
+uniform sampler2D historyTexture;
+uniform sampler2D historyDepthTexture;
+uniform sampler2D historyNormalTexture;
+uniform isampler2D historyCountTexture;
+uniform sampler2D historyluminance1Texture;
+uniform sampler2D historyluminance2Texture;
+
+// Reprojects the surface at pos into the last frame and fetches its history
+// bilinearly, from the taps of the four around it that saw the same surface.
+// Returns false, a disocclusion, if none did.
+bool reprojectHistory(vec3 pos, vec3 normal, out vec3 color, out float count, out vec2 moments) {
+	color = vec3(0.0);
+	count = 0.0;
+	moments = vec2(0.0);
+	vec3 d = pos - prevCamera.camPos;
+	float z = dot(d, prevCamera.front);
+	if (z <= 0.0) return false;
+	vec2 uv = 0.5 + 0.5 * vec2(dot(d, prevCamera.right) / (z * prevCamera.halfW), dot(d, prevCamera.up) / (z * prevCamera.halfH));
+	ivec2 size = textureSize(historyTexture, 0);
+	vec2 p = uv * vec2(size) - 0.5;
+	ivec2 p0 = ivec2(floor(p));
+	vec2 f = p - vec2(p0);
+	// The depth of a neighbouring pixel differs more on a surface seen edge on
+	float prevDepth = length(d);
+	float cosine = abs(dot(normal, d)) / prevDepth;
+	float depthTolerance = 0.01 * prevDepth / max(cosine, 0.1);
+	float weightSum = 0.0;
+	for (int i = 0; i < 4; i++) {
+		ivec2 offset = ivec2(i & 1, i >> 1);
+		ivec2 q = p0 + offset;
+		if (any(lessThan(q, ivec2(0))) || any(greaterThanEqual(q, size))) continue;
+		float histDepth = texelFetch(historyDepthTexture, q, 0).r;
+		vec3 histNormal = texelFetch(historyNormalTexture, q, 0).rgb;
+		if (abs(histDepth - prevDepth) > depthTolerance || dot(normal, histNormal) < 0.95) continue;
+		float w = (offset.x == 1 ? f.x : 1.0 - f.x) * (offset.y == 1 ? f.y : 1.0 - f.y);
+		color += w * texelFetch(historyTexture, q, 0).rgb;
+		count += w * float(texelFetch(historyCountTexture, q, 0).r);
+		moments += w * vec2(texelFetch(historyluminance1Texture, q, 0).r, texelFetch(historyluminance2Texture, q, 0).r);
+		weightSum += w;
+	}
+	if (weightSum < 0.01) return false;
+	color /= weightSum;
+	count /= weightSum;
+	moments /= weightSum;
+	return true;
+}
+
+void main() {
+	ivec2 p = ivec2(gl_FragCoord.xy);
+	ivec2 size = textureSize(sampleTexture, 0);
+	vec3 color = texelFetch(sampleTexture, p, 0).rgb;
+	float depth = texelFetch(depthTexture, p, 0).r;
+	vec3 normal = texelFetch(normalTexture, p, 0).rgb;
+	float luminance = color.x*0.30+color.y*0.59+color.z*0.11;
+
+	vec3 hist;
+	float histCount;
+	vec2 histMoments;
+	// A miss has no surface to reproject, and the sky needs no history
+	vec3 direction = normalize(camera.leftbottom + (TexCoords.x * 2.0 * camera.halfW) * camera.right + (TexCoords.y * 2.0 * camera.halfH) * camera.up);
+	bool valid = historyValid && dot(normal, normal) > 0.0
+		&& reprojectHistory(camera.camPos + depth * direction, normal, hist, histCount, histMoments);
+	if (!valid) {
+		FragColor = vec4(color, 1.0);
+		FragCount = 1;
+		luminance1 = luminance;
+		luminance2 = luminance * luminance;
+		return;
+	}
+
+	// Mean and standard deviation of the new samples around the pixel
+	vec3 m1 = vec3(0.0);
+	vec3 m2 = vec3(0.0);
+	for (int y = -1; y <= 1; y++) {
+		for (int x = -1; x <= 1; x++) {
+			vec3 c = texelFetch(sampleTexture, clamp(p + ivec2(x, y), ivec2(0), size - 1), 0).rgb;
+			m1 += c;
+			m2 += c * c;
+		}
+	}
+	m1 /= 9.0;
+	m2 /= 9.0;
+	vec3 sigma = sqrt(max(vec3(0.0), m2 - m1 * m1));
+	hist = clamp(hist, m1 - clampGamma * sigma, m1 + clampGamma * sigma);
+
+	int n = min(int(histCount + 0.5) + 1, max(1, maxHistory));
+	float alpha = 1.0 / float(n);
+	FragColor = vec4(mix(hist, color, alpha), 1.0);
+	FragCount = n;
+	luminance1 = mix(histMoments.x, luminance, alpha);
+	luminance2 = mix(histMoments.y, luminance * luminance, alpha);
+}
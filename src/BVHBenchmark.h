@@ -0,0 +1,152 @@
+#pragma once
+#ifndef BVHBENCHMARK_H
+#define BVHBENCHMARK_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <random>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "CompactBVH.h"
+#include "Geometry.h"
+
+/**
+ * Ray sets and timing for the traversal microbenchmarks. Every traversal
+ * variant is run on the same rays, single threaded.
+ */
+
+// Primary rays of a size x size pinhole camera looking at the box down -z, in
+// 4x4 pixel tiles so that any 8 or 16 consecutive rays form a ray packet.
+// size should be a multiple of 4.
+inline std::vector<Ray> makePrimaryRays(const Bound3f &bound, int size) {
+	glm::vec3 center = 0.5f * (bound.pMin + bound.pMax);
+	float radius = 0.5f * glm::length(bound.Diagonal());
+	glm::vec3 eye = center + glm::vec3(0.0f, 0.0f, 3.0f * radius);
+	float half = 1.2f * radius;
+	std::vector<Ray> rays;
+	rays.reserve(size * size);
+	for (int tj = 0; tj < size; tj += 4) {
+		for (int ti = 0; ti < size; ti += 4) {
+			for (int j = tj; j < tj + 4; ++j) {
+				for (int i = ti; i < ti + 4; ++i) {
+					glm::vec3 target = center + glm::vec3(
+						half * (2.0f * (i + 0.5f) / size - 1.0f),
+						half * (2.0f * (j + 0.5f) / size - 1.0f), 0.0f);
+					rays.push_back({ eye, glm::normalize(target - eye) });
+				}
+			}
+		}
+	}
+	return rays;
+}
+
+// Mirror bounces of the rays that hit the mesh, in the order of rays. Misses
+// are dropped, so neighbouring rays stay mostly neighbours.
+inline std::vector<Ray> makeMirrorRays(const CompactBVH &bvh, const std::vector<Ray> &rays) {
+	std::vector<Ray> mirrorRays;
+	mirrorRays.reserve(rays.size());
+	for (const Ray &ray : rays) {
+		float tHit;
+		int primId;
+		if (!IntersectCompactBVH(bvh, ray, tHit, primId)) continue;
+		const uint32_t *tri = &bvh.indices[3 * primId];
+		const glm::vec3 &v0 = bvh.vertices[tri[0]];
+		glm::vec3 n = glm::normalize(glm::cross(bvh.vertices[tri[1]] - v0, bvh.vertices[tri[2]] - v0));
+		if (glm::dot(n, ray.direction) > 0.0f) n = -n;
+		glm::vec3 dir = ray.direction - 2.0f * glm::dot(ray.direction, n) * n;
+		mirrorRays.push_back({ ray.origin + tHit * ray.direction + 1e-4f * n, dir });
+	}
+	return mirrorRays;
+}
+
+// Incoherent rays from the bounding sphere towards random points in the box
+inline std::vector<Ray> makeRandomRays(const Bound3f &bound, int count, unsigned int seed = 1) {
+	std::mt19937 rng(seed);
+	std::uniform_real_distribution<float> uni(0.0f, 1.0f);
+	glm::vec3 center = 0.5f * (bound.pMin + bound.pMax);
+	float radius = 0.5f * glm::length(bound.Diagonal());
+	std::vector<Ray> rays(count);
+	for (Ray &ray : rays) {
+		float z = 2.0f * uni(rng) - 1.0f;
+		float phi = 6.2831853f * uni(rng);
+		float r = sqrtf(glm::max(0.0f, 1.0f - z * z));
+		glm::vec3 origin = center + 1.5f * radius * glm::vec3(r * cosf(phi), r * sinf(phi), z);
+		glm::vec3 target = bound.pMin + bound.Diagonal() * glm::vec3(uni(rng), uni(rng), uni(rng));
+		ray = { origin, glm::normalize(target - origin) };
+	}
+	return rays;
+}
+
+// Rays aimed at the midpoints of the edges shared by two triangles, from
+// directions where the edge is not on the silhouette. The two triangles then
+// cover the midpoint, so a miss means the ray slipped through a crack.
+inline std::vector<Ray> makeEdgeRays(const std::vector<glm::vec3> &vertices,
+	const std::vector<uint32_t> &indices, int count, unsigned int seed = 1) {
+	std::map<std::pair<uint32_t, uint32_t>, std::vector<int>> edgeTriangles;
+	for (size_t i = 0; i + 3 <= indices.size(); i += 3) {
+		for (int k = 0; k < 3; ++k) {
+			uint32_t a = indices[i + k], b = indices[i + (k + 1) % 3];
+			edgeTriangles[std::make_pair(std::min(a, b), std::max(a, b))].push_back((int)i / 3);
+		}
+	}
+	struct Edge {
+		glm::vec3 midpoint;
+		glm::vec3 n0, n1;
+	};
+	auto faceNormal = [&](int tri) {
+		const uint32_t *v = &indices[3 * tri];
+		return glm::cross(vertices[v[1]] - vertices[v[0]], vertices[v[2]] - vertices[v[0]]);
+	};
+	std::vector<Edge> edges;
+	for (const auto &e : edgeTriangles) {
+		if (e.second.size() != 2) continue;
+		Edge edge;
+		edge.midpoint = 0.5f * (vertices[e.first.first] + vertices[e.first.second]);
+		edge.n0 = faceNormal(e.second[0]);
+		edge.n1 = faceNormal(e.second[1]);
+		edges.push_back(edge);
+	}
+	std::vector<Ray> rays;
+	if (edges.empty()) return rays;
+
+	Bound3f bound;
+	for (const glm::vec3 &v : vertices)
+		bound = Union(bound, v);
+	glm::vec3 center = 0.5f * (bound.pMin + bound.pMax);
+	float radius = 0.5f * glm::length(bound.Diagonal());
+	std::mt19937 rng(seed);
+	std::uniform_real_distribution<float> uni(0.0f, 1.0f);
+	rays.reserve(count);
+	for (int i = 0; (int)rays.size() < count && i < 16 * count; ++i) {
+		const Edge &e = edges[i % edges.size()];
+		float z = 2.0f * uni(rng) - 1.0f;
+		float phi = 6.2831853f * uni(rng);
+		float r = sqrtf(glm::max(0.0f, 1.0f - z * z));
+		glm::vec3 origin = center + 1.5f * radius * glm::vec3(r * cosf(phi), r * sinf(phi), z);
+		glm::vec3 dir = glm::normalize(e.midpoint - origin);
+		if (glm::dot(e.n0, dir) * glm::dot(e.n1, dir) <= 0.0f) continue;
+		rays.push_back({ origin, dir });
+	}
+	return rays;
+}
+
+// Seconds per call of pass, repeated until at least minTime has elapsed
+template<typename F>
+inline double timePass(F pass, double minTime = 0.25) {
+	pass(); // warm up caches
+	int reps = 0;
+	auto start = std::chrono::steady_clock::now();
+	double elapsed = 0.0;
+	do {
+		pass();
+		reps++;
+		elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	} while (elapsed < minTime);
+	return elapsed / reps;
+}
+
+#endif
@@ -0,0 +1,74 @@
+#pragma once
+#ifndef BVHBUFFER_H
+#define BVHBUFFER_H
+
+#include <iostream>
+#include <vector>
+
+#define GLEW_STATIC
+#include <GL/glew.h>
+
+#include "BVHTree.h"
+
+/**
+ * NodeArray and MeshArray of a BVHTree as two GL_R32F buffer textures, read
+ * with texelFetch by the ray tracer. Node i starts at texel 9 * i and
+ * triangle i at texel 24 * i, the layout of BVHTree.
+ */
+class BVHBuffer {
+public:
+	BVHBuffer() : nodeNum(0), meshNum(0) {}
+
+	// Returns false and creates nothing if the BVH does not fit in a buffer texture
+	bool Init(const BVHTree &bvhTree) {
+		GLint maxTexels = 0;
+		glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &maxTexels);
+		if ((GLint)bvhTree.NodeArray.size() > maxTexels || (GLint)bvhTree.MeshArray.size() > maxTexels) {
+			std::cerr << "BVH does not fit in a buffer texture of " << maxTexels << " texels" << std::endl;
+			return false;
+		}
+		nodeNum = bvhTree.nodeNum;
+		meshNum = bvhTree.meshNum;
+		createBuffer(bvhTree.NodeArray, nodeBuffer, nodeTexture);
+		createBuffer(bvhTree.MeshArray, meshBuffer, meshTexture);
+		return true;
+	}
+
+	// Binds the node texture to texture unit nodeUnit and the mesh texture to meshUnit
+	void BindAsTexture(int nodeUnit, int meshUnit) {
+		glActiveTexture(GL_TEXTURE0 + nodeUnit);
+		glBindTexture(GL_TEXTURE_BUFFER, nodeTexture);
+		glActiveTexture(GL_TEXTURE0 + meshUnit);
+		glBindTexture(GL_TEXTURE_BUFFER, meshTexture);
+		glActiveTexture(GL_TEXTURE0);
+	}
+
+	void Delete() {
+		glDeleteTextures(1, &nodeTexture);
+		glDeleteTextures(1, &meshTexture);
+		glDeleteBuffers(1, &nodeBuffer);
+		glDeleteBuffers(1, &meshBuffer);
+	}
+
+	int getNodeNum() const { return nodeNum; }
+	int getMeshNum() const { return meshNum; }
+
+private:
+	void createBuffer(const std::vector<float> &data, GLuint &buffer, GLuint &texture) {
+		glGenBuffers(1, &buffer);
+		glBindBuffer(GL_TEXTURE_BUFFER, buffer);
+		glBufferData(GL_TEXTURE_BUFFER, data.size() * sizeof(float), data.data(), GL_STATIC_DRAW);
+		glGenTextures(1, &texture);
+		glBindTexture(GL_TEXTURE_BUFFER, texture);
+		glTexBuffer(GL_TEXTURE_BUFFER, GL_R32F, buffer);
+		glBindTexture(GL_TEXTURE_BUFFER, 0);
+		glBindBuffer(GL_TEXTURE_BUFFER, 0);
+	}
+
+	int nodeNum;
+	int meshNum;
+	GLuint nodeBuffer, meshBuffer;
+	GLuint nodeTexture, meshTexture;
+};
+
+#endif
@@ -6,15 +6,23 @@
 #include "glm/gtc/matrix_transform.hpp"
 #include "glm/gtc/type_ptr.hpp"
 
-#include "../Source/Shape.h"
-#include "../Source/Camera.h"
+#include "Geometry.h"
+#include "Shape.h"
+#include "Camera.h"
+#include "Sphere.h"
+#include "ThreadPool.h"
+#include "TraceEvents.h"
 
 #include <algorithm>
+#include <array>
+#include <cassert>
+#include <atomic>
+#include <chrono>
 #include <vector>
 #include <memory>
 #include <iostream>
 
-int totalPrimitives = 0;
+inline std::atomic<int> totalPrimitives(0);
 
 // ݽṹ
 
@@ -40,6 +48,25 @@ struct BVHNode {
 	}
 };
 
+// Monotonic allocator for the build-time tree. A binary tree over n
+// primitives has at most 2n - 1 nodes, so a single block is reserved up
+// front and the whole tree is released at once with the arena.
+class BVHNodeArena {
+public:
+	explicit BVHNodeArena(size_t capacity) :
+		nodes(new BVHNode[capacity]), capacity(capacity), used(0) {}
+	BVHNode *alloc() {
+		size_t index = used++;
+		assert(index < capacity);
+		return &nodes[index];
+	}
+	int size() const { return (int)used.load(); }
+private:
+	std::unique_ptr<BVHNode[]> nodes;
+	size_t capacity;
+	std::atomic<size_t> used;
+};
+
 struct LinearBVHNode {
 	glm::vec3 pMin, pMax;
 	float nPrimitives;
@@ -47,12 +74,12 @@ struct LinearBVHNode {
 	float childOffset; //ڶӽڵλ  Ԫʼλ
 };
 
-void setBound(LinearBVHNode & lb, const Bound3f& bound) {
+inline void setBound(LinearBVHNode & lb, const Bound3f& bound) {
 	lb.pMax = bound.pMax;
 	lb.pMin = bound.pMin;
 }
 
-void getBound(const LinearBVHNode & lb, Bound3f& bound) {
+inline void getBound(const LinearBVHNode & lb, Bound3f& bound) {
 	bound.pMax = lb.pMax;
 	bound.pMin = lb.pMin;
 }
@@ -73,29 +100,60 @@ struct BucketInfo {
 	Bound3f bounds;
 };
 
+enum BVH_SplitMethod {
+	SPLIT_MEDIAN,
+	SPLIT_SAH
+};
+
+// Quality of a built tree, the SAH cost is relative to the root bound
+struct BVHStats {
+	int interiorNum = 0;
+	int leafNum = 0;
+	int maxDepth = 0;
+	int maxLeafPrims = 0;
+	float sahCost = 0.0f;
+	double buildTime = 0.0;
+};
+
 
 // BVH
 
 class BVHTree {
 public:
-	int nodeNum;
+	int nodeNum = 0;
 	int nodeNumX, nodeNumY;
-	float *NodeArray;
+	std::vector<float> NodeArray;
 
-	LinearBVHNode *nodes = nullptr;
 	std::vector<std::shared_ptr<Triangle>> primitives;
 
-	int meshNum;
+	int meshNum = 0;
 	int meshNumX, meshNumY;
-	float *MeshArray;
+	std::vector<float> MeshArray;
 
-	int maxPrimsInNode = 1;
+	BVH_SplitMethod splitMethod = SPLIT_SAH;
+	int maxPrimsInNode = 4;
+	// SAH parameters, cost of one node traversal vs. one triangle test
+	static constexpr int nBuckets = 12;
+	float traversalCost = 0.125f;
+	float intersectCost = 1.0f;
+	// Build subtrees with more primitives than parallelThreshold as separate tasks
+	bool parallelBuild = false;
+	int parallelThreshold = 4096;
+	int buildThreadNum = 0;
+
+	BVHStats stats;
 
 	BVHTree() {}
+	// The node and mesh arrays can be large, the tree is moved but never copied
+	BVHTree(const BVHTree &) = delete;
+	BVHTree &operator=(const BVHTree &) = delete;
+	BVHTree(BVHTree &&) = default;
+	BVHTree &operator=(BVHTree &&) = default;
 
 	void releaseAll() {
-		delete[] NodeArray; NodeArray = nullptr;
-		delete[] MeshArray; MeshArray = nullptr;
+		std::vector<float>().swap(NodeArray);
+		std::vector<float>().swap(MeshArray);
+		primitives.clear();
 		nodeNum = 0;
 		meshNum = 0;
 	}
@@ -103,27 +161,17 @@ public:
 	void BVHBuildTree(std::vector<std::shared_ptr<Triangle>> p) {
 		primitives = std::move(p);
 		if (primitives.empty()) return;
-		// Initialize primitives
-		std::vector<BVHPrimitiveInfo> primitiveInfo(primitives.size());
+		std::vector<Bound3f> bounds(primitives.size());
 		for (size_t i = 0; i < primitives.size(); ++i)
-			primitiveInfo[i] = { i, getTriangleBound(*primitives[i])};
+			bounds[i] = getTriangleBound(*primitives[i]);
+		std::vector<size_t> order = buildNodes(bounds);
+		std::cout << "nodeNumX = " << nodeNumX << " nodeNumY = " << nodeNumY << std::endl;
 
-		// Build BVH tree
-		int totalNodes = 0;
 		std::vector<std::shared_ptr<Triangle>> orderedPrims;
 		orderedPrims.reserve(primitives.size());
-
-		BVHNode *root;
-		root = recursiveBuild(primitiveInfo, 0, primitives.size(),
-			&totalNodes, orderedPrims);
+		for (size_t i : order)
+			orderedPrims.push_back(primitives[i]);
 		primitives.swap(orderedPrims);
-		primitiveInfo.resize(0);
-
-		// Compute representation of depth-first traversal of BVH tree
-		nodeNum = totalNodes;
-		nodes = new LinearBVHNode[totalNodes];
-		int offset = 0;
-		flattenBVHTree(root, &offset);
 
 		meshNum = primitives.size();
 		int meshNumSize = meshNum * (9 + 9 + 6);
@@ -132,7 +180,7 @@ public:
 		meshNumY = ceilf((float)meshNumSize / (float)meshNumX);
 		std::cout << "meshNumX = " << meshNumX << " meshNumY = " << meshNumY << std::endl;
 
-		MeshArray = new float[(meshNumX * meshNumY) * (9 + 9 + 6)];
+		MeshArray.assign(meshNumX * meshNumY, 0.0f);
 		// 㸳ֵ
 		for (int i = 0; i < meshNum; i++) {
 			MeshArray[i * (9 + 9 + 6) + 0] = primitives[i]->v0.x;
@@ -144,120 +192,455 @@ public:
 			MeshArray[i * (9 + 9 + 6) + 6] = primitives[i]->v2.x;
 			MeshArray[i * (9 + 9 + 6) + 7] = primitives[i]->v2.y;
 			MeshArray[i * (9 + 9 + 6) + 8] = primitives[i]->v2.z;
+			MeshArray[i * (9 + 9 + 6) + 9] = primitives[i]->n0.x;
+			MeshArray[i * (9 + 9 + 6) + 10] = primitives[i]->n0.y;
+			MeshArray[i * (9 + 9 + 6) + 11] = primitives[i]->n0.z;
+			MeshArray[i * (9 + 9 + 6) + 12] = primitives[i]->n1.x;
+			MeshArray[i * (9 + 9 + 6) + 13] = primitives[i]->n1.y;
+			MeshArray[i * (9 + 9 + 6) + 14] = primitives[i]->n1.z;
+			MeshArray[i * (9 + 9 + 6) + 15] = primitives[i]->n2.x;
+			MeshArray[i * (9 + 9 + 6) + 16] = primitives[i]->n2.y;
+			MeshArray[i * (9 + 9 + 6) + 17] = primitives[i]->n2.z;
 		}
+	}
 
-		int nodeNumSize = nodeNum * (9);
-		float Node_x_f = sqrtf(nodeNumSize);
-		nodeNumX = ceilf(Node_x_f);
-		nodeNumY = ceilf((float)nodeNumSize / (float)nodeNumX);
-		std::cout << "nodeNumX = " << nodeNumX << " nodeNumY = " << nodeNumY << std::endl;
+	// Builds a tree over spheres instead of triangles. MeshArray then holds
+	// SPHERE_FLOATS floats per sphere, in leaf order: center, radius, albedo
+	// and materialIndex.
+	void BVHBuildSpheres(const std::vector<Sphere> &spheres) {
+		primitives.clear();
+		std::vector<float>().swap(NodeArray);
+		std::vector<float>().swap(MeshArray);
+		nodeNum = 0;
+		meshNum = 0;
+		if (spheres.empty()) return;
+		std::vector<Bound3f> bounds(spheres.size());
+		for (size_t i = 0; i < spheres.size(); ++i) {
+			glm::vec3 r(spheres[i].radius);
+			bounds[i] = Bound3f(spheres[i].center - r, spheres[i].center + r);
+		}
+		std::vector<size_t> order = buildNodes(bounds);
 
-		NodeArray = new float[(nodeNumX * nodeNumY)];
-		for (int i = 0; i < nodeNum; i++) {
-			NodeArray[i * (9) + 0] = nodes[i].pMin.x;
-			NodeArray[i * (9) + 1] = nodes[i].pMin.y;
-			NodeArray[i * (9) + 2] = nodes[i].pMin.z;
-			NodeArray[i * (9) + 3] = nodes[i].pMax.x;
-			NodeArray[i * (9) + 4] = nodes[i].pMax.y;
-			NodeArray[i * (9) + 5] = nodes[i].pMax.z;
+		meshNum = (int)spheres.size();
+		MeshArray.assign(meshNum * SPHERE_FLOATS, 0.0f);
+		for (int i = 0; i < meshNum; i++) {
+			const Sphere &s = spheres[order[i]];
+			float *m = &MeshArray[i * SPHERE_FLOATS];
+			m[0] = s.center.x; m[1] = s.center.y; m[2] = s.center.z;
+			m[3] = s.radius;
+			m[4] = s.albedo.x; m[5] = s.albedo.y; m[6] = s.albedo.z;
+			m[7] = (float)s.materialIndex;
+		}
+	}
 
-			//std::cout << nodes[i].pMin.x << " " << nodes[i].pMin.y << " " << nodes[i].pMin.z << " " <<	nodes[i].pMax.x << " " << nodes[i].pMax.y << " " << nodes[i].pMax.z << " " << std::endl;
+	static const int SPHERE_FLOATS = 8;
 
-			NodeArray[i * (9) + 6] = nodes[i].nPrimitives;
-			NodeArray[i * (9) + 7] = nodes[i].axis;
-			NodeArray[i * (9) + 8] = nodes[i].childOffset;
-		}
+	// Builds and flattens the nodes over the primitive bounds. Returns the
+	// primitive, as an index in bounds, of each leaf slot.
+	std::vector<size_t> buildNodes(const std::vector<Bound3f> &bounds) {
+		TRACE_SCOPE("BVH build");
+		auto startTime = std::chrono::steady_clock::now();
+		std::vector<BVHPrimitiveInfo> primitiveInfo(bounds.size());
+		for (size_t i = 0; i < bounds.size(); ++i)
+			primitiveInfo[i] = { i, bounds[i] };
 
-		delete[] nodes;
-		nodes = nullptr;
+		// Build BVH tree
+		BVHNodeArena arena(2 * bounds.size() - 1);
+		if (parallelBuild)
+			buildPool = std::make_unique<ThreadPool>(buildThreadNum);
 
+		BVHNode *root;
+		root = recursiveBuild(primitiveInfo, 0, bounds.size(), arena);
+		buildPool.reset();
+
+		// Leaves reference the range of primitiveInfo they were built from
+		std::vector<size_t> order(primitiveInfo.size());
+		for (size_t i = 0; i < primitiveInfo.size(); ++i)
+			order[i] = primitiveInfo[i].primitiveNumber;
+		primitiveInfo.resize(0);
+
+		// Compute representation of depth-first traversal of BVH tree,
+		// written straight into the node texture data
+		nodeNum = arena.size();
+		int nodeNumSize = nodeNum * (9);
+		float Node_x_f = sqrtf(nodeNumSize);
+		nodeNumX = ceilf(Node_x_f);
+		nodeNumY = ceilf((float)nodeNumSize / (float)nodeNumX);
+
+		NodeArray.assign(nodeNumX * nodeNumY, 0.0f);
+		int offset = 0;
+		flattenBVHTree(root, &offset);
+		stats.buildTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+		computeStats();
+		return order;
 	}
 
 	BVHNode *recursiveBuild(std::vector<BVHPrimitiveInfo> &primitiveInfo,
-		int start, int end, int *totalNodes,
-		std::vector<std::shared_ptr<Triangle>> &orderedPrims) {
+		int start, int end, BVHNodeArena &arena) {
 
-		BVHNode* node = new BVHNode;
-		(*totalNodes)++;
+		BVHNode* node = arena.alloc();
 		// BVHڵлԪı߽
-		Bound3f bounds;
-		for (int i = start; i < end; ++i)
-			bounds = Union(bounds, primitiveInfo[i].bound);
+		Bound3f bounds, centroidBounds;
+		computeBounds(primitiveInfo, start, end, bounds, centroidBounds);
 		int nPrimitives = end - start;
-		if (nPrimitives == 1) {
+		if (nPrimitives == 1 || (splitMethod == SPLIT_MEDIAN && nPrimitives <= maxPrimsInNode)) {
 			// Ҷڵ
-			int firstPrimOffset = orderedPrims.size();
-			for (int i = start; i < end; ++i) {
-				int primNum = primitiveInfo[i].primitiveNumber;
-				orderedPrims.push_back(primitives[primNum]);
-			}
-			node->InitLeaf(firstPrimOffset, nPrimitives, bounds);
-			return node;
+			return createLeaf(node, start, end, bounds);
 		}
 		else {
 			// ȼԪı߽磬ѡڻֵά
-			Bound3f centroidBounds;
-			for (int i = start; i < end; ++i)
-				centroidBounds = Union(centroidBounds, primitiveInfo[i].centroid);
 			int dim = centroidBounds.MaximumExtent();
 
 			// ѻԪֵӼӽڵ
-			int mid = (start + end) / 2;
-			if (centroidBounds.pMax[dim] == centroidBounds.pMin[dim]) {
-				// Ҷڵ
-				int firstPrimOffset = orderedPrims.size();
-				for (int i = start; i < end; ++i) {
-					int primNum = primitiveInfo[i].primitiveNumber;
-					orderedPrims.push_back(primitives[primNum]);
-				}
-				node->InitLeaf(firstPrimOffset, nPrimitives, bounds);
-				return node;
-			}
-			else {
+			int mid = -1;
+			if (centroidBounds.pMax[dim] != centroidBounds.pMin[dim]) {
 				// splitԪΪ
-				{
+				switch (splitMethod) {
+				case SPLIT_SAH:
+					mid = splitSAH(primitiveInfo, start, end, dim, bounds, centroidBounds);
+					break;
+				case SPLIT_MEDIAN:
+				default:
 					mid = (start + end) / 2;
 					std::nth_element(&primitiveInfo[start], &primitiveInfo[mid],
 						&primitiveInfo[end - 1] + 1,
 						[dim](const BVHPrimitiveInfo &a, const BVHPrimitiveInfo &b) {
 						return a.centroid[dim] < b.centroid[dim];
 					});
+					break;
 				}
-				node->InitInterior(dim,
-					recursiveBuild(primitiveInfo, start, mid,
-						totalNodes, orderedPrims),
-					recursiveBuild(primitiveInfo, mid, end,
-						totalNodes, orderedPrims));
 			}
+			if (mid < 0) {
+				// No split separates the centroids. A small range is a leaf; a
+				// larger one, such as many coincident triangles, is halved by
+				// index so that no leaf outgrows maxPrimsInNode and the 16 bit
+				// leaf counts of CompactBVH.
+				if (nPrimitives <= maxPrimsInNode)
+					return createLeaf(node, start, end, bounds);
+				mid = (start + end) / 2;
+			}
+			BVHNode *children[2];
+			if (buildPool && nPrimitives >= parallelThreshold) {
+				TaskGroup group(*buildPool);
+				group.run([&]() {
+					children[0] = recursiveBuild(primitiveInfo, start, mid, arena);
+				});
+				children[1] = recursiveBuild(primitiveInfo, mid, end, arena);
+				group.wait();
+			}
+			else {
+				children[0] = recursiveBuild(primitiveInfo, start, mid, arena);
+				children[1] = recursiveBuild(primitiveInfo, mid, end, arena);
+			}
+			node->InitInterior(dim, children[0], children[1]);
 		}
+		return node;
+	}
+
+	BVHNode *createLeaf(BVHNode *node, int start, int end, const Bound3f &bounds) {
+		node->InitLeaf(start, end - start, bounds);
+		return node;
+	}
+
+	// Bounds of the primitives and of their centroids, reduced over chunks
+	// of the range when it is large enough to be split across threads
+	void computeBounds(const std::vector<BVHPrimitiveInfo> &primitiveInfo, int start, int end,
+		Bound3f &bounds, Bound3f &centroidBounds) {
+		int chunkNum = getChunkNum(start, end);
+		if (chunkNum == 1) {
+			for (int i = start; i < end; ++i) {
+				bounds = Union(bounds, primitiveInfo[i].bound);
+				centroidBounds = Union(centroidBounds, primitiveInfo[i].centroid);
+			}
+			return;
+		}
+		std::vector<Bound3f> chunkBounds(chunkNum), chunkCentroidBounds(chunkNum);
+		forEachChunk(start, end, chunkNum, [&](int c, int s, int e) {
+			for (int i = s; i < e; ++i) {
+				chunkBounds[c] = Union(chunkBounds[c], primitiveInfo[i].bound);
+				chunkCentroidBounds[c] = Union(chunkCentroidBounds[c], primitiveInfo[i].centroid);
+			}
+		});
+		for (int c = 0; c < chunkNum; ++c) {
+			bounds = Union(bounds, chunkBounds[c]);
+			centroidBounds = Union(centroidBounds, chunkCentroidBounds[c]);
+		}
+	}
+
+	// Binned SAH split along dim. Returns the partition point, or -1 if a
+	// leaf is cheaper than any split and small enough to be created
+	int splitSAH(std::vector<BVHPrimitiveInfo> &primitiveInfo, int start, int end,
+		int dim, const Bound3f &bounds, const Bound3f &centroidBounds) {
+		BucketInfo buckets[nBuckets];
+		int chunkNum = getChunkNum(start, end);
+		if (chunkNum == 1) {
+			fillBuckets(primitiveInfo, start, end, dim, centroidBounds, buckets);
+		}
+		else {
+			std::vector<std::array<BucketInfo, nBuckets>> chunkBuckets(chunkNum);
+			forEachChunk(start, end, chunkNum, [&](int c, int s, int e) {
+				fillBuckets(primitiveInfo, s, e, dim, centroidBounds, chunkBuckets[c].data());
+			});
+			for (int c = 0; c < chunkNum; ++c) {
+				for (int b = 0; b < nBuckets; ++b) {
+					buckets[b].count += chunkBuckets[c][b].count;
+					buckets[b].bounds = Union(buckets[b].bounds, chunkBuckets[c][b].bounds);
+				}
+			}
+		}
+
+		// Sweep from both sides to get the cost of splitting after each bucket
+		float cost[nBuckets - 1];
+		Bound3f b0;
+		int count0 = 0;
+		for (int i = 0; i < nBuckets - 1; ++i) {
+			b0 = Union(b0, buckets[i].bounds);
+			count0 += buckets[i].count;
+			cost[i] = count0 * b0.SurfaceArea();
+		}
+		Bound3f b1;
+		int count1 = 0;
+		for (int i = nBuckets - 1; i > 0; --i) {
+			b1 = Union(b1, buckets[i].bounds);
+			count1 += buckets[i].count;
+			cost[i - 1] += count1 * b1.SurfaceArea();
+		}
+
+		float invArea = 1.0f / bounds.SurfaceArea();
+		int minCostSplitBucket = -1;
+		float minCost = FLT_MAX;
+		count0 = 0;
+		for (int i = 0; i < nBuckets - 1; ++i) {
+			count0 += buckets[i].count;
+			if (count0 == 0 || count0 == end - start) continue;
+			float c = traversalCost + intersectCost * cost[i] * invArea;
+			if (c < minCost) {
+				minCost = c;
+				minCostSplitBucket = i;
+			}
+		}
+
+		int nPrimitives = end - start;
+		float leafCost = intersectCost * nPrimitives;
+		if (minCostSplitBucket < 0 || (nPrimitives <= maxPrimsInNode && leafCost <= minCost))
+			return -1;
+
+		return stablePartition(primitiveInfo, start, end, [=](const BVHPrimitiveInfo &pi) {
+			return bucketIndex(pi, dim, centroidBounds) <= minCostSplitBucket;
+		});
+	}
+
+	void fillBuckets(const std::vector<BVHPrimitiveInfo> &primitiveInfo, int start, int end,
+		int dim, const Bound3f &centroidBounds, BucketInfo *buckets) const {
+		for (int i = start; i < end; ++i) {
+			int b = bucketIndex(primitiveInfo[i], dim, centroidBounds);
+			buckets[b].count++;
+			buckets[b].bounds = Union(buckets[b].bounds, primitiveInfo[i].bound);
+		}
+	}
+
+	// Stable so that the serial and the parallel build order primitives
+	// identically. Large ranges are counted and scattered chunk by chunk.
+	template<typename Pred>
+	int stablePartition(std::vector<BVHPrimitiveInfo> &primitiveInfo, int start, int end, Pred pred) {
+		int chunkNum = getChunkNum(start, end);
+		if (chunkNum == 1) {
+			BVHPrimitiveInfo *pmid = std::stable_partition(&primitiveInfo[start], &primitiveInfo[end - 1] + 1, pred);
+			return pmid - &primitiveInfo[0];
+		}
+		std::vector<int> trueNum(chunkNum, 0);
+		forEachChunk(start, end, chunkNum, [&](int c, int s, int e) {
+			for (int i = s; i < e; ++i)
+				if (pred(primitiveInfo[i])) trueNum[c]++;
+		});
+		int totalTrue = 0;
+		for (int c = 0; c < chunkNum; ++c)
+			totalTrue += trueNum[c];
+		std::vector<int> trueOffset(chunkNum), falseOffset(chunkNum);
+		int trueSum = 0, falseSum = totalTrue;
+		for (int c = 0; c < chunkNum; ++c) {
+			trueOffset[c] = trueSum;
+			falseOffset[c] = falseSum;
+			trueSum += trueNum[c];
+			falseSum += chunkEnd(start, end, chunkNum, c) - chunkEnd(start, end, chunkNum, c - 1) - trueNum[c];
+		}
+		std::vector<BVHPrimitiveInfo> scattered(end - start);
+		forEachChunk(start, end, chunkNum, [&](int c, int s, int e) {
+			int t = trueOffset[c], f = falseOffset[c];
+			for (int i = s; i < e; ++i) {
+				if (pred(primitiveInfo[i])) scattered[t++] = primitiveInfo[i];
+				else scattered[f++] = primitiveInfo[i];
+			}
+		});
+		forEachChunk(start, end, chunkNum, [&](int /*c*/, int s, int e) {
+			std::copy(scattered.begin() + (s - start), scattered.begin() + (e - start), primitiveInfo.begin() + s);
+		});
+		return start + totalTrue;
+	}
+
+	// Number of chunks the parallel passes split [start, end) into, 1 when built serially
+	int getChunkNum(int start, int end) const {
+		if (!buildPool || end - start < parallelThreshold) return 1;
+		return std::max(1, std::min(buildPool->size() * 4, (end - start) / 1024));
+	}
+	int chunkEnd(int start, int end, int chunkNum, int c) const {
+		return start + (int)((long long)(end - start) * (c + 1) / chunkNum);
+	}
+	template<typename F>
+	void forEachChunk(int start, int end, int chunkNum, F f) {
+		if (chunkNum == 1) {
+			f(0, start, end);
+			return;
+		}
+		TaskGroup group(*buildPool);
+		for (int c = 0; c < chunkNum; ++c) {
+			int s = chunkEnd(start, end, chunkNum, c - 1);
+			int e = chunkEnd(start, end, chunkNum, c);
+			group.run([&f, c, s, e]() { f(c, s, e); });
+		}
+		group.wait();
+	}
+
+	int bucketIndex(const BVHPrimitiveInfo &pi, int dim, const Bound3f &centroidBounds) const {
+		int b = nBuckets * centroidBounds.Offset(pi.centroid)[dim];
+		if (b >= nBuckets) b = nBuckets - 1;
+		if (b < 0) b = 0;
+		return b;
+	}
+
+	void computeStats() {
+		stats.interiorNum = stats.leafNum = 0;
+		stats.maxDepth = stats.maxLeafPrims = 0;
+		stats.sahCost = 0.0f;
+		Bound3f rootBound;
+		getBound(getLinearNode(0), rootBound);
+		float invRootArea = 1.0f / rootBound.SurfaceArea();
+		// Depth first walk over the flattened nodes
+		std::vector<std::pair<int, int>> stack;
+		stack.push_back({ 0, 1 });
+		while (!stack.empty()) {
+			int index = stack.back().first;
+			int depth = stack.back().second;
+			stack.pop_back();
+			LinearBVHNode node = getLinearNode(index);
+			Bound3f bound;
+			getBound(node, bound);
+			float area = bound.SurfaceArea() * invRootArea;
+			stats.maxDepth = std::max(stats.maxDepth, depth);
+			if (node.nPrimitives > 0) {
+				stats.leafNum++;
+				stats.maxLeafPrims = std::max(stats.maxLeafPrims, (int)node.nPrimitives);
+				stats.sahCost += intersectCost * node.nPrimitives * area;
+			}
+			else {
+				stats.interiorNum++;
+				stats.sahCost += traversalCost * area;
+				stack.push_back({ index + 1, depth + 1 });
+				stack.push_back({ (int)node.childOffset, depth + 1 });
+			}
+		}
+	}
+
+	// True if both trees have the same nodes and the same primitive order
+	bool sameTree(const BVHTree &other) const {
+		if (nodeNum != other.nodeNum || meshNum != other.meshNum) return false;
+		return NodeArray == other.NodeArray && MeshArray == other.MeshArray;
+	}
+
+	void printStats() const {
+		std::cout << (splitMethod == SPLIT_SAH ? "SAH" : "median") << " BVH: "
+			<< meshNum << " triangles, " << nodeNum << " nodes ("
+			<< stats.interiorNum << " interior, " << stats.leafNum << " leaves), "
+			<< "max depth " << stats.maxDepth << ", max leaf size " << stats.maxLeafPrims
+			<< ", SAH cost " << stats.sahCost << ", built in " << stats.buildTime * 1000.0 << " ms" << std::endl;
 	}
 
 	int flattenBVHTree(BVHNode *node, int *offset) {
-		LinearBVHNode *linearNode = &nodes[*offset];
-		setBound(*linearNode, node->bound);
+		LinearBVHNode linearNode = {};
+		setBound(linearNode, node->bound);
 		int myOffset = (*offset)++;
 		if (node->nPrimitives > 0) {
-			linearNode->childOffset = node->firstPrimOffset;
-			linearNode->nPrimitives = node->nPrimitives;
+			linearNode.childOffset = node->firstPrimOffset;
+			linearNode.nPrimitives = node->nPrimitives;
 		}
 		else {
 			// Create interior flattened BVH node
-			linearNode->axis = node->splitAxis;
-			linearNode->nPrimitives = 0;
+			linearNode.axis = node->splitAxis;
+			linearNode.nPrimitives = 0;
 			flattenBVHTree(node->children[0], offset);
-			linearNode->childOffset = flattenBVHTree(node->children[1], offset);
+			linearNode.childOffset = flattenBVHTree(node->children[1], offset);
 		}
+		setLinearNode(myOffset, linearNode);
 		return myOffset;
 	}
 
+	// Nodes are stored in NodeArray as 9 floats: pMin, pMax, nPrimitives, axis, childOffset
+	void setLinearNode(int index, const LinearBVHNode &node) {
+		float *p = &NodeArray[index * (9)];
+		p[0] = node.pMin.x; p[1] = node.pMin.y; p[2] = node.pMin.z;
+		p[3] = node.pMax.x; p[4] = node.pMax.y; p[5] = node.pMax.z;
+		p[6] = node.nPrimitives;
+		p[7] = node.axis;
+		p[8] = node.childOffset;
+	}
+	LinearBVHNode getLinearNode(int index) const {
+		const float *p = &NodeArray[index * (9)];
+		LinearBVHNode node;
+		node.pMin = glm::vec3(p[0], p[1], p[2]);
+		node.pMax = glm::vec3(p[3], p[4], p[5]);
+		node.nPrimitives = p[6];
+		node.axis = p[7];
+		node.childOffset = p[8];
+		return node;
+	}
+
+private:
+	std::unique_ptr<ThreadPool> buildPool;
 };
 
+// Triangles of a mesh loaded by Shape::loadMesh
+inline std::vector<std::shared_ptr<Triangle>> getShapeTriangles(const Shape &shape) {
+	const std::vector<float> &posBuf = shape.getPosBuf();
+	const std::vector<float> &norBuf = shape.getNorBuf();
+	bool hasNormals = norBuf.size() == posBuf.size();
+	std::vector<std::shared_ptr<Triangle>> triangles;
+	triangles.reserve(posBuf.size() / 9);
+	for (size_t i = 0; i + 9 <= posBuf.size(); i += 9) {
+		auto tri = std::make_shared<Triangle>();
+		tri->v0 = glm::vec3(posBuf[i + 0], posBuf[i + 1], posBuf[i + 2]);
+		tri->v1 = glm::vec3(posBuf[i + 3], posBuf[i + 4], posBuf[i + 5]);
+		tri->v2 = glm::vec3(posBuf[i + 6], posBuf[i + 7], posBuf[i + 8]);
+		if (hasNormals) {
+			tri->n0 = glm::vec3(norBuf[i + 0], norBuf[i + 1], norBuf[i + 2]);
+			tri->n1 = glm::vec3(norBuf[i + 3], norBuf[i + 4], norBuf[i + 5]);
+			tri->n2 = glm::vec3(norBuf[i + 6], norBuf[i + 7], norBuf[i + 8]);
+		}
+		else {
+			glm::vec3 n = glm::normalize(glm::cross(tri->v1 - tri->v0, tri->v2 - tri->v0));
+			tri->n0 = tri->n1 = tri->n2 = n;
+		}
+		triangles.push_back(tri);
+	}
+	return triangles;
+}
+
 struct hitRecord {
 	glm::vec3 Pos;
-	glm::vec3 Normal;
+	glm::vec3 Normal;    // interpolated vertex normal
+	glm::vec3 geoNormal; // face normal, with the winding of the triangle
+	float t;
+	float u, v;          // barycentric coordinates of v1 and v2
+	int primId;          // index in bvhTree.primitives
 };
-bool IntersectBVH(const BVHTree& bvhTree, const Ray &ray, hitRecord& rec) {
-	// if (!bvhTree.nodes) return false;
+
+// Node traversal shared by the triangle and sphere trees. Visits the near
+// child first and skips nodes beyond the closest hit so far. hitPrim(i, tMax)
+// tests leaf primitive i and, on a hit closer than tMax, lowers tMax and
+// returns true; with anyHit the traversal stops at the first such hit.
+template<bool anyHit, typename F>
+inline bool traverseBVHNodes(const BVHTree& bvhTree, const Ray &ray, float tMax, F hitPrim, long long *nodesVisited) {
+	if (bvhTree.nodeNum == 0) return false;
+	const float *nodeArray = bvhTree.NodeArray.data();
 	bool hit = false;
 
 	glm::vec3 invDir(1 / ray.direction.x, 1 / ray.direction.y, 1 / ray.direction.z);
@@ -265,41 +648,37 @@ bool IntersectBVH(const BVHTree& bvhTree, const Ray &ray, hitRecord& rec) {
 	// Follow ray through BVH nodes to find primitive intersections
 	int toVisitOffset = 0, currentNodeIndex = 0;
 	int nodesToVisit[64];
+	long long visited = 0;
 	while (true) {
-		int offset1 = currentNodeIndex * (9);
-		LinearBVHNode node;
-		node.pMin = glm::vec3(bvhTree.NodeArray[offset1 + 0], bvhTree.NodeArray[offset1 + 1], bvhTree.NodeArray[offset1 + 2]);
-		node.pMax = glm::vec3(bvhTree.NodeArray[offset1 + 3], bvhTree.NodeArray[offset1 + 4], bvhTree.NodeArray[offset1 + 5]);
-		node.nPrimitives = bvhTree.NodeArray[offset1 + 6];
-		node.axis = bvhTree.NodeArray[offset1 + 7];
-		node.childOffset = bvhTree.NodeArray[offset1 + 8];
+		const float *p = &nodeArray[currentNodeIndex * (9)];
+		glm::vec3 pMin(p[0], p[1], p[2]);
+		glm::vec3 pMax(p[3], p[4], p[5]);
+		int nPrimitives = (int)p[6];
+		int axis = (int)p[7];
+		int childOffset = (int)p[8];
+		visited++;
 
 		// Ray  BVHĽ
-		Bound3f bound;
-		getBound(node, bound);
-		if (IntersectBound(bound, ray, invDir, dirIsNeg)) {
-			if (node.nPrimitives > 0) {
+		if (IntersectBox(pMin, pMax, ray, invDir, dirIsNeg, tMax)) {
+			if (nPrimitives > 0) {
 				// Ray  ҶڵĽ
-				for (int i = 0; i < node.nPrimitives; ++i) {
-					int offset = (node.childOffset + i) * (9 + 9 + 6);
-					Triangle tri; 
-					tri.v0 = glm::vec3(bvhTree.MeshArray[offset + 0], bvhTree.MeshArray[offset + 1], bvhTree.MeshArray[offset + 2]);
-					tri.v1 = glm::vec3(bvhTree.MeshArray[offset + 3], bvhTree.MeshArray[offset + 4], bvhTree.MeshArray[offset + 5]);
-					tri.v2 = glm::vec3(bvhTree.MeshArray[offset + 6], bvhTree.MeshArray[offset + 7], bvhTree.MeshArray[offset + 8]);
-					float t = hitTriangle(tri, ray);
-					if (t > 0.0f) hit = true; 
+				for (int i = 0; i < nPrimitives; ++i) {
+					if (hitPrim(childOffset + i, tMax)) {
+						hit = true;
+						if (anyHit) break;
+					}
 				}
-				if (toVisitOffset == 0) break;
+				if ((anyHit && hit) || toVisitOffset == 0) break;
 				currentNodeIndex = nodesToVisit[--toVisitOffset];
 			}
 			else {
 				//  BVH node  _nodesToVisit_ stack, advance to near
-				if (dirIsNeg[int(node.axis)]) {
+				if (dirIsNeg[axis]) {
 					nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
-					currentNodeIndex = node.childOffset;
+					currentNodeIndex = childOffset;
 				}
 				else {
-					nodesToVisit[toVisitOffset++] = node.childOffset;
+					nodesToVisit[toVisitOffset++] = childOffset;
 					currentNodeIndex = currentNodeIndex + 1;
 				}
 			}
@@ -309,13 +688,60 @@ bool IntersectBVH(const BVHTree& bvhTree, const Ray &ray, hitRecord& rec) {
 			currentNodeIndex = nodesToVisit[--toVisitOffset];
 		}
 	}
+	if (nodesVisited) *nodesVisited += visited;
 	return hit;
 }
 
+// Shared traversal of IntersectBVH and OccludedBVH over the triangles of
+// MeshArray; with anyHit it stops at the first triangle closer than tMax.
+template<bool anyHit>
+inline bool traverseBVH(const BVHTree& bvhTree, const Ray &ray, float tMax, hitRecord *rec, long long *nodesVisited) {
+	const float *meshArray = bvhTree.MeshArray.data();
+	return traverseBVHNodes<anyHit>(bvhTree, ray, tMax, [&](int prim, float &tClosest) {
+		const float *m = &meshArray[prim * (9 + 9 + 6)];
+		float t, u, v;
+		if (!hitTriangle(glm::vec3(m[0], m[1], m[2]), glm::vec3(m[3], m[4], m[5]),
+			glm::vec3(m[6], m[7], m[8]), ray, tClosest, t, u, v))
+			return false;
+		if (!anyHit) {
+			tClosest = t;
+			rec->t = t;
+			rec->u = u;
+			rec->v = v;
+			rec->primId = prim;
+		}
+		return true;
+	}, nodesVisited);
+}
+
+// Closest hit closer than tMax. On a hit rec is filled in, otherwise it is left untouched.
+// nodesVisited, if given, is increased by the number of nodes tested.
+inline bool IntersectBVH(const BVHTree& bvhTree, const Ray &ray, hitRecord& rec,
+	float tMax = FLT_MAX, long long *nodesVisited = nullptr) {
+	hitRecord closest;
+	if (!traverseBVH<false>(bvhTree, ray, tMax, &closest, nodesVisited)) return false;
+
+	const float *m = &bvhTree.MeshArray[closest.primId * (9 + 9 + 6)];
+	glm::vec3 v0(m[0], m[1], m[2]), v1(m[3], m[4], m[5]), v2(m[6], m[7], m[8]);
+	glm::vec3 n0(m[9], m[10], m[11]), n1(m[12], m[13], m[14]), n2(m[15], m[16], m[17]);
+	closest.Pos = ray.origin + closest.t * ray.direction;
+	closest.geoNormal = glm::normalize(glm::cross(v1 - v0, v2 - v0));
+	glm::vec3 n = (1.0f - closest.u - closest.v) * n0 + closest.u * n1 + closest.v * n2;
+	float len = glm::length(n);
+	closest.Normal = len > 0.0f ? n / len : closest.geoNormal;
+	rec = closest;
+	return true;
+}
+
+// Any hit closer than tMax, for shadow rays
+inline bool OccludedBVH(const BVHTree& bvhTree, const Ray &ray, float tMax = FLT_MAX,
+	long long *nodesVisited = nullptr) {
+	return traverseBVH<true>(bvhTree, ray, tMax, nullptr, nodesVisited);
+}
+
 
-#define STB_IMAGE_WRITE_IMPLEMENTATION	// include֮ǰ붨
-#include "../Tool/stb_image_write.h"
-void BVHTest(const BVHTree& bvhTree, const Camera& camera) {
+#include "stb_image_write.h"
+inline void BVHTest(const BVHTree& bvhTree, const Camera& camera) {
 
 	Ray cameraRay;
 	cameraRay.origin = camera.cameraPos;
@@ -330,14 +756,15 @@ void BVHTest(const BVHTree& bvhTree, const Camera& camera) {
 			cameraRay.direction = 
 				normalize(camera.LeftBottomCorner + (x * 2.0f * camera.halfW) * camera.cameraRight + (y * 2.0f * camera.halfH) * camera.cameraUp);
 			
+			// Shading normal mapped to color, black if missed
 			hitRecord rec;
-			if (IntersectBVH(bvhTree, cameraRay, rec)) 
-				data[(i + (height - j - 1) * width) * 4 + 0] = 255;
-			else 
-				data[(i + (height - j - 1) * width) * 4 + 0] = 0;
+			glm::vec3 color(0.0f);
+			if (IntersectBVH(bvhTree, cameraRay, rec))
+				color = 0.5f * rec.Normal + glm::vec3(0.5f);
 
-			data[(i + (height - j - 1) * width) * 4 + 1] = 0;
-			data[(i + (height - j - 1) * width) * 4 + 2] = 0;
+			data[(i + (height - j - 1) * width) * 4 + 0] = (unsigned char)(255.0f * color.x);
+			data[(i + (height - j - 1) * width) * 4 + 1] = (unsigned char)(255.0f * color.y);
+			data[(i + (height - j - 1) * width) * 4 + 2] = (unsigned char)(255.0f * color.z);
 			data[(i + (height - j - 1) * width) * 4 + 3] = 255;
 
 			//std::cout << "(" << i <<", " << j << ")" << std::endl;
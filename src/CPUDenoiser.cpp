@@ -0,0 +1,614 @@
+#include "CPUDenoiser.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+
+#include "Camera.h"
+#include "Simd.h"
+#include "TraceEvents.h"
+
+using namespace std;
+
+// Pixels filtered together by one SIMD instruction
+#if defined(SIMD_AVX)
+static const int DenoiseSimdWidth = 8;
+#else
+static const int DenoiseSimdWidth = 4;
+#endif
+
+// B3 spline kernel of the a-trous filter, by distance from the centre tap
+static const float Kernel[3] = { 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+
+struct FilterParams {
+	float sigmaDepth;
+	float sigmaNormal;
+	float sigmaLuminance;
+	int normalPower; // sigmaNormal rounded, for the vector path
+};
+
+void DenoiseFrame::resize(int w, int h)
+{
+	width = w;
+	height = h;
+	size_t n = (size_t)w * h;
+	for (int c = 0; c < 3; ++c) {
+		color[c].resize(n);
+		normal[c].resize(n);
+	}
+	depth.resize(n);
+	count.resize(n);
+	luminance1.resize(n);
+	luminance2.resize(n);
+}
+
+vector<float> DenoiseFrame::getColorRGB() const
+{
+	size_t n = (size_t)width * height;
+	vector<float> rgb(3 * n);
+	for (size_t i = 0; i < n; ++i) {
+		for (int c = 0; c < 3; ++c) {
+			rgb[3 * i + c] = color[c][i];
+		}
+	}
+	return rgb;
+}
+
+vector<unsigned char> DenoiseFrame::getImageBytes() const
+{
+	size_t n = (size_t)width * height;
+	vector<unsigned char> bytes(3 * n);
+	for (size_t i = 0; i < n; ++i) {
+		for (int c = 0; c < 3; ++c) {
+			float v = glm::clamp(color[c][i], 0.0f, 1.0f);
+			bytes[3 * i + c] = (unsigned char)(v * 255.0f + 0.5f);
+		}
+	}
+	return bytes;
+}
+
+// ************ Scalar pixels, line by line the functions of the shaders ************** //
+
+static inline float luminance(float r, float g, float b)
+{
+	return r * 0.30f + g * 0.59f + b * 0.11f;
+}
+
+static inline glm::vec3 getNormal(const DenoiseFrame &f, int i)
+{
+	return glm::vec3(f.normal[0][i], f.normal[1][i], f.normal[2][i]);
+}
+
+static glm::vec2 depthGradient(const DenoiseFrame &f, int x, int y, float depth)
+{
+	const float *d = f.depth.data();
+	int W = f.width;
+	float dx = min(fabsf(d[y * W + min(x + 1, W - 1)] - depth), fabsf(depth - d[y * W + max(x - 1, 0)]));
+	float dy = min(fabsf(d[min(y + 1, f.height - 1) * W + x] - depth), fabsf(depth - d[max(y - 1, 0) * W + x]));
+	return glm::vec2(dx, dy);
+}
+
+static float geometryWeight(const FilterParams &p, float depthP, const glm::vec3 &normalP, const glm::vec2 &gradP,
+	int ox, int oy, float depthQ, const glm::vec3 &normalQ)
+{
+	bool missP = glm::dot(normalP, normalP) == 0.0f;
+	bool missQ = glm::dot(normalQ, normalQ) == 0.0f;
+	if (missP || missQ) {
+		return missP && missQ ? 1.0f : 0.0f;
+	}
+	float wDepth = expf(-fabsf(depthP - depthQ) / (p.sigmaDepth * (gradP.x * abs(ox) + gradP.y * abs(oy)) + 1e-4f));
+	float wNormal = powf(max(0.0f, glm::dot(normalP, normalQ)), p.sigmaNormal);
+	return wDepth * wNormal;
+}
+
+static float estimatePixel(const DenoiseFrame &f, const FilterParams &p, int x, int y)
+{
+	int W = f.width;
+	int i = y * W + x;
+	float count = f.count[i];
+	if (count >= 4.0f) {
+		float m1 = f.luminance1[i];
+		return max(0.0f, f.luminance2[i] - m1 * m1) / max(1.0f, count);
+	}
+	float depthP = f.depth[i];
+	glm::vec3 normalP = getNormal(f, i);
+	glm::vec2 gradP = depthGradient(f, x, y, depthP);
+	float weightSum = 0.0f;
+	float m1 = 0.0f, m2 = 0.0f;
+	for (int dy = -3; dy <= 3; dy++) {
+		int qy = glm::clamp(y + dy, 0, f.height - 1);
+		for (int dx = -3; dx <= 3; dx++) {
+			int q = qy * W + glm::clamp(x + dx, 0, W - 1);
+			float w = (dx == 0 && dy == 0) ? 1.0f : geometryWeight(p, depthP, normalP, gradP, dx, dy, f.depth[q], getNormal(f, q));
+			m1 += w * f.luminance1[q];
+			m2 += w * f.luminance2[q];
+			weightSum += w;
+		}
+	}
+	m1 /= weightSum;
+	m2 /= weightSum;
+	return max(0.0f, m2 - m1 * m1) / max(1.0f, count);
+}
+
+static void atrousPixel(const DenoiseFrame &f, const FilterParams &p, const vector<float> *inColor, const vector<float> &inVar,
+	int x, int y, int step, vector<float> *outColor, vector<float> &outVar)
+{
+	int W = f.width, H = f.height;
+	int i = y * W + x;
+	float depthP = f.depth[i];
+	glm::vec3 normalP = getNormal(f, i);
+	glm::vec2 gradP = depthGradient(f, x, y, depthP);
+	float luminanceP = luminance(inColor[0][i], inColor[1][i], inColor[2][i]);
+	float var3x3 = 0.0f;
+	for (int dy = -1; dy <= 1; dy++) {
+		for (int dx = -1; dx <= 1; dx++) {
+			float w = (dx == 0 ? 0.5f : 0.25f) * (dy == 0 ? 0.5f : 0.25f);
+			var3x3 += w * inVar[glm::clamp(y + dy, 0, H - 1) * W + glm::clamp(x + dx, 0, W - 1)];
+		}
+	}
+	float luminanceScale = p.sigmaLuminance * sqrtf(var3x3) + 1e-6f;
+
+	float h0 = Kernel[0] * Kernel[0];
+	float weightSum = h0;
+	glm::vec3 color = h0 * glm::vec3(inColor[0][i], inColor[1][i], inColor[2][i]);
+	float var = h0 * h0 * inVar[i];
+	for (int dy = -2; dy <= 2; dy++) {
+		int qy = y + dy * step;
+		if (qy < 0 || qy >= H) continue;
+		for (int dx = -2; dx <= 2; dx++) {
+			int qx = x + dx * step;
+			if ((dx == 0 && dy == 0) || qx < 0 || qx >= W) continue;
+			int q = qy * W + qx;
+			glm::vec3 c(inColor[0][q], inColor[1][q], inColor[2][q]);
+			float w = geometryWeight(p, depthP, normalP, gradP, dx * step, dy * step, f.depth[q], getNormal(f, q));
+			w *= expf(-fabsf(luminanceP - luminance(c.x, c.y, c.z)) / luminanceScale);
+			float h = Kernel[abs(dx)] * Kernel[abs(dy)] * w;
+			weightSum += h;
+			color += h * c;
+			var += h * h * inVar[q];
+		}
+	}
+	for (int c = 0; c < 3; ++c) {
+		outColor[c][i] = color[c] / weightSum;
+	}
+	outVar[i] = var / (weightSum * weightSum);
+}
+
+static bool reprojectHistory(const DenoiseFrame &history, const Camera &prev, const glm::vec3 &pos, const glm::vec3 &normal,
+	glm::vec3 &color, float &count, glm::vec2 &moments)
+{
+	color = glm::vec3(0.0f);
+	count = 0.0f;
+	moments = glm::vec2(0.0f);
+	glm::vec3 d = pos - prev.cameraPos;
+	float z = glm::dot(d, prev.cameraFront);
+	if (z <= 0.0f) return false;
+	int W = history.width, H = history.height;
+	float px = (0.5f + 0.5f * glm::dot(d, prev.cameraRight) / (z * prev.halfW)) * (float)W - 0.5f;
+	float py = (0.5f + 0.5f * glm::dot(d, prev.cameraUp) / (z * prev.halfH)) * (float)H - 0.5f;
+	int x0 = (int)floorf(px), y0 = (int)floorf(py);
+	float fx = px - (float)x0, fy = py - (float)y0;
+	float prevDepth = glm::length(d);
+	float cosine = fabsf(glm::dot(normal, d)) / prevDepth;
+	float depthTolerance = 0.01f * prevDepth / max(cosine, 0.1f);
+	float weightSum = 0.0f;
+	for (int k = 0; k < 4; k++) {
+		int ox = k & 1, oy = k >> 1;
+		int qx = x0 + ox, qy = y0 + oy;
+		if (qx < 0 || qy < 0 || qx >= W || qy >= H) continue;
+		int q = qy * W + qx;
+		if (fabsf(history.depth[q] - prevDepth) > depthTolerance || glm::dot(normal, getNormal(history, q)) < 0.95f) continue;
+		float w = (ox == 1 ? fx : 1.0f - fx) * (oy == 1 ? fy : 1.0f - fy);
+		color += w * glm::vec3(history.color[0][q], history.color[1][q], history.color[2][q]);
+		count += w * history.count[q];
+		moments.x += w * history.luminance1[q];
+		moments.y += w * history.luminance2[q];
+		weightSum += w;
+	}
+	if (weightSum < 0.01f) return false;
+	color /= weightSum;
+	count /= weightSum;
+	moments.x /= weightSum;
+	moments.y /= weightSum;
+	return true;
+}
+
+// History of a row of the temporal resolve, reprojected one pixel at a time
+struct ResolveRow {
+	vector<float> hist[3];
+	vector<float> luminance1, luminance2;
+	vector<float> alpha, count, valid;
+
+	explicit ResolveRow(int width) {
+		for (int c = 0; c < 3; ++c) hist[c].assign(width, 0.0f);
+		luminance1.assign(width, 0.0f);
+		luminance2.assign(width, 0.0f);
+		alpha.assign(width, 1.0f);
+		count.assign(width, 1.0f);
+		valid.assign(width, 0.0f);
+	}
+};
+
+static void resolvePixel(const DenoiseFrame &s, const ResolveRow &row, float clampGamma, int x, int y, DenoiseFrame &out)
+{
+	int W = s.width, H = s.height;
+	int i = y * W + x;
+	glm::vec3 color(s.color[0][i], s.color[1][i], s.color[2][i]);
+	float lum = luminance(color.x, color.y, color.z);
+	if (row.valid[x] == 0.0f) {
+		for (int c = 0; c < 3; ++c) out.color[c][i] = color[c];
+		out.count[i] = 1.0f;
+		out.luminance1[i] = lum;
+		out.luminance2[i] = lum * lum;
+		return;
+	}
+	glm::vec3 m1(0.0f), m2(0.0f);
+	for (int dy = -1; dy <= 1; dy++) {
+		for (int dx = -1; dx <= 1; dx++) {
+			int q = glm::clamp(y + dy, 0, H - 1) * W + glm::clamp(x + dx, 0, W - 1);
+			glm::vec3 c(s.color[0][q], s.color[1][q], s.color[2][q]);
+			m1 += c;
+			m2 += c * c;
+		}
+	}
+	m1 /= 9.0f;
+	m2 /= 9.0f;
+	float alpha = row.alpha[x];
+	for (int c = 0; c < 3; ++c) {
+		float sigma = sqrtf(max(0.0f, m2[c] - m1[c] * m1[c]));
+		float hist = min(max(row.hist[c][x], m1[c] - clampGamma * sigma), m1[c] + clampGamma * sigma);
+		out.color[c][i] = hist * (1.0f - alpha) + color[c] * alpha;
+	}
+	out.count[i] = row.count[x];
+	out.luminance1[i] = row.luminance1[x] * (1.0f - alpha) + lum * alpha;
+	out.luminance2[i] = row.luminance2[x] * (1.0f - alpha) + lum * lum * alpha;
+}
+
+// ************ Vector spans, K pixels of a row at a time ************** //
+// Each returns the first pixel it did not filter. The callers keep x far
+// enough from the left and right edges that no tap needs clamping.
+
+template<typename S>
+static inline typename S::type absv(typename S::type a)
+{
+	return S::andnot(S::set1(-0.0f), a);
+}
+
+template<typename S>
+static inline typename S::type powi(typename S::type x, int n)
+{
+	typename S::type result = S::set1(1.0f);
+	while (n > 0) {
+		if (n & 1) result = S::mul(result, x);
+		n >>= 1;
+		if (n) x = S::mul(x, x);
+	}
+	return result;
+}
+
+// geometryWeight() for K pixels; the geometry of p is preloaded
+template<typename S>
+static inline typename S::type geometryWeightK(const FilterParams &p, const DenoiseFrame &f, int q,
+	typename S::type depthP, const typename S::type normalP[3], typename S::type missP,
+	typename S::type gradX, typename S::type gradY, int ox, int oy)
+{
+	typedef typename S::type F;
+	F zero = S::zero();
+	F nx = S::loadu(&f.normal[0][q]), ny = S::loadu(&f.normal[1][q]), nz = S::loadu(&f.normal[2][q]);
+	F missQ = S::eq(S::add(S::add(S::mul(nx, nx), S::mul(ny, ny)), S::mul(nz, nz)), zero);
+	F denom = S::add(S::mul(S::set1(p.sigmaDepth), S::add(S::mul(gradX, S::set1((float)abs(ox))), S::mul(gradY, S::set1((float)abs(oy))))),
+		S::set1(1e-4f));
+	F wDepth = S::exp(S::sub(zero, S::div(absv<S>(S::sub(depthP, S::loadu(&f.depth[q]))), denom)));
+	F cosine = S::add(S::add(S::mul(normalP[0], nx), S::mul(normalP[1], ny)), S::mul(normalP[2], nz));
+	F w = S::mul(wDepth, powi<S>(S::max(zero, cosine), p.normalPower));
+	// A miss only matches another miss
+	F anyMiss = S::orv(missP, missQ);
+	return S::select(anyMiss, S::andv(S::andv(missP, missQ), S::set1(1.0f)), w);
+}
+
+template<typename S>
+static inline void depthGradientK(const DenoiseFrame &f, int i, int y, typename S::type depthP,
+	typename S::type &gradX, typename S::type &gradY)
+{
+	int W = f.width;
+	int up = (min(y + 1, f.height - 1) - y) * W, down = (max(y - 1, 0) - y) * W;
+	gradX = S::min(absv<S>(S::sub(S::loadu(&f.depth[i + 1]), depthP)), absv<S>(S::sub(depthP, S::loadu(&f.depth[i - 1]))));
+	gradY = S::min(absv<S>(S::sub(S::loadu(&f.depth[i + up]), depthP)), absv<S>(S::sub(depthP, S::loadu(&f.depth[i + down]))));
+}
+
+template<int K>
+static int estimateSpan(const DenoiseFrame &f, const FilterParams &p, int y, int x, int end, float *outVar)
+{
+	typedef SimdFloat<K> S;
+	if constexpr (S::enabled) {
+		typedef typename S::type F;
+		const int W = f.width;
+		const F zero = S::zero(), one = S::set1(1.0f);
+		for (; x + K <= end; x += K) {
+			int i = y * W + x;
+			F count = S::loadu(&f.count[i]);
+			F divisor = S::max(one, count);
+			F m1 = S::loadu(&f.luminance1[i]);
+			F var = S::div(S::max(zero, S::sub(S::loadu(&f.luminance2[i]), S::mul(m1, m1))), divisor);
+			F spatial = S::lt(count, S::set1(4.0f));
+			if (S::movemask(spatial)) {
+				F depthP = S::loadu(&f.depth[i]);
+				F normalP[3] = { S::loadu(&f.normal[0][i]), S::loadu(&f.normal[1][i]), S::loadu(&f.normal[2][i]) };
+				F missP = S::eq(S::add(S::add(S::mul(normalP[0], normalP[0]), S::mul(normalP[1], normalP[1])), S::mul(normalP[2], normalP[2])), zero);
+				F gradX, gradY;
+				depthGradientK<S>(f, i, y, depthP, gradX, gradY);
+				F weightSum = zero, s1 = zero, s2 = zero;
+				for (int dy = -3; dy <= 3; dy++) {
+					int row = glm::clamp(y + dy, 0, f.height - 1) * W;
+					for (int dx = -3; dx <= 3; dx++) {
+						int q = row + x + dx;
+						F w = (dx == 0 && dy == 0) ? one : geometryWeightK<S>(p, f, q, depthP, normalP, missP, gradX, gradY, dx, dy);
+						s1 = S::add(s1, S::mul(w, S::loadu(&f.luminance1[q])));
+						s2 = S::add(s2, S::mul(w, S::loadu(&f.luminance2[q])));
+						weightSum = S::add(weightSum, w);
+					}
+				}
+				s1 = S::div(s1, weightSum);
+				s2 = S::div(s2, weightSum);
+				F estimate = S::div(S::max(zero, S::sub(s2, S::mul(s1, s1))), divisor);
+				var = S::select(spatial, estimate, var);
+			}
+			S::store(&outVar[i], var);
+		}
+	}
+	return x;
+}
+
+template<int K>
+static int atrousSpan(const DenoiseFrame &f, const FilterParams &p, const vector<float> *inColor, const vector<float> &inVar,
+	int y, int step, int x, int end, vector<float> *outColor, vector<float> &outVar)
+{
+	typedef SimdFloat<K> S;
+	if constexpr (S::enabled) {
+		typedef typename S::type F;
+		const int W = f.width, H = f.height;
+		const F zero = S::zero();
+		const F lumR = S::set1(0.30f), lumG = S::set1(0.59f), lumB = S::set1(0.11f);
+		for (; x + K <= end; x += K) {
+			int i = y * W + x;
+			F depthP = S::loadu(&f.depth[i]);
+			F normalP[3] = { S::loadu(&f.normal[0][i]), S::loadu(&f.normal[1][i]), S::loadu(&f.normal[2][i]) };
+			F missP = S::eq(S::add(S::add(S::mul(normalP[0], normalP[0]), S::mul(normalP[1], normalP[1])), S::mul(normalP[2], normalP[2])), zero);
+			F gradX, gradY;
+			depthGradientK<S>(f, i, y, depthP, gradX, gradY);
+			F c[3] = { S::loadu(&inColor[0][i]), S::loadu(&inColor[1][i]), S::loadu(&inColor[2][i]) };
+			F luminanceP = S::add(S::add(S::mul(c[0], lumR), S::mul(c[1], lumG)), S::mul(c[2], lumB));
+			F var3x3 = zero;
+			for (int dy = -1; dy <= 1; dy++) {
+				int row = glm::clamp(y + dy, 0, H - 1) * W;
+				for (int dx = -1; dx <= 1; dx++) {
+					float w = (dx == 0 ? 0.5f : 0.25f) * (dy == 0 ? 0.5f : 0.25f);
+					var3x3 = S::add(var3x3, S::mul(S::set1(w), S::loadu(&inVar[row + x + dx])));
+				}
+			}
+			F luminanceScale = S::add(S::mul(S::set1(p.sigmaLuminance), S::sqrt(var3x3)), S::set1(1e-6f));
+
+			F h0 = S::set1(Kernel[0] * Kernel[0]);
+			F weightSum = h0;
+			F sum[3] = { S::mul(h0, c[0]), S::mul(h0, c[1]), S::mul(h0, c[2]) };
+			F var = S::mul(S::mul(h0, h0), S::loadu(&inVar[i]));
+			for (int dy = -2; dy <= 2; dy++) {
+				int qy = y + dy * step;
+				if (qy < 0 || qy >= H) continue;
+				for (int dx = -2; dx <= 2; dx++) {
+					if (dx == 0 && dy == 0) continue;
+					int q = qy * W + x + dx * step;
+					F cq[3] = { S::loadu(&inColor[0][q]), S::loadu(&inColor[1][q]), S::loadu(&inColor[2][q]) };
+					F w = geometryWeightK<S>(p, f, q, depthP, normalP, missP, gradX, gradY, dx * step, dy * step);
+					F luminanceQ = S::add(S::add(S::mul(cq[0], lumR), S::mul(cq[1], lumG)), S::mul(cq[2], lumB));
+					w = S::mul(w, S::exp(S::sub(zero, S::div(absv<S>(S::sub(luminanceP, luminanceQ)), luminanceScale))));
+					F h = S::mul(S::set1(Kernel[abs(dx)] * Kernel[abs(dy)]), w);
+					weightSum = S::add(weightSum, h);
+					for (int ch = 0; ch < 3; ++ch) {
+						sum[ch] = S::add(sum[ch], S::mul(h, cq[ch]));
+					}
+					var = S::add(var, S::mul(S::mul(h, h), S::loadu(&inVar[q])));
+				}
+			}
+			for (int ch = 0; ch < 3; ++ch) {
+				S::store(&outColor[ch][i], S::div(sum[ch], weightSum));
+			}
+			S::store(&outVar[i], S::div(var, S::mul(weightSum, weightSum)));
+		}
+	}
+	return x;
+}
+
+template<int K>
+static int resolveSpan(const DenoiseFrame &s, const ResolveRow &rowState, float clampGamma, int y, int x, int end, DenoiseFrame &out)
+{
+	typedef SimdFloat<K> S;
+	if constexpr (S::enabled) {
+		typedef typename S::type F;
+		const int W = s.width, H = s.height;
+		const F zero = S::zero(), one = S::set1(1.0f), nine = S::set1(9.0f), gamma = S::set1(clampGamma);
+		const int rows[3] = { max(y - 1, 0) * W, y * W, min(y + 1, H - 1) * W };
+		for (; x + K <= end; x += K) {
+			int i = y * W + x;
+			F c[3] = { S::loadu(&s.color[0][i]), S::loadu(&s.color[1][i]), S::loadu(&s.color[2][i]) };
+			F lum = S::add(S::add(S::mul(c[0], S::set1(0.30f)), S::mul(c[1], S::set1(0.59f))), S::mul(c[2], S::set1(0.11f)));
+			F valid = S::gt(S::loadu(&rowState.valid[x]), zero);
+			F alpha = S::loadu(&rowState.alpha[x]);
+			F keep = S::sub(one, alpha);
+			for (int ch = 0; ch < 3; ++ch) {
+				F m1 = zero, m2 = zero;
+				for (int r = 0; r < 3; ++r) {
+					for (int dx = -1; dx <= 1; dx++) {
+						F v = S::loadu(&s.color[ch][rows[r] + x + dx]);
+						m1 = S::add(m1, v);
+						m2 = S::add(m2, S::mul(v, v));
+					}
+				}
+				m1 = S::div(m1, nine);
+				m2 = S::div(m2, nine);
+				F sigma = S::sqrt(S::max(zero, S::sub(m2, S::mul(m1, m1))));
+				F hist = S::loadu(&rowState.hist[ch][x]);
+				hist = S::min(S::max(hist, S::sub(m1, S::mul(gamma, sigma))), S::add(m1, S::mul(gamma, sigma)));
+				F blended = S::add(S::mul(hist, keep), S::mul(c[ch], alpha));
+				S::store(&out.color[ch][i], S::select(valid, blended, c[ch]));
+			}
+			F lum2 = S::mul(lum, lum);
+			F m1 = S::add(S::mul(S::loadu(&rowState.luminance1[x]), keep), S::mul(lum, alpha));
+			F m2 = S::add(S::mul(S::loadu(&rowState.luminance2[x]), keep), S::mul(lum2, alpha));
+			S::store(&out.count[i], S::select(valid, S::loadu(&rowState.count[x]), one));
+			S::store(&out.luminance1[i], S::select(valid, m1, lum));
+			S::store(&out.luminance2[i], S::select(valid, m2, lum2));
+		}
+	}
+	return x;
+}
+
+// ************ CPUDenoiser ************** //
+
+CPUDenoiser::CPUDenoiser(int threadNum) :
+	sigmaDepth(1.0f),
+	sigmaNormal(128.0f),
+	sigmaLuminance(4.0f),
+	rowsPerTask(8),
+	pool(threadNum),
+	temporalTime(0.0),
+	filterTime(0.0)
+{
+}
+
+template<typename F>
+void CPUDenoiser::forRows(int height, F f)
+{
+	TaskGroup group(pool);
+	for (int y0 = 0; y0 < height; y0 += rowsPerTask) {
+		int y1 = min(y0 + rowsPerTask, height);
+		group.run([&f, y0, y1]() {
+			for (int y = y0; y < y1; ++y) {
+				f(y);
+			}
+		});
+	}
+	group.wait();
+}
+
+void CPUDenoiser::estimateRow(const DenoiseFrame &frame, int y, Planes &out) const
+{
+	FilterParams p = { sigmaDepth, sigmaNormal, sigmaLuminance, (int)(sigmaNormal + 0.5f) };
+	int W = frame.width;
+	size_t row = (size_t)y * W;
+	for (int c = 0; c < 3; ++c) {
+		memcpy(&out.color[c][row], &frame.color[c][row], W * sizeof(float));
+	}
+	// The 7x7 estimate reaches 3 pixels to the sides
+	int x0 = min(3, W);
+	int x1 = estimateSpan<DenoiseSimdWidth>(frame, p, y, x0, W - 3, out.variance.data());
+	for (int x = 0; x < x0; ++x) {
+		out.variance[row + x] = estimatePixel(frame, p, x, y);
+	}
+	for (int x = x1; x < W; ++x) {
+		out.variance[row + x] = estimatePixel(frame, p, x, y);
+	}
+}
+
+void CPUDenoiser::atrousRow(const DenoiseFrame &frame, const Planes &in, int y, int step, Planes &out) const
+{
+	FilterParams p = { sigmaDepth, sigmaNormal, sigmaLuminance, (int)(sigmaNormal + 0.5f) };
+	int W = frame.width;
+	// The outer taps are 2 steps to the sides
+	int x0 = min(2 * step, W);
+	int x1 = atrousSpan<DenoiseSimdWidth>(frame, p, in.color, in.variance, y, step, x0, W - 2 * step, out.color, out.variance);
+	for (int x = 0; x < x0; ++x) {
+		atrousPixel(frame, p, in.color, in.variance, x, y, step, out.color, out.variance);
+	}
+	for (int x = x1; x < W; ++x) {
+		atrousPixel(frame, p, in.color, in.variance, x, y, step, out.color, out.variance);
+	}
+}
+
+void CPUDenoiser::resolveRow(const DenoiseFrame &sample, const Camera &camera, const DenoiseFrame *history,
+	const Camera *prevCamera, int maxHistory, float clampGamma, int y, DenoiseFrame &out) const
+{
+	int W = sample.width, H = sample.height;
+	ResolveRow row(W);
+	if (history && prevCamera) {
+		for (int x = 0; x < W; ++x) {
+			int i = y * W + x;
+			glm::vec3 normal = getNormal(sample, i);
+			if (glm::dot(normal, normal) == 0.0f) continue;
+			// Texture coordinate of the pixel center, as interpolated for the fragment
+			float u = ((float)x + 0.5f) / (float)W;
+			float v = ((float)y + 0.5f) / (float)H;
+			glm::vec3 direction = glm::normalize(camera.LeftBottomCorner + (u * 2.0f * camera.halfW) * camera.cameraRight
+				+ (v * 2.0f * camera.halfH) * camera.cameraUp);
+			glm::vec3 hist;
+			float histCount;
+			glm::vec2 histMoments;
+			if (!reprojectHistory(*history, *prevCamera, camera.cameraPos + sample.depth[i] * direction, normal, hist, histCount, histMoments)) continue;
+			int n = min((int)(histCount + 0.5f) + 1, max(1, maxHistory));
+			for (int c = 0; c < 3; ++c) row.hist[c][x] = hist[c];
+			row.luminance1[x] = histMoments.x;
+			row.luminance2[x] = histMoments.y;
+			row.count[x] = (float)n;
+			row.alpha[x] = 1.0f / (float)n;
+			row.valid[x] = 1.0f;
+		}
+	}
+	int x0 = min(1, W);
+	int x1 = resolveSpan<DenoiseSimdWidth>(sample, row, clampGamma, y, x0, W - 1, out);
+	for (int x = 0; x < x0; ++x) {
+		resolvePixel(sample, row, clampGamma, x, y, out);
+	}
+	for (int x = x1; x < W; ++x) {
+		resolvePixel(sample, row, clampGamma, x, y, out);
+	}
+	size_t first = (size_t)y * W;
+	memcpy(&out.depth[first], &sample.depth[first], W * sizeof(float));
+	for (int c = 0; c < 3; ++c) {
+		memcpy(&out.normal[c][first], &sample.normal[c][first], W * sizeof(float));
+	}
+}
+
+void CPUDenoiser::resolveTemporal(const DenoiseFrame &sample, const Camera &camera, const DenoiseFrame *history,
+	const Camera *prevCamera, int maxHistory, float clampGamma, DenoiseFrame &out)
+{
+	TRACE_SCOPE("CPU temporal resolve");
+	auto start = chrono::steady_clock::now();
+	out.resize(sample.width, sample.height);
+	// A history of another size is no history
+	if (history && (history->width != sample.width || history->height != sample.height)) {
+		history = nullptr;
+	}
+	forRows(sample.height, [&](int y) {
+		resolveRow(sample, camera, history, prevCamera, maxHistory, clampGamma, y, out);
+	});
+	temporalTime = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+void CPUDenoiser::filter(const DenoiseFrame &frame, int iterations, DenoiseFrame &out)
+{
+	TRACE_SCOPE("CPU a-trous filter");
+	auto start = chrono::steady_clock::now();
+	size_t n = (size_t)frame.width * frame.height;
+	for (Planes &planes : passes) {
+		for (int c = 0; c < 3; ++c) planes.color[c].resize(n);
+		planes.variance.resize(n);
+	}
+	forRows(frame.height, [&](int y) {
+		estimateRow(frame, y, passes[0]);
+	});
+	for (int pass = 1; pass <= iterations; ++pass) {
+		const Planes &in = passes[(pass - 1) % 2];
+		Planes &target = passes[pass % 2];
+		int step = 1 << (pass - 1);
+		forRows(frame.height, [&](int y) {
+			atrousRow(frame, in, y, step, target);
+		});
+	}
+	const Planes &result = passes[iterations % 2];
+	out.width = frame.width;
+	out.height = frame.height;
+	for (int c = 0; c < 3; ++c) out.color[c] = result.color[c];
+	out.variance = result.variance;
+	filterTime = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
@@ -0,0 +1,90 @@
+#pragma once
+#ifndef CPUDENOISER_H
+#define CPUDENOISER_H
+
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "ThreadPool.h"
+
+class Camera;
+
+// One frame of the denoisers as float planes, one per channel, bottom row
+// first like the OpenGL framebuffer. count is the history length of each
+// pixel, an integer; variance is only written by CPUDenoiser::filter().
+struct DenoiseFrame {
+	int width = 0;
+	int height = 0;
+	std::vector<float> color[3];
+	std::vector<float> depth;
+	std::vector<float> normal[3];
+	std::vector<float> count;
+	std::vector<float> luminance1;
+	std::vector<float> luminance2;
+	std::vector<float> variance;
+
+	void resize(int w, int h);
+	// Color as float RGB, and as 8 bit RGB like glReadPixels with GL_UNSIGNED_BYTE
+	std::vector<float> getColorRGB() const;
+	std::vector<unsigned char> getImageBytes() const;
+};
+
+/**
+ * CPU counterparts of the denoiser passes, so that a frame can be denoised
+ * without OpenGL and checked against the OpenGL output: resolveTemporal() is
+ * TemporalFragmentShader.glsl and filter() ATrousFragmentShader.glsl. The
+ * rows are split among a thread pool. Within a row the SimdFloat lanes
+ * filter neighbouring pixels together, so every tap is one unaligned load
+ * per plane; pixels whose taps leave the image, and the reprojection, which
+ * gathers from anywhere in the history, are done one at a time. The vector
+ * exp() and the integer power of the normal weight differ from the scalar
+ * path in the last bits only.
+ */
+class CPUDenoiser
+{
+public:
+	CPUDenoiser(int threadNum = 0);
+
+	// Blends the color of sample with history, the resolved last frame seen by
+	// prevCamera, or null if there is none. out gets the color, count and
+	// luminance moments, and the depth and normal of sample so that it can be
+	// the history of the next frame.
+	void resolveTemporal(const DenoiseFrame &sample, const Camera &camera, const DenoiseFrame *history,
+		const Camera *prevCamera, int maxHistory, float clampGamma, DenoiseFrame &out);
+	// Variance estimate and iterations a-trous iterations of frame, into the
+	// color and variance of out
+	void filter(const DenoiseFrame &frame, int iterations, DenoiseFrame &out);
+
+	int getThreadNum() const { return pool.size(); }
+	double getTemporalTime() const { return temporalTime; }
+	double getFilterTime() const { return filterTime; }
+
+	// Edge-stopping parameters, as the uniforms of the a-trous shader. The
+	// vector path rounds sigmaNormal to an integer power.
+	float sigmaDepth;
+	float sigmaNormal;
+	float sigmaLuminance;
+	int rowsPerTask;
+
+private:
+	// Color and variance planes of one a-trous pass
+	struct Planes {
+		std::vector<float> color[3];
+		std::vector<float> variance;
+	};
+
+	template<typename F>
+	void forRows(int height, F f);
+	void estimateRow(const DenoiseFrame &frame, int y, Planes &out) const;
+	void atrousRow(const DenoiseFrame &frame, const Planes &in, int y, int step, Planes &out) const;
+	void resolveRow(const DenoiseFrame &sample, const Camera &camera, const DenoiseFrame *history,
+		const Camera *prevCamera, int maxHistory, float clampGamma, int y, DenoiseFrame &out) const;
+
+	ThreadPool pool;
+	Planes passes[2];
+	double temporalTime;
+	double filterTime;
+};
+
+#endif
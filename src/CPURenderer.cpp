@@ -0,0 +1,447 @@
+#include "CPURenderer.h"
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+
+#include "BVHTree.h"
+#include "Camera.h"
+#include "CPUDenoiser.h"
+#include "Material.h"
+#include "RayPacket.h"
+#include "stb_image_write.h"
+#include "TraceEvents.h"
+
+using namespace std;
+
+// ************ Random numbers, same as randcore() in the shader ************** //
+static float randcore(unsigned int &wseed)
+{
+	unsigned int seed = wseed;
+	seed = (seed ^ 61u) ^ (seed >> 16u);
+	seed *= 9u;
+	seed = seed ^ (seed >> 4u);
+	seed *= 0x27d4eb2du;
+	wseed = seed ^ (seed >> 15u);
+	return float(wseed) * (1.0f / 4294967296.0f);
+}
+
+static glm::vec3 random_in_unit_sphere(unsigned int &wseed)
+{
+	glm::vec3 p;
+	do {
+		float x = randcore(wseed);
+		float y = randcore(wseed);
+		float z = randcore(wseed);
+		p = 2.0f * glm::vec3(x, y, z) - glm::vec3(1.0f, 1.0f, 1.0f);
+	} while (glm::dot(p, p) >= 1.0f);
+	return p;
+}
+
+static glm::vec3 diffuseReflection(const glm::vec3 &Normal, unsigned int &wseed)
+{
+	return glm::normalize(Normal + random_in_unit_sphere(wseed));
+}
+
+static glm::vec3 metalReflection(const glm::vec3 &rayIn, const glm::vec3 &Normal, unsigned int &wseed)
+{
+	return glm::normalize(rayIn - 2.0f * glm::dot(rayIn, Normal) * Normal + 0.35f * random_in_unit_sphere(wseed));
+}
+
+static glm::vec3 mirrorReflection(const glm::vec3 &rayIn, const glm::vec3 &Normal, unsigned int &wseed)
+{
+	return glm::normalize(rayIn - 2.0f * glm::dot(rayIn, Normal) * Normal + 0.01f * random_in_unit_sphere(wseed));
+}
+
+// Distance from the ray origin to the sphere, -1 if missed
+static float hitSphere(const glm::vec3 &center, float radius, const Ray &r)
+{
+	glm::vec3 oc = r.origin - center;
+	float a = glm::dot(r.direction, r.direction);
+	float b = 2.0f * glm::dot(oc, r.direction);
+	float c = glm::dot(oc, oc) - radius * radius;
+	float discriminant = b * b - 4 * a * c;
+	if (discriminant > 0.0f) {
+		float dis = (-b - sqrtf(discriminant)) / (2.0f * a);
+		if (dis > 0.0f) return dis;
+		else return -1.0f;
+	}
+	else return -1.0f;
+}
+
+CPURenderer::CPURenderer(int threadNum) :
+	tileSize(16),
+	pool(threadNum),
+	globalLight(1.0f),
+	meshAlbedo(1.0f),
+	meshMaterialIndex(DIFFUSE),
+	width(0),
+	height(0),
+	frameNum(0),
+	rayCount(0),
+	renderTime(0.0)
+{
+}
+
+CPURenderer::~CPURenderer()
+{
+}
+
+void CPURenderer::setScene(const vector<shared_ptr<Sphere>> &s, float light)
+{
+	vector<Sphere> spheres;
+	for (const auto &sphere : s) {
+		spheres.push_back(*sphere);
+	}
+	sphereTree = make_shared<BVHTree>();
+	sphereTree->BVHBuildSpheres(spheres);
+	globalLight = light;
+}
+
+void CPURenderer::setMesh(const shared_ptr<BVHTree> &mesh, const glm::vec3 &albedo, int materialIndex)
+{
+	compactMesh = CompactBVH();
+	meshNormals.clear();
+	if (mesh && mesh->nodeNum > 0) {
+		compactMesh.build(*mesh);
+		meshNormals.reserve(3 * mesh->primitives.size());
+		for (const auto &tri : mesh->primitives) {
+			meshNormals.push_back(tri->n0);
+			meshNormals.push_back(tri->n1);
+			meshNormals.push_back(tri->n2);
+		}
+	}
+	wideMesh.build(compactMesh);
+	meshAlbedo = albedo;
+	meshMaterialIndex = materialIndex;
+}
+
+void CPURenderer::render(const Camera &camera, int w, int h, int spp, float randOrigin, bool accumulate)
+{
+	TRACE_SCOPE("CPU render");
+	if (!accumulate || w != width || h != height) {
+		frameNum = 0;
+	}
+	width = w;
+	height = h;
+	if (frameNum == 0) {
+		colorBuffer.assign(width * height, glm::vec3(0.0f));
+		luminance1Buffer.assign(width * height, 0.0f);
+		luminance2Buffer.assign(width * height, 0.0f);
+	}
+	depthBuffer.assign(width * height, 0.0f);
+	normalBuffer.assign(width * height, glm::vec3(0.0f));
+
+	auto start = chrono::steady_clock::now();
+	atomic<long long> rays(0);
+	{
+		TaskGroup group(pool);
+		for (int y0 = 0; y0 < height; y0 += tileSize) {
+			for (int x0 = 0; x0 < width; x0 += tileSize) {
+				int x1 = min(x0 + tileSize, width);
+				int y1 = min(y0 + tileSize, height);
+				group.run([this, &camera, &rays, x0, y0, x1, y1, spp, randOrigin]() {
+					TRACE_SCOPE("render tile");
+					rays += renderTile(camera, x0, y0, x1, y1, spp, randOrigin);
+				});
+			}
+		}
+		group.wait();
+	}
+	auto end = chrono::steady_clock::now();
+
+	rayCount = rays.load();
+	renderTime = chrono::duration<double>(end - start).count();
+	frameNum++;
+}
+
+long long CPURenderer::renderTile(const Camera &camera, int x0, int y0, int x1, int y1, int spp, float randOrigin)
+{
+	long long rays = 0;
+	PixelState states[BlockSize];
+	Ray cameraRays[BlockSize];
+	glm::vec3 colors[BlockSize];
+	for (int by = y0; by < y1; by += BlockHeight) {
+		for (int bx = x0; bx < x1; bx += BlockWidth) {
+			int mask = 0;
+			for (int lane = 0; lane < BlockSize; ++lane) {
+				int i = bx + lane % BlockWidth;
+				int j = by + lane / BlockWidth;
+				if (i >= x1 || j >= y1) continue;
+				mask |= 1 << lane;
+				// Texture coordinate of the pixel center, as interpolated for the fragment
+				float x = ((float)i + 0.5f) / (float)width;
+				float y = ((float)j + 0.5f) / (float)height;
+				states[lane].wseed = (unsigned int)(randOrigin * 6.95857f * (x * y));
+				states[lane].rays = 0;
+
+				cameraRays[lane].origin = camera.cameraPos;
+				cameraRays[lane].direction = glm::normalize(camera.LeftBottomCorner + (x * 2.0f * camera.halfW) * camera.cameraRight + (y * 2.0f * camera.halfH) * camera.cameraUp);
+			}
+			shadeBlock(cameraRays, mask, spp, states, colors);
+
+			for (int lane = 0; lane < BlockSize; ++lane) {
+				if (!(mask & (1 << lane))) continue;
+				// Running mean over the frames, as in the shader
+				int index = (by + lane / BlockWidth) * width + bx + lane % BlockWidth;
+				glm::vec3 color = colors[lane];
+				float luminance = color.x * 0.30f + color.y * 0.59f + color.z * 0.11f;
+				if (frameNum > 0) {
+					float n = (float)(frameNum + 1);
+					color = (1.0f / n) * color + ((float)frameNum / n) * colorBuffer[index];
+					luminance1Buffer[index] = (luminance + frameNum * luminance1Buffer[index]) / n;
+					luminance2Buffer[index] = (luminance * luminance + frameNum * luminance2Buffer[index]) / n;
+				}
+				else {
+					luminance1Buffer[index] = luminance;
+					luminance2Buffer[index] = luminance * luminance;
+				}
+				colorBuffer[index] = color;
+				depthBuffer[index] = states[lane].depth;
+				normalBuffer[index] = states[lane].normal;
+				rays += states[lane].rays;
+			}
+		}
+	}
+	return rays;
+}
+
+void CPURenderer::shadeBlock(const Ray *cameraRays, int mask, int spp, PixelState *states, glm::vec3 *colors) const
+{
+	Ray rays[BlockSize];
+	glm::vec3 throughput[BlockSize];
+	float meshT[BlockSize];
+	int meshPrim[BlockSize];
+	for (int lane = 0; lane < BlockSize; ++lane) {
+		colors[lane] = glm::vec3(0.0f, 0.0f, 0.0f);
+	}
+	for (int sample = 0; sample < spp; sample++) {
+		// Rays still bouncing, and those of them that stay coherent: the camera
+		// rays and their reflections off mirrors
+		int active = mask;
+		int coherent = mask;
+		for (int lane = 0; lane < BlockSize; ++lane) {
+			rays[lane] = cameraRays[lane];
+			throughput[lane] = glm::vec3(1.0f, 1.0f, 1.0f);
+		}
+		for (int i = 0; i < 20 && active; i++) {
+			traceMesh(rays, active, coherent, meshT, meshPrim);
+			for (int lane = 0; lane < BlockSize; ++lane) {
+				if (!(active & (1 << lane))) continue;
+				Ray &tmpr = rays[lane];
+				glm::vec3 &color = throughput[lane];
+				PixelState &state = states[lane];
+				HitRecord rec;
+				if (hitScene(tmpr, i, meshT[lane], meshPrim[lane], rec, state)) {
+					tmpr.origin = rec.Pos;
+					if (rec.materialIndex == EMISSIVE) {
+						color *= rec.albedo;
+						active &= ~(1 << lane);
+						continue;
+					}
+					else if (rec.materialIndex == DIFFUSE)
+						tmpr.direction = diffuseReflection(rec.Normal, state.wseed);
+					else if (rec.materialIndex == METAL)
+						tmpr.direction = metalReflection(tmpr.direction, rec.Normal, state.wseed);
+					else if (rec.materialIndex == MIRROR)
+						tmpr.direction = mirrorReflection(tmpr.direction, rec.Normal, state.wseed);
+					if (rec.materialIndex != MIRROR) coherent &= ~(1 << lane);
+					color *= rec.albedo;
+				}
+				else {
+					// Sky
+					float a = 0.5f * (tmpr.direction.y + 1.0f);
+					color *= globalLight * ((1.0f - a) * glm::vec3(1.0f, 1.0f, 1.0f) + a * glm::vec3(0.5f, 0.7f, 1.0f));
+					active &= ~(1 << lane);
+				}
+			}
+			coherent &= active;
+		}
+		for (int lane = 0; lane < BlockSize; ++lane) {
+			colors[lane] = colors[lane] + throughput[lane];
+		}
+	}
+	for (int lane = 0; lane < BlockSize; ++lane) {
+		colors[lane] = colors[lane] / (float)spp;
+	}
+}
+
+void CPURenderer::traceMesh(const Ray *rays, int mask, int packetMask, float *meshT, int *meshPrim) const
+{
+	if (wideMesh.nodes.empty()) {
+		for (int lane = 0; lane < BlockSize; ++lane) {
+			meshPrim[lane] = -1;
+		}
+		return;
+	}
+	// A packet of a few rays costs more than tracing them one by one
+	packetMask &= mask;
+	if (popCount(packetMask) <= BlockSize / 4) packetMask = 0;
+	RayPacket<BlockSize> packet;
+	if (packetMask) {
+		for (int lane = 0; lane < BlockSize; ++lane) {
+			if (packetMask & (1 << lane)) packet.setRay(lane, rays[lane]);
+		}
+		IntersectPacketCompactBVH<BlockSize, KERNEL_WATERTIGHT>(compactMesh, packet);
+	}
+	for (int lane = 0; lane < BlockSize; ++lane) {
+		if (packetMask & (1 << lane)) {
+			meshT[lane] = packet.tMax[lane];
+			meshPrim[lane] = packet.primId[lane];
+		}
+		else if (mask & (1 << lane)) {
+			IntersectWideBVH<BVH_WIDTH, KERNEL_WATERTIGHT>(wideMesh, rays[lane], meshT[lane], meshPrim[lane]);
+		}
+	}
+}
+
+bool CPURenderer::hitScene(const Ray &r, int index, float meshT, int meshPrim, HitRecord &rec, PixelState &state) const
+{
+	float dis = 100000;
+	bool meshHit = meshPrim >= 0 && meshT < dis;
+	if (meshHit) {
+		dis = meshT;
+	}
+	bool hitAnything = false;
+	int hitSphereIndex = 0;
+	state.rays++;
+	const float *sphereArray = sphereTree ? sphereTree->MeshArray.data() : nullptr;
+	if (sphereTree) {
+		// Only spheres closer than the mesh hit
+		hitAnything = traverseBVHNodes<false>(*sphereTree, r, dis, [&](int i, float &tMax) {
+			const float *s = &sphereArray[i * BVHTree::SPHERE_FLOATS];
+			float dis_t = hitSphere(glm::vec3(s[0], s[1], s[2]), s[3], r);
+			if (dis_t > 0 && dis_t < tMax) {
+				tMax = dis = dis_t;
+				hitSphereIndex = i;
+				return true;
+			}
+			return false;
+		}, nullptr);
+	}
+	if (hitAnything) {
+		rec.Pos = r.origin + dis * r.direction;
+		const float *s = &sphereArray[hitSphereIndex * BVHTree::SPHERE_FLOATS];
+		rec.Normal = glm::normalize(r.origin + dis * r.direction - glm::vec3(s[0], s[1], s[2]));
+		rec.albedo = glm::vec3(s[4], s[5], s[6]);
+		rec.materialIndex = (int)s[7];
+	}
+	else if (meshHit) {
+		meshHitRecord(r, dis, meshPrim, rec);
+	}
+	if (meshHit || hitAnything) {
+		if (index == 0) {
+			state.depth = dis;
+			state.normal = rec.Normal;
+		}
+		return true;
+	}
+	else {
+		if (index == 0) {
+			state.depth = dis;
+			state.normal = glm::vec3(0.0f, 0.0f, 0.0f);
+		}
+		return false;
+	}
+}
+
+void CPURenderer::meshHitRecord(const Ray &r, float t, int primId, HitRecord &rec) const
+{
+	const uint32_t *tri = &compactMesh.indices[3 * primId];
+	glm::vec3 v0 = compactMesh.vertices[tri[0]], v1 = compactMesh.vertices[tri[1]], v2 = compactMesh.vertices[tri[2]];
+	glm::vec3 pos = r.origin + t * r.direction;
+	glm::vec3 geoNormal = glm::normalize(glm::cross(v1 - v0, v2 - v0));
+
+	// Barycentric coordinates of the hit point interpolate the vertex normals
+	glm::vec3 e1 = v1 - v0, e2 = v2 - v0, p = pos - v0;
+	float d11 = glm::dot(e1, e1), d12 = glm::dot(e1, e2), d22 = glm::dot(e2, e2);
+	float p1 = glm::dot(p, e1), p2 = glm::dot(p, e2);
+	float denom = d11 * d22 - d12 * d12;
+	float u = denom != 0.0f ? (d22 * p1 - d12 * p2) / denom : 0.0f;
+	float v = denom != 0.0f ? (d11 * p2 - d12 * p1) / denom : 0.0f;
+	const glm::vec3 *normals = &meshNormals[3 * primId];
+	glm::vec3 n = (1.0f - u - v) * normals[0] + u * normals[1] + v * normals[2];
+	float len = glm::length(n);
+	rec.Normal = len > 0.0f ? n / len : geoNormal;
+
+	// Normals facing the ray, and the hit point moved off the surface so
+	// that the next ray does not hit the same triangle again
+	if (glm::dot(rec.Normal, r.direction) > 0.0f) rec.Normal = -rec.Normal;
+	if (glm::dot(geoNormal, r.direction) > 0.0f) geoNormal = -geoNormal;
+	rec.Pos = pos + 1e-4f * geoNormal;
+	rec.albedo = meshAlbedo;
+	rec.materialIndex = meshMaterialIndex;
+}
+
+vector<unsigned char> CPURenderer::getImageBytes() const
+{
+	// Same 8 bit conversion as glReadPixels with GL_UNSIGNED_BYTE
+	vector<unsigned char> buffer(width * height * 3);
+	for (int i = 0; i < width * height; ++i) {
+		for (int c = 0; c < 3; ++c) {
+			float v = glm::clamp(colorBuffer[i][c], 0.0f, 1.0f);
+			buffer[3 * i + c] = (unsigned char)(v * 255.0f + 0.5f);
+		}
+	}
+	return buffer;
+}
+
+bool CPURenderer::saveImage(const string &filepath) const
+{
+	vector<unsigned char> buffer = getImageBytes();
+	stbi_flip_vertically_on_write(true);
+	int rc = stbi_write_png(filepath.c_str(), width, height, 3, buffer.data(), 3 * width);
+	if(rc) {
+		cout << "Wrote to " << filepath << endl;
+	} else {
+		cout << "Couldn't write to " << filepath << endl;
+	}
+	return rc != 0;
+}
+
+double CPURenderer::meanVariance(const vector<float> &luminance1, const vector<float> &luminance2, int frameNum)
+{
+	if (frameNum == 0 || luminance1.empty()) return 0.0;
+	double sum = 0.0;
+	for (size_t i = 0; i < luminance1.size(); ++i) {
+		double m1 = luminance1[i];
+		sum += max(0.0, (double)luminance2[i] - m1 * m1);
+	}
+	return sum / luminance1.size() / frameNum;
+}
+
+vector<float> CPURenderer::getVariance() const
+{
+	vector<float> variance(luminance1Buffer.size(), 0.0f);
+	if (frameNum == 0) return variance;
+	for (size_t i = 0; i < variance.size(); ++i) {
+		float m1 = luminance1Buffer[i];
+		variance[i] = max(0.0f, luminance2Buffer[i] - m1 * m1) / frameNum;
+	}
+	return variance;
+}
+
+void CPURenderer::getDenoiseFrame(DenoiseFrame &frame) const
+{
+	frame.resize(width, height);
+	float count = (float)max(1, frameNum);
+	for (int i = 0; i < width * height; ++i) {
+		for (int c = 0; c < 3; ++c) {
+			frame.color[c][i] = colorBuffer[i][c];
+			frame.normal[c][i] = normalBuffer[i][c];
+		}
+		frame.depth[i] = depthBuffer[i];
+		frame.count[i] = count;
+		frame.luminance1[i] = luminance1Buffer[i];
+		frame.luminance2[i] = luminance2Buffer[i];
+	}
+}
+
+void CPURenderer::printStats() const
+{
+	double raysPerSec = renderTime > 0.0 ? rayCount / renderTime : 0.0;
+	cout << "CPU render " << width << "x" << height << " on " << pool.size() << " threads: "
+		<< renderTime * 1000.0 << " ms, " << rayCount << " rays, "
+		<< raysPerSec / 1.0e6 << " Mrays/s" << endl;
+}
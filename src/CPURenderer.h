@@ -0,0 +1,123 @@
+#pragma once
+#ifndef CPURENDERER_H
+#define CPURENDERER_H
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "CompactBVH.h"
+#include "Geometry.h"
+#include "Sphere.h"
+#include "ThreadPool.h"
+#include "WideBVH.h"
+
+class BVHTree;
+class Camera;
+struct DenoiseFrame;
+
+/**
+ * CPU path tracer. Traces the same spheres, mesh, materials and sky as
+ * RayTracerFragmentShader.glsl, including its random number generator, so
+ * that a frame can be compared pixel by pixel with the OpenGL output.
+ * The screen is split into tiles which are rendered by a work-stealing pool.
+ * A tile is shaded in blocks of 4x4 pixels; the primary rays of a block, and
+ * those of their bounces that leave a mirror, are traced through the mesh
+ * as one packet.
+ * Pixels are stored bottom row first, like the OpenGL framebuffer.
+ * With accumulate, render() averages the new frame into the previous ones of
+ * the same size, like the accumulate mode of the shader.
+ */
+class CPURenderer
+{
+public:
+	CPURenderer(int threadNum = 0);
+	virtual ~CPURenderer();
+
+	// Builds the BVH of the spheres
+	void setScene(const std::vector<std::shared_ptr<Sphere>> &spheres, float globalLight);
+	// Triangle mesh, or none if mesh is null. The renderer keeps its own
+	// layouts of the BVH, the float encoded tree is not used.
+	void setMesh(const std::shared_ptr<BVHTree> &mesh, const glm::vec3 &albedo, int materialIndex);
+	void render(const Camera &camera, int width, int height, int spp, float randOrigin, bool accumulate = false);
+	bool saveImage(const std::string &filepath) const;
+	// Color as 8 bit RGB, bottom row first
+	std::vector<unsigned char> getImageBytes() const;
+	void printStats() const;
+
+	int getWidth() const { return width; }
+	int getHeight() const { return height; }
+	int getThreadNum() const { return pool.size(); }
+	const std::vector<glm::vec3> &getColor() const { return colorBuffer; }
+	const std::vector<float> &getDepth() const { return depthBuffer; }
+	const std::vector<glm::vec3> &getNormal() const { return normalBuffer; }
+	long long getRayCount() const { return rayCount; }
+	double getRenderTime() const { return renderTime; }
+	int getFrameNum() const { return frameNum; }
+	double getMeanVariance() const { return meanVariance(luminance1Buffer, luminance2Buffer, frameNum); }
+	// Per pixel variance of the accumulated luminance
+	std::vector<float> getVariance() const;
+	// The frame as the planes of CPUDenoiser, with the frames averaged as count
+	void getDenoiseFrame(DenoiseFrame &frame) const;
+
+	// Mean over the pixels of the variance of a mean of frameNum frames,
+	// from the per pixel means of the luminance and of its square
+	static double meanVariance(const std::vector<float> &luminance1, const std::vector<float> &luminance2, int frameNum);
+
+	int tileSize;
+
+private:
+	// Pixels of a block, shaded together
+	static const int BlockWidth = 4;
+	static const int BlockHeight = 4;
+	static const int BlockSize = BlockWidth * BlockHeight;
+
+	// Per pixel state of shadeBlock(), the counterpart of the shader globals
+	struct PixelState {
+		unsigned int wseed;
+		float depth;
+		glm::vec3 normal;
+		long long rays;
+	};
+	struct HitRecord {
+		glm::vec3 Normal;
+		glm::vec3 Pos;
+		glm::vec3 albedo;
+		int materialIndex;
+	};
+
+	long long renderTile(const Camera &camera, int x0, int y0, int x1, int y1, int spp, float randOrigin);
+	// Color of the pixels in mask, the counterpart of shading() in the shader
+	void shadeBlock(const Ray *cameraRays, int mask, int spp, PixelState *states, glm::vec3 *colors) const;
+	// Closest mesh hits of the rays in mask, primId -1 if missed. The rays in
+	// packetMask are traced as a packet, the others one by one.
+	void traceMesh(const Ray *rays, int mask, int packetMask, float *meshT, int *meshPrim) const;
+	// Closest hit among the spheres and the mesh hit found by traceMesh
+	bool hitScene(const Ray &r, int index, float meshT, int meshPrim, HitRecord &rec, PixelState &state) const;
+	// Fills rec for the mesh triangle primId hit at distance t
+	void meshHitRecord(const Ray &r, float t, int primId, HitRecord &rec) const;
+
+	ThreadPool pool;
+	std::shared_ptr<BVHTree> sphereTree; // spheres in leaf order, see BVHTree::BVHBuildSpheres
+	float globalLight;
+	CompactBVH compactMesh; // traced by the packets
+	WideBVH<BVH_WIDTH> wideMesh; // traced by single rays
+	std::vector<glm::vec3> meshNormals; // vertex normals of the triangles of compactMesh
+	glm::vec3 meshAlbedo;
+	int meshMaterialIndex;
+
+	int width;
+	int height;
+	std::vector<glm::vec3> colorBuffer;
+	std::vector<float> depthBuffer;
+	std::vector<glm::vec3> normalBuffer;
+	std::vector<float> luminance1Buffer;
+	std::vector<float> luminance2Buffer;
+	int frameNum; // frames averaged in colorBuffer
+	long long rayCount;
+	double renderTime;
+};
+
+#endif
@@ -108,6 +108,16 @@ public:
 
 		LoopNum = 0;
 	}
+	// Moves the camera to a view of a camera path
+	void setView(const glm::vec3 &position, float yaw, float pitch, float fieldOfView) {
+		cameraPos = position;
+		Yaw = yaw;
+		Pitch = glm::clamp(pitch, -89.0f, 89.0f);
+		fov = glm::clamp(fieldOfView, 1.0f, 45.0f);
+		halfH = glm::tan(glm::radians(fov));
+		halfW = halfH * ScreenRatio;
+		updateCameraVectors();
+	}
 	void LoopIncrease() {
 		LoopNum++;
 	}
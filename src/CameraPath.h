@@ -0,0 +1,112 @@
+#pragma once
+#ifndef CAMERAPATH_H
+#define CAMERAPATH_H
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+// Camera state at one time of a path
+struct CameraKey {
+	float time;
+	glm::vec3 position;
+	float yaw;
+	float pitch;
+	float fov;
+};
+
+/**
+ * Keyframed camera fly-through. The path file has one key per line,
+ * "time x y z yaw pitch fov", with times in seconds in increasing order;
+ * empty lines and lines starting with # are ignored. Between two keys every
+ * value follows a Catmull-Rom spline through the neighbouring keys.
+ */
+class CameraPath {
+public:
+	bool load(const std::string &filepath) {
+		keys.clear();
+		std::ifstream in(filepath);
+		if (!in) {
+			std::cerr << "Couldn't open camera path " << filepath << std::endl;
+			return false;
+		}
+		std::string line;
+		int lineNum = 0;
+		while (std::getline(in, line)) {
+			lineNum++;
+			size_t first = line.find_first_not_of(" \t\r");
+			if (first == std::string::npos || line[first] == '#') {
+				continue;
+			}
+			std::istringstream ss(line);
+			CameraKey key;
+			if (!(ss >> key.time >> key.position.x >> key.position.y >> key.position.z >> key.yaw >> key.pitch >> key.fov)) {
+				std::cerr << filepath << ":" << lineNum << ": expected time x y z yaw pitch fov" << std::endl;
+				keys.clear();
+				return false;
+			}
+			if (!keys.empty() && key.time <= keys.back().time) {
+				std::cerr << filepath << ":" << lineNum << ": key times must increase" << std::endl;
+				keys.clear();
+				return false;
+			}
+			keys.push_back(key);
+		}
+		if (keys.empty()) {
+			std::cerr << "Camera path " << filepath << " has no keys" << std::endl;
+			return false;
+		}
+		return true;
+	}
+
+	bool empty() const { return keys.empty(); }
+	float getDuration() const { return keys.empty() ? 0.0f : keys.back().time - keys.front().time; }
+	// Frames of the path at fps, the first on the first key and the last on or before the last key
+	int getFrameNum(float fps) const {
+		return keys.empty() ? 0 : (int)(getDuration() * fps + 1e-4f) + 1;
+	}
+
+	// Camera at time, clamped to the path
+	CameraKey sample(float time) const {
+		if (time <= keys.front().time) return keys.front();
+		if (time >= keys.back().time) return keys.back();
+		size_t i = std::upper_bound(keys.begin(), keys.end(), time,
+			[](float t, const CameraKey &key) { return t < key.time; }) - keys.begin() - 1;
+		const CameraKey &k0 = keys[i > 0 ? i - 1 : i];
+		const CameraKey &k1 = keys[i];
+		const CameraKey &k2 = keys[i + 1];
+		const CameraKey &k3 = keys[i + 2 < keys.size() ? i + 2 : i + 1];
+		float t = (time - k1.time) / (k2.time - k1.time);
+
+		CameraKey key;
+		key.time = time;
+		key.position = spline(k0.position, k1.position, k2.position, k3.position, t);
+		key.yaw = spline(k0.yaw, k1.yaw, k2.yaw, k3.yaw, t);
+		key.pitch = spline(k0.pitch, k1.pitch, k2.pitch, k3.pitch, t);
+		key.fov = spline(k0.fov, k1.fov, k2.fov, k3.fov, t);
+		return key;
+	}
+
+	// Camera of frame at fps
+	CameraKey getFrame(int frame, float fps) const {
+		return sample(keys.front().time + frame / fps);
+	}
+
+private:
+	template<typename T>
+	static T spline(const T &p0, const T &p1, const T &p2, const T &p3, float t) {
+		float t2 = t * t;
+		float t3 = t2 * t;
+		return 0.5f * ((2.0f * p1) + (p2 - p0) * t + (2.0f * p0 - 5.0f * p1 + 4.0f * p2 - p3) * t2
+			+ (3.0f * p1 - p0 - 3.0f * p2 + p3) * t3);
+	}
+
+	std::vector<CameraKey> keys;
+};
+
+#endif
@@ -0,0 +1,174 @@
+#pragma once
+#ifndef COMPACTBVH_H
+#define COMPACTBVH_H
+
+#include <cassert>
+#include <cfloat>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "BVHTree.h"
+#include "Geometry.h"
+#include "TriangleKernel.h"
+
+/**
+ * CPU traversal layout of a BVHTree. The float encoded NodeArray is meant
+ * for the shader; here nodes keep integer offsets and a packed primitive
+ * count and axis so that two of them fit in one 64 byte cache line.
+ */
+struct alignas(32) CompactBVHNode {
+	glm::vec3 pMin;
+	int32_t offset;       // primitives offset for leaves, second child for interior nodes
+	glm::vec3 pMax;
+	uint16_t nPrimitives; // 0 for interior nodes
+	uint8_t axis;
+	uint8_t pad;
+};
+static_assert(sizeof(CompactBVHNode) == 32, "CompactBVHNode should be 32 bytes");
+
+class CompactBVH {
+public:
+	std::vector<CompactBVHNode> nodes;
+	// Shared vertices and three indices per triangle, in BVH leaf order
+	std::vector<glm::vec3> vertices;
+	std::vector<uint32_t> indices;
+
+	void build(const BVHTree &tree) {
+		nodes.assign(tree.nodeNum, CompactBVHNode());
+		for (int i = 0; i < tree.nodeNum; ++i) {
+			LinearBVHNode node = tree.getLinearNode(i);
+			CompactBVHNode &c = nodes[i];
+			assert(node.nPrimitives <= UINT16_MAX);
+			c.pMin = node.pMin;
+			c.pMax = node.pMax;
+			c.offset = (int32_t)node.childOffset;
+			c.nPrimitives = (uint16_t)node.nPrimitives;
+			c.axis = (uint8_t)node.axis;
+			c.pad = 0;
+		}
+
+		// Merge vertices shared by neighbouring triangles, keyed on their exact bits
+		struct VertexKey {
+			uint32_t bits[3];
+			bool operator==(const VertexKey &o) const {
+				return bits[0] == o.bits[0] && bits[1] == o.bits[1] && bits[2] == o.bits[2];
+			}
+		};
+		struct VertexHash {
+			size_t operator()(const VertexKey &k) const {
+				size_t h = k.bits[0];
+				h = h * 0x9E3779B1u ^ k.bits[1];
+				h = h * 0x9E3779B1u ^ k.bits[2];
+				return h;
+			}
+		};
+		std::unordered_map<VertexKey, uint32_t, VertexHash> vertexIndex;
+		vertices.clear();
+		indices.clear();
+		indices.reserve(tree.primitives.size() * 3);
+		auto addVertex = [&](const glm::vec3 &v) {
+			VertexKey key;
+			std::memcpy(&key.bits[0], &v.x, sizeof(float));
+			std::memcpy(&key.bits[1], &v.y, sizeof(float));
+			std::memcpy(&key.bits[2], &v.z, sizeof(float));
+			auto it = vertexIndex.find(key);
+			if (it == vertexIndex.end()) {
+				it = vertexIndex.emplace(key, (uint32_t)vertices.size()).first;
+				vertices.push_back(v);
+			}
+			indices.push_back(it->second);
+		};
+		for (const auto &tri : tree.primitives) {
+			addVertex(tri->v0);
+			addVertex(tri->v1);
+			addVertex(tri->v2);
+		}
+	}
+
+	int triangleNum() const { return (int)indices.size() / 3; }
+	size_t memoryUsage() const {
+		return nodes.size() * sizeof(CompactBVHNode) + vertices.size() * sizeof(glm::vec3)
+			+ indices.size() * sizeof(uint32_t);
+	}
+};
+
+// Closest hit in the subtree of rootIndex. tMax and primId hold the closest
+// hit so far and are updated; visited counts the nodes tested.
+template<TriangleKernel kernel = KERNEL_SCALAR>
+inline void traverseCompactBVH(const CompactBVH &bvh, const Ray &ray, int rootIndex,
+	float &tMax, int &primId, long long &visited) {
+	glm::vec3 invDir(1 / ray.direction.x, 1 / ray.direction.y, 1 / ray.direction.z);
+	WatertightRay wr{};
+	if constexpr (kernel == KERNEL_WATERTIGHT)
+		wr = makeWatertightRay(ray);
+	int dirIsNeg[3] = { invDir.x < 0, invDir.y < 0, invDir.z < 0 };
+	const CompactBVHNode *nodes = bvh.nodes.data();
+	const glm::vec3 *vertices = bvh.vertices.data();
+	const uint32_t *indices = bvh.indices.data();
+
+	int toVisitOffset = 0, currentNodeIndex = rootIndex;
+	int nodesToVisit[64];
+	while (true) {
+		const CompactBVHNode &node = nodes[currentNodeIndex];
+		visited++;
+		if (IntersectBox(node.pMin, node.pMax, ray, invDir, dirIsNeg, tMax)) {
+			if (node.nPrimitives > 0) {
+				for (int i = 0; i < node.nPrimitives; ++i) {
+					const uint32_t *tri = &indices[3 * (node.offset + i)];
+					if constexpr (kernel == KERNEL_WATERTIGHT) {
+						float t, u, v;
+						if (hitTriangleWatertight(vertices[tri[0]], vertices[tri[1]], vertices[tri[2]], wr, tMax, t, u, v)) {
+							tMax = t;
+							primId = node.offset + i;
+						}
+					}
+					else {
+						float t = hitTriangle(vertices[tri[0]], vertices[tri[1]], vertices[tri[2]], ray);
+						if (t > 0.0f && t < tMax) {
+							tMax = t;
+							primId = node.offset + i;
+						}
+					}
+				}
+				if (toVisitOffset == 0) break;
+				currentNodeIndex = nodesToVisit[--toVisitOffset];
+			}
+			else {
+				// Visit the near child first so that tMax shrinks early
+				if (dirIsNeg[node.axis]) {
+					nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
+					currentNodeIndex = node.offset;
+				}
+				else {
+					nodesToVisit[toVisitOffset++] = node.offset;
+					currentNodeIndex = currentNodeIndex + 1;
+				}
+			}
+		}
+		else {
+			if (toVisitOffset == 0) break;
+			currentNodeIndex = nodesToVisit[--toVisitOffset];
+		}
+	}
+}
+
+// Closest hit, returns the distance in tHit and the triangle index in primId.
+// nodesVisited, if given, is increased by the number of nodes tested.
+template<TriangleKernel kernel = KERNEL_SCALAR>
+inline bool IntersectCompactBVH(const CompactBVH &bvh, const Ray &ray, float &tHit, int &primId,
+	long long *nodesVisited = nullptr) {
+	primId = -1;
+	if (bvh.nodes.empty()) return false;
+	float tMax = FLT_MAX;
+	long long visited = 0;
+	traverseCompactBVH<kernel>(bvh, ray, 0, tMax, primId, visited);
+	if (nodesVisited) *nodesVisited += visited;
+	tHit = tMax;
+	return primId >= 0;
+}
+
+#endif
@@ -0,0 +1,262 @@
+#pragma once
+#ifndef GPUPROFILER_H
+#define GPUPROFILER_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#define GLEW_STATIC
+#include <GL/glew.h>
+
+// Min, mean and 99th percentile of the last windowSize samples
+class RollingStats {
+public:
+	RollingStats(int windowSize = 512) : window(windowSize > 0 ? windowSize : 1), next(0), count(0) {
+		samples.resize(window);
+	}
+
+	void add(double value) {
+		samples[next] = value;
+		next = (next + 1) % window;
+		count++;
+	}
+
+	int getCount() const { return count; }
+	int getWindow() const { return window; }
+	double getMin() const { return count == 0 ? 0.0 : *std::min_element(samples.begin(), samples.begin() + size()); }
+	double getMean() const {
+		double sum = 0.0;
+		for (int i = 0; i < size(); ++i) sum += samples[i];
+		return count == 0 ? 0.0 : sum / size();
+	}
+	double getPercentile(double p) const {
+		if (count == 0) return 0.0;
+		std::vector<double> sorted(samples.begin(), samples.begin() + size());
+		size_t k = std::min(sorted.size() - 1, (size_t)(p * (sorted.size() - 1) + 0.5));
+		std::nth_element(sorted.begin(), sorted.begin() + k, sorted.end());
+		return sorted[k];
+	}
+
+private:
+	int size() const { return count < window ? count : window; }
+
+	int window;
+	int next;
+	int count;
+	std::vector<double> samples;
+};
+
+/**
+ * Per pass frame timing. The GPU passes are timed with GL_TIME_ELAPSED
+ * queries, the CPU passes and the whole frame with the wall clock. Every
+ * frame has a slot in a ring of ringSize frames; the query results are
+ * collected without waiting once the GPU has finished the frame, usually a
+ * frame or two later. A slot whose results are still pending when it comes
+ * round again is dropped rather than waited for. Each finished frame feeds
+ * the rolling statistics and, if a CSV file is open, one CSV row in ms.
+ * A pass that did not run in a frame, such as the readback of frames that
+ * are not saved, is left out of its statistics and empty in the CSV.
+ */
+class GPUProfiler {
+public:
+	GPUProfiler() : current(0), frameNum(0), droppedNum(0), csv(NULL) {}
+	~GPUProfiler() { closeCSV(); }
+
+	void Init(const std::vector<std::string> &gpuPassNames, const std::vector<std::string> &cpuPassNames, int ringSize = 8) {
+		gpuNames = gpuPassNames;
+		cpuNames = cpuPassNames;
+		slots.assign(ringSize > 0 ? ringSize : 1, Slot());
+		for (Slot &slot : slots) {
+			slot.queries.resize(gpuNames.size());
+			glGenQueries((GLsizei)slot.queries.size(), slot.queries.data());
+			slot.used.assign(gpuNames.size(), false);
+			slot.cpuTime.assign(cpuNames.size(), -1.0);
+		}
+		gpuStats.assign(gpuNames.size(), RollingStats());
+		cpuStats.assign(cpuNames.size(), RollingStats());
+		frameStats = RollingStats();
+		current = 0;
+		frameStart = std::chrono::steady_clock::now();
+	}
+
+	// Writes one row per finished frame to filepath
+	bool openCSV(const std::string &filepath) {
+		closeCSV();
+		csv = fopen(filepath.c_str(), "w");
+		if (!csv) {
+			std::cerr << "Couldn't write to " << filepath << std::endl;
+			return false;
+		}
+		fprintf(csv, "frame");
+		for (const std::string &name : gpuNames) fprintf(csv, ",%s_gpu_ms", name.c_str());
+		for (const std::string &name : cpuNames) fprintf(csv, ",%s_cpu_ms", name.c_str());
+		fprintf(csv, ",frame_ms\n");
+		return true;
+	}
+
+	// GPU passes may not overlap, GL_TIME_ELAPSED queries do not nest
+	void begin(int pass) {
+		glBeginQuery(GL_TIME_ELAPSED, slots[current].queries[pass]);
+	}
+	void end(int pass) {
+		glEndQuery(GL_TIME_ELAPSED);
+		slots[current].used[pass] = true;
+	}
+
+	// Time of CPU pass in seconds for the current frame
+	void setCPUTime(int pass, double seconds) {
+		slots[current].cpuTime[pass] = seconds;
+	}
+
+	// Closes the current frame and collects the finished ones
+	void endFrame() {
+		auto now = std::chrono::steady_clock::now();
+		Slot &slot = slots[current];
+		slot.frame = frameNum++;
+		slot.frameTime = std::chrono::duration<double>(now - frameStart).count();
+		slot.pending = true;
+		frameStart = now;
+		poll();
+		current = (current + 1) % (int)slots.size();
+		// The next slot is reused now, its frame is dropped if still in flight
+		Slot &next = slots[current];
+		if (next.pending) {
+			droppedNum++;
+			next.pending = false;
+		}
+		next.used.assign(gpuNames.size(), false);
+		next.cpuTime.assign(cpuNames.size(), -1.0);
+	}
+
+	// Collects, oldest first, the frames whose results are available
+	void poll() {
+		for (int i = 1; i <= (int)slots.size(); ++i) {
+			Slot &slot = slots[(current + i) % slots.size()];
+			if (!slot.pending) continue;
+			if (!collect(slot)) break;
+		}
+	}
+
+	void printStats(std::ostream &out = std::cout) const {
+		out << "Frame profile over the last " << std::min(frameStats.getCount(), frameStats.getWindow()) << " of " << frameStats.getCount()
+			<< " frames (ms, min / avg / p99)";
+		if (droppedNum > 0) out << ", " << droppedNum << " frames dropped";
+		out << std::endl;
+		for (size_t i = 0; i < gpuNames.size(); ++i) printLine(out, gpuNames[i] + " (GPU)", gpuStats[i]);
+		for (size_t i = 0; i < cpuNames.size(); ++i) printLine(out, cpuNames[i] + " (CPU)", cpuStats[i]);
+		printLine(out, "frame", frameStats);
+	}
+
+	// One line summary, such as the window title
+	std::string getSummary() const {
+		std::string summary;
+		char text[64];
+		for (size_t i = 0; i < gpuNames.size(); ++i) {
+			snprintf(text, sizeof(text), "%s %.2f ms  ", gpuNames[i].c_str(), gpuStats[i].getMean());
+			summary += text;
+		}
+		for (size_t i = 0; i < cpuNames.size(); ++i) {
+			snprintf(text, sizeof(text), "%s %.2f ms  ", cpuNames[i].c_str(), cpuStats[i].getMean());
+			summary += text;
+		}
+		snprintf(text, sizeof(text), "frame %.2f ms", frameStats.getMean());
+		return summary + text;
+	}
+
+	const RollingStats &getGPUStats(int pass) const { return gpuStats[pass]; }
+	const RollingStats &getCPUStats(int pass) const { return cpuStats[pass]; }
+	const RollingStats &getFrameStats() const { return frameStats; }
+	int getDroppedNum() const { return droppedNum; }
+
+	// Waits for the frames in flight, then releases the queries
+	void Delete() {
+		for (int i = 1; i <= (int)slots.size(); ++i) {
+			Slot &slot = slots[(current + i) % slots.size()];
+			if (slot.pending) collect(slot, true);
+		}
+		for (Slot &slot : slots) {
+			glDeleteQueries((GLsizei)slot.queries.size(), slot.queries.data());
+		}
+		slots.clear();
+		closeCSV();
+	}
+
+private:
+	struct Slot {
+		std::vector<GLuint> queries;
+		std::vector<bool> used;
+		std::vector<double> cpuTime;
+		double frameTime = 0.0;
+		int frame = 0;
+		bool pending = false;
+	};
+
+	// Returns false, without waiting unless block, if a result is not ready
+	bool collect(Slot &slot, bool block = false) {
+		for (size_t i = 0; i < slot.queries.size(); ++i) {
+			if (!slot.used[i] || block) continue;
+			GLint available = 0;
+			glGetQueryObjectiv(slot.queries[i], GL_QUERY_RESULT_AVAILABLE, &available);
+			if (!available) return false;
+		}
+		std::vector<double> gpuTime(slot.queries.size(), -1.0);
+		for (size_t i = 0; i < slot.queries.size(); ++i) {
+			if (!slot.used[i]) continue;
+			GLuint64 ns = 0;
+			glGetQueryObjectui64v(slot.queries[i], GL_QUERY_RESULT, &ns);
+			gpuTime[i] = ns * 1e-9;
+			gpuStats[i].add(gpuTime[i] * 1000.0);
+		}
+		for (size_t i = 0; i < slot.cpuTime.size(); ++i) {
+			if (slot.cpuTime[i] >= 0.0) cpuStats[i].add(slot.cpuTime[i] * 1000.0);
+		}
+		frameStats.add(slot.frameTime * 1000.0);
+		if (csv) {
+			fprintf(csv, "%d", slot.frame);
+			for (double t : gpuTime) writeCSVTime(t);
+			for (double t : slot.cpuTime) writeCSVTime(t);
+			writeCSVTime(slot.frameTime);
+			fprintf(csv, "\n");
+		}
+		slot.pending = false;
+		return true;
+	}
+
+	void writeCSVTime(double seconds) {
+		if (seconds >= 0.0) fprintf(csv, ",%.4f", seconds * 1000.0);
+		else fprintf(csv, ",");
+	}
+
+	static void printLine(std::ostream &out, const std::string &name, const RollingStats &stats) {
+		if (stats.getCount() == 0) return;
+		char line[160];
+		snprintf(line, sizeof(line), "  %-16s %9.3f %9.3f %9.3f", name.c_str(),
+			stats.getMin(), stats.getMean(), stats.getPercentile(0.99));
+		out << line << std::endl;
+	}
+
+	void closeCSV() {
+		if (csv) {
+			fclose(csv);
+			csv = NULL;
+		}
+	}
+
+	std::vector<std::string> gpuNames;
+	std::vector<std::string> cpuNames;
+	std::vector<Slot> slots;
+	std::vector<RollingStats> gpuStats;
+	std::vector<RollingStats> cpuStats;
+	RollingStats frameStats;
+	int current;
+	int frameNum;
+	int droppedNum;
+	FILE *csv;
+	std::chrono::steady_clock::time_point frameStart;
+};
+
+#endif
@@ -0,0 +1,128 @@
+#pragma once
+#ifndef GEOMETRY_H
+#define GEOMETRY_H
+
+#include <cfloat>
+#include <cmath>
+
+#include <glm/glm.hpp>
+
+struct Ray {
+	glm::vec3 origin;
+	glm::vec3 direction;
+};
+
+// Axis aligned bounding box, empty when pMin > pMax
+struct Bound3f {
+	Bound3f() : pMin(FLT_MAX), pMax(-FLT_MAX) {}
+	Bound3f(const glm::vec3 &p) : pMin(p), pMax(p) {}
+	Bound3f(const glm::vec3 &p1, const glm::vec3 &p2) :
+		pMin(glm::min(p1, p2)), pMax(glm::max(p1, p2)) {}
+
+	bool Empty() const {
+		return pMin.x > pMax.x || pMin.y > pMax.y || pMin.z > pMax.z;
+	}
+	glm::vec3 Diagonal() const { return pMax - pMin; }
+	float SurfaceArea() const {
+		if (Empty()) return 0.0f;
+		glm::vec3 d = Diagonal();
+		return 2.0f * (d.x * d.y + d.x * d.z + d.y * d.z);
+	}
+	int MaximumExtent() const {
+		glm::vec3 d = Diagonal();
+		if (d.x > d.y && d.x > d.z)
+			return 0;
+		else if (d.y > d.z)
+			return 1;
+		else
+			return 2;
+	}
+	// Position of p relative to the box, 0 at pMin and 1 at pMax
+	glm::vec3 Offset(const glm::vec3 &p) const {
+		glm::vec3 o = p - pMin;
+		if (pMax.x > pMin.x) o.x /= pMax.x - pMin.x;
+		if (pMax.y > pMin.y) o.y /= pMax.y - pMin.y;
+		if (pMax.z > pMin.z) o.z /= pMax.z - pMin.z;
+		return o;
+	}
+	const glm::vec3 &operator[](int i) const { return i == 0 ? pMin : pMax; }
+
+	glm::vec3 pMin, pMax;
+};
+
+inline Bound3f Union(const Bound3f &b, const glm::vec3 &p) {
+	Bound3f ret;
+	ret.pMin = glm::min(b.pMin, p);
+	ret.pMax = glm::max(b.pMax, p);
+	return ret;
+}
+
+inline Bound3f Union(const Bound3f &b1, const Bound3f &b2) {
+	Bound3f ret;
+	ret.pMin = glm::min(b1.pMin, b2.pMin);
+	ret.pMax = glm::max(b1.pMax, b2.pMax);
+	return ret;
+}
+
+// 1 + 2 * gamma(3) as in pbrt: scaling the far slab distance by it makes the
+// box test conservative, so rounding never culls a triangle lying on a face
+const float BoxFarScale = 1.0000004f;
+
+// Slab test against [0, tMax), dirIsNeg[i] is 1 if the ray direction is negative along axis i
+inline bool IntersectBox(const glm::vec3 &pMin, const glm::vec3 &pMax, const Ray &ray,
+	const glm::vec3 &invDir, const int dirIsNeg[3], float tMax) {
+	const glm::vec3 &nearX = dirIsNeg[0] ? pMax : pMin, &farX = dirIsNeg[0] ? pMin : pMax;
+	const glm::vec3 &nearY = dirIsNeg[1] ? pMax : pMin, &farY = dirIsNeg[1] ? pMin : pMax;
+	const glm::vec3 &nearZ = dirIsNeg[2] ? pMax : pMin, &farZ = dirIsNeg[2] ? pMin : pMax;
+	float t0 = (nearX.x - ray.origin.x) * invDir.x;
+	float t1 = (farX.x - ray.origin.x) * invDir.x;
+	float ty0 = (nearY.y - ray.origin.y) * invDir.y;
+	float ty1 = (farY.y - ray.origin.y) * invDir.y;
+	float tz0 = (nearZ.z - ray.origin.z) * invDir.z;
+	float tz1 = (farZ.z - ray.origin.z) * invDir.z;
+	t0 = glm::max(t0, glm::max(ty0, tz0));
+	t1 = glm::min(t1, glm::min(ty1, tz1)) * BoxFarScale;
+	return t0 <= t1 && t1 > 0.0f && t0 < tMax;
+}
+
+// Positions and vertex normals, the normals are the face normal if the mesh has none
+struct Triangle {
+	glm::vec3 v0, v1, v2;
+	glm::vec3 n0, n1, n2;
+};
+
+inline Bound3f getTriangleBound(const Triangle &tri) {
+	return Union(Bound3f(tri.v0, tri.v1), tri.v2);
+}
+
+// Moller-Trumbore. On a hit closer than tMax, returns the distance in t and the
+// barycentric coordinates of v1 and v2 in u and v.
+inline bool hitTriangle(const glm::vec3 &v0, const glm::vec3 &v1, const glm::vec3 &v2, const Ray &ray,
+	float tMax, float &t, float &u, float &v) {
+	glm::vec3 e1 = v1 - v0;
+	glm::vec3 e2 = v2 - v0;
+	glm::vec3 p = glm::cross(ray.direction, e2);
+	float det = glm::dot(e1, p);
+	if (fabsf(det) < 1e-8f) return false;
+	float invDet = 1.0f / det;
+	glm::vec3 s = ray.origin - v0;
+	u = glm::dot(s, p) * invDet;
+	if (u < 0.0f || u > 1.0f) return false;
+	glm::vec3 q = glm::cross(s, e1);
+	v = glm::dot(ray.direction, q) * invDet;
+	if (v < 0.0f || u + v > 1.0f) return false;
+	t = glm::dot(e2, q) * invDet;
+	return t > 0.0f && t < tMax;
+}
+
+// Returns the distance to the triangle or -1 if missed
+inline float hitTriangle(const glm::vec3 &v0, const glm::vec3 &v1, const glm::vec3 &v2, const Ray &ray) {
+	float t, u, v;
+	return hitTriangle(v0, v1, v2, ray, FLT_MAX, t, u, v) ? t : -1.0f;
+}
+
+inline float hitTriangle(const Triangle &tri, const Ray &ray) {
+	return hitTriangle(tri.v0, tri.v1, tri.v2, ray);
+}
+
+#endif
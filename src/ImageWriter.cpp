@@ -0,0 +1,133 @@
+#include "ImageWriter.h"
+
+#include <cstdio>
+#include <iostream>
+
+#include "stb_image_write.h"
+#include "TraceEvents.h"
+
+using namespace std;
+
+ImageWriter::ImageWriter(int threadNum, int max) :
+	pool(threadNum),
+	group(pool),
+	maxPending(max > 0 ? max : 1),
+	pending(0),
+	imageNum(0),
+	failNum(0),
+	byteNum(0),
+	encodeTime(0),
+	stallTime(0.0),
+	started(false)
+{
+	// Every image is bottom row first. The flag is global to stb, so it is only ever set to true.
+	stbi_flip_vertically_on_write(true);
+}
+
+ImageWriter::~ImageWriter()
+{
+	wait();
+}
+
+template<typename F>
+void ImageWriter::submit(F encode)
+{
+	auto now = chrono::steady_clock::now();
+	if (!started) {
+		started = true;
+		startTime = now;
+	}
+	{
+		unique_lock<mutex> lock(pendingMutex);
+		if (pending >= maxPending) {
+			pendingCond.wait(lock, [this]() { return pending < maxPending; });
+			stallTime += chrono::duration<double>(chrono::steady_clock::now() - now).count();
+		}
+		pending++;
+	}
+	group.run([this, encode]() mutable {
+		TRACE_SCOPE("encode image");
+		auto start = chrono::steady_clock::now();
+		if (encode()) {
+			imageNum++;
+		}
+		else {
+			failNum++;
+		}
+		encodeTime += chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+		{
+			lock_guard<mutex> lock(pendingMutex);
+			pending--;
+		}
+		pendingCond.notify_one();
+	});
+}
+
+void ImageWriter::writePNG(const string &path, int width, int height, vector<unsigned char> pixels)
+{
+	byteNum += (long long)pixels.size();
+	auto data = make_shared<vector<unsigned char>>(move(pixels));
+	submit([path, width, height, data]() {
+		int rc = stbi_write_png(path.c_str(), width, height, 3, data->data(), 3 * width);
+		if (!rc) {
+			cerr << "Couldn't write to " << path << endl;
+		}
+		return rc != 0;
+	});
+}
+
+void ImageWriter::writeHDR(const string &path, int width, int height, vector<float> pixels)
+{
+	byteNum += (long long)(pixels.size() * sizeof(float));
+	auto data = make_shared<vector<float>>(move(pixels));
+	submit([path, width, height, data]() {
+		int rc = stbi_write_hdr(path.c_str(), width, height, 3, data->data());
+		if (!rc) {
+			cerr << "Couldn't write to " << path << endl;
+		}
+		return rc != 0;
+	});
+}
+
+void ImageWriter::writePFM(const string &path, int width, int height, int channels, vector<float> pixels)
+{
+	byteNum += (long long)(pixels.size() * sizeof(float));
+	auto data = make_shared<vector<float>>(move(pixels));
+	submit([path, width, height, channels, data]() {
+		FILE *file = fopen(path.c_str(), "wb");
+		bool ok = file != NULL;
+		if (ok) {
+			// A negative scale marks little endian floats; the rows are bottom to top
+			ok = fprintf(file, "%s\n%d %d\n-1.0\n", channels == 1 ? "Pf" : "PF", width, height) > 0;
+			ok = ok && fwrite(data->data(), sizeof(float), data->size(), file) == data->size();
+			ok = (fclose(file) == 0) && ok;
+		}
+		if (!ok) {
+			cerr << "Couldn't write to " << path << endl;
+		}
+		return ok;
+	});
+}
+
+void ImageWriter::wait()
+{
+	group.wait();
+	endTime = chrono::steady_clock::now();
+}
+
+void ImageWriter::printStats() const
+{
+	int n = imageNum.load();
+	double wall = started ? chrono::duration<double>(endTime - startTime).count() : 0.0;
+	cout << "Wrote " << n << " images";
+	if (failNum.load() > 0) {
+		cout << " (" << failNum.load() << " failed)";
+	}
+	cout << ", " << byteNum.load() / 1.0e6 << " MB of pixels in " << wall << " s";
+	if (n > 0) {
+		cout << ": " << (wall > 0.0 ? n / wall : 0.0) << " images/s, "
+			<< encodeTime.load() / 1000.0 / n << " ms encode per image on "
+			<< pool.size() << " threads, " << stallTime * 1000.0 << " ms waited for the queue";
+	}
+	cout << endl;
+}
@@ -0,0 +1,60 @@
+#pragma once
+#ifndef IMAGEWRITER_H
+#define IMAGEWRITER_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "ThreadPool.h"
+
+/**
+ * Encodes and saves images on a pool of worker threads, so that the render
+ * thread never waits on PNG compression. Pixels are RGB, bottom row first,
+ * like the OpenGL framebuffer and the PFM format. At most maxPending images are queued; a
+ * further write waits for one of them to finish.
+ */
+class ImageWriter
+{
+public:
+	ImageWriter(int threadNum = 0, int maxPending = 8);
+	virtual ~ImageWriter();
+
+	// 8 bit PNG
+	void writePNG(const std::string &path, int width, int height, std::vector<unsigned char> pixels);
+	// 32 bit float Radiance HDR
+	void writeHDR(const std::string &path, int width, int height, std::vector<float> pixels);
+	// Uncompressed little endian float PFM with 1 or 3 channels. After the
+	// text header the file is the raw pixels, so it can be memory mapped.
+	void writePFM(const std::string &path, int width, int height, int channels, std::vector<float> pixels);
+	// Waits until every queued image is saved
+	void wait();
+	void printStats() const;
+
+	int getImageNum() const { return imageNum.load(); }
+	int getFailNum() const { return failNum.load(); }
+
+private:
+	template<typename F>
+	void submit(F encode);
+
+	ThreadPool pool;
+	TaskGroup group;
+	int maxPending;
+	int pending;                        // queued images, guarded by pendingMutex
+	std::mutex pendingMutex;
+	std::condition_variable pendingCond; // signalled when an image is done
+	std::atomic<int> imageNum;
+	std::atomic<int> failNum;
+	std::atomic<long long> byteNum;     // uncompressed pixel bytes
+	std::atomic<long long> encodeTime;  // microseconds, summed over the workers
+	double stallTime;                   // seconds the caller waited for a free slot
+	bool started;
+	std::chrono::steady_clock::time_point startTime;
+	std::chrono::steady_clock::time_point endTime;
+};
+
+#endif
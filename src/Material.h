@@ -5,6 +5,15 @@
 #include <glm/glm.hpp>
 #include <glm/gtc/type_ptr.hpp>
 
+// Light transport model selected by Sphere::materialIndex, the same
+// numbering as shading() in RayTracerFragmentShader.glsl
+enum Material_Type {
+	EMISSIVE = 0,
+	DIFFUSE = 1,
+	METAL = 2,
+	MIRROR = 3
+};
+
 class Material
 {
 public:
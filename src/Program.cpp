@@ -77,6 +77,28 @@ bool Program::init()
 		return false;
 	}
 	
+	// Resolve every active uniform once, so that addUniform() is optional
+	uniforms.clear();
+	GLint uniformNum = 0;
+	glGetProgramiv(pid, GL_ACTIVE_UNIFORMS, &uniformNum);
+	for(GLint i = 0; i < uniformNum; ++i) {
+		char name[256];
+		GLsizei length = 0;
+		GLint size = 0;
+		GLenum type = 0;
+		glGetActiveUniform(pid, i, sizeof(name), &length, &size, &type, name);
+		GLint location = glGetUniformLocation(pid, name);
+		if(location < 0) {
+			continue; // in a uniform block
+		}
+		string uniform(name, length);
+		uniforms[uniform] = location;
+		// Arrays are reported as name[0]
+		if(uniform.size() > 3 && uniform.compare(uniform.size() - 3, 3, "[0]") == 0) {
+			uniforms[uniform.substr(0, uniform.size() - 3)] = location;
+		}
+	}
+	
 	GLSL::checkError(GET_FILE_LINE);
 	return true;
 }
@@ -101,6 +123,18 @@ void Program::addUniform(const string &name)
 	uniforms[name] = glGetUniformLocation(pid, name.c_str());
 }
 
+void Program::addUniformBlock(const string &name, GLuint binding)
+{
+	GLuint index = glGetUniformBlockIndex(pid, name.c_str());
+	if(index == GL_INVALID_INDEX) {
+		if(isVerbose()) {
+			cout << name << " is not a uniform block" << endl;
+		}
+		return;
+	}
+	glUniformBlockBinding(pid, index, binding);
+}
+
 GLint Program::getAttribute(const string &name) const
 {
 	map<string,GLint>::const_iterator attribute = attributes.find(name.c_str());
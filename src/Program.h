@@ -27,7 +27,10 @@ public:
 
 	void addAttribute(const std::string &name);
 	void addUniform(const std::string &name);
+	// Binds uniform block name to the uniform buffer binding point
+	void addUniformBlock(const std::string &name, GLuint binding);
 	GLint getAttribute(const std::string &name) const;
+	// Locations are resolved by init(), look them up once and keep the GLint
 	GLint getUniform(const std::string &name) const;
 	
 protected:
@@ -5,6 +5,7 @@
 #define GLEW_STATIC
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
+#include <iostream>
 
 const float ScreenVertices[] = {
 	//λ(x,y)     //
@@ -60,7 +61,8 @@ public:
 		// ɫ
 		glGenTextures(1, &textureColorbuffer);
 		glBindTexture(GL_TEXTURE_2D, textureColorbuffer);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, SCR_WIDTH, SCR_HEIGHT, 0, GL_RGB, GL_FLOAT, NULL);
+		// 32 bit float so that the running mean of many frames keeps its precision
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, SCR_WIDTH, SCR_HEIGHT, 0, GL_RGBA, GL_FLOAT, NULL);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
@@ -117,16 +119,35 @@ public:
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT5, GL_TEXTURE_2D, textureluminance2buffer, 0);
 
+		// Unfiltered color of the frame when the temporal denoiser resolves it
+		glGenTextures(1, &textureSamplebuffer);
+		glBindTexture(GL_TEXTURE_2D, textureSamplebuffer);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, SCR_WIDTH, SCR_HEIGHT, 0, GL_RGBA, GL_FLOAT, NULL);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT6, GL_TEXTURE_2D, textureSamplebuffer, 0);
+
 		attachments[0] = GL_COLOR_ATTACHMENT0;
 		attachments[1] = GL_COLOR_ATTACHMENT1;
 		attachments[2] = GL_COLOR_ATTACHMENT2;
 		attachments[3] = GL_COLOR_ATTACHMENT3;
 		attachments[4] = GL_COLOR_ATTACHMENT4;
 		attachments[5] = GL_COLOR_ATTACHMENT5;
+		checkStatus("Screen framebuffer");
+
+		// The temporal resolve writes color, count and luminance moments through
+		// a framebuffer of its own, so that the sample, depth and normal it
+		// reads are not attached to the framebuffer it draws to
+		glGenFramebuffers(1, &resolveFramebuffer);
+		glBindFramebuffer(GL_FRAMEBUFFER, resolveFramebuffer);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, textureColorbuffer, 0);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, textureCountbuffer, 0);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, GL_TEXTURE_2D, textureluminance1buffer, 0);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT3, GL_TEXTURE_2D, textureluminance2buffer, 0);
+		checkStatus("Temporal resolve framebuffer");
 
-		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
-			// ûȷʵ֣򱨴
-		}
 		// 󶨵ĬFrameBuffer
 		unBind();
 	}
@@ -137,10 +158,38 @@ public:
 		glDisable(GL_DEPTH_TEST);
 	}
 
+	// The color output goes to the sample attachment, only depth and normal
+	// are also written; the temporal resolve fills in the rest
+	void BindSample() {
+		const GLenum buffers[6] = { GL_COLOR_ATTACHMENT6, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2, GL_NONE, GL_NONE, GL_NONE };
+		glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+		glDrawBuffers(6, buffers);
+		glDisable(GL_DEPTH_TEST);
+	}
+
+	// Color, count and the luminance moments as outputs 0 to 3
+	void BindResolve() {
+		const GLenum buffers[4] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2, GL_COLOR_ATTACHMENT3 };
+		glBindFramebuffer(GL_FRAMEBUFFER, resolveFramebuffer);
+		glDrawBuffers(4, buffers);
+		glDisable(GL_DEPTH_TEST);
+	}
+
 	void unBind() {
 		glBindFramebuffer(GL_FRAMEBUFFER, 0);
 	}
 
+	// Binds the sample, depth and normal to units unit to unit + 2
+	void BindSampleAsTexture(int unit) {
+		glActiveTexture(GL_TEXTURE0 + unit);
+		glBindTexture(GL_TEXTURE_2D, textureSamplebuffer);
+		glActiveTexture(GL_TEXTURE0 + unit + 1);
+		glBindTexture(GL_TEXTURE_2D, textureDepthbuffer);
+		glActiveTexture(GL_TEXTURE0 + unit + 2);
+		glBindTexture(GL_TEXTURE_2D, textureNormalbuffer);
+		glActiveTexture(GL_TEXTURE0);
+	}
+
 	void BindAsTexture() {
 		// Ϊ0
 		glActiveTexture(GL_TEXTURE0);
@@ -157,18 +206,38 @@ public:
 		glBindTexture(GL_TEXTURE_2D, textureluminance2buffer);
 	}
 
+	unsigned int getFramebuffer() const { return framebuffer; }
+
+	// Reads color attachment index into data
+	void readAttachment(int index, GLenum format, GLenum type, void *data, int width, int height) {
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+		glReadBuffer(GL_COLOR_ATTACHMENT0 + index);
+		glPixelStorei(GL_PACK_ALIGNMENT, 1);
+		glReadPixels(0, 0, width, height, format, type, data);
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+	}
+
 	void Delete() {
 		// ɾ
 		unBind();
 		glDeleteFramebuffers(1, &framebuffer);
+		glDeleteFramebuffers(1, &resolveFramebuffer);
 		glDeleteTextures(1, &textureColorbuffer);
 		glDeleteTextures(1, &textureDepthbuffer);
 		glDeleteTextures(1, &textureNormalbuffer);
 		glDeleteTextures(1, &textureCountbuffer);
 		glDeleteTextures(1, &textureluminance1buffer);
 		glDeleteTextures(1, &textureluminance2buffer);
+		glDeleteTextures(1, &textureSamplebuffer);
 	}
 private:
+	// Reports the framebuffer that is bound, if it is incomplete
+	static void checkStatus(const char *name) {
+		GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+		if (status != GL_FRAMEBUFFER_COMPLETE)
+			std::cerr << name << " is incomplete, status 0x" << std::hex << status << std::dec << std::endl;
+	}
+
 	// framebuffer
 	unsigned int framebuffer;
 	// ɫ
@@ -183,6 +252,10 @@ private:
 	unsigned int textureluminance1buffer;
 
 	unsigned int textureluminance2buffer;
+
+	unsigned int textureSamplebuffer;
+
+	unsigned int resolveFramebuffer;
 	// Ⱥģ帽renderbuffer object
 	unsigned int rbo;
 
@@ -190,6 +263,98 @@ private:
 };
 
 
+// Color target of the screen pass when there is no window to draw to
+class OutputFBO {
+public:
+	void configuration(int SCR_WIDTH, int SCR_HEIGHT) {
+		glGenFramebuffers(1, &framebuffer);
+		glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+		glGenTextures(1, &textureColorbuffer);
+		glBindTexture(GL_TEXTURE_2D, textureColorbuffer);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, SCR_WIDTH, SCR_HEIGHT, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, textureColorbuffer, 0);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	}
+
+	void Bind() {
+		glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+		glDrawBuffer(GL_COLOR_ATTACHMENT0);
+		glReadBuffer(GL_COLOR_ATTACHMENT0);
+	}
+
+	unsigned int getFramebuffer() const { return framebuffer; }
+
+	void Delete() {
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		glDeleteFramebuffers(1, &framebuffer);
+		glDeleteTextures(1, &textureColorbuffer);
+	}
+private:
+	unsigned int framebuffer;
+	unsigned int textureColorbuffer;
+};
+
+// Two RGBA32F color targets the a-trous passes of the spatial denoiser draw
+// into in turn, color in rgb and its variance in alpha. They are linearly
+// filtered for the bilinear variance fetches; the texel fetches of the
+// other taps are not filtered.
+class DenoiseBuffer {
+public:
+	void Init(int SCR_WIDTH, int SCR_HEIGHT) {
+		glGenFramebuffers(2, framebuffer);
+		glGenTextures(2, texture);
+		for (int i = 0; i < 2; ++i) {
+			glBindFramebuffer(GL_FRAMEBUFFER, framebuffer[i]);
+			glBindTexture(GL_TEXTURE_2D, texture[i]);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, SCR_WIDTH, SCR_HEIGHT, 0, GL_RGBA, GL_FLOAT, NULL);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture[i], 0);
+		}
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	}
+
+	// Draws pass into target pass % 2, reading the previous pass at unit
+	void BindPass(int pass, int unit) {
+		glBindFramebuffer(GL_FRAMEBUFFER, framebuffer[pass % 2]);
+		glDrawBuffer(GL_COLOR_ATTACHMENT0);
+		glActiveTexture(GL_TEXTURE0 + unit);
+		glBindTexture(GL_TEXTURE_2D, pass > 0 ? texture[(pass - 1) % 2] : 0);
+		glActiveTexture(GL_TEXTURE0);
+	}
+
+	// Binds the output of pass to unit
+	void BindAsTexture(int pass, int unit) {
+		glActiveTexture(GL_TEXTURE0 + unit);
+		glBindTexture(GL_TEXTURE_2D, texture[pass % 2]);
+		glActiveTexture(GL_TEXTURE0);
+	}
+
+	unsigned int getFramebuffer(int pass) const { return framebuffer[pass % 2]; }
+
+	// Color and variance written by pass, width * height RGBA floats
+	void read(int pass, float *data, int width, int height) {
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer[pass % 2]);
+		glReadBuffer(GL_COLOR_ATTACHMENT0);
+		glPixelStorei(GL_PACK_ALIGNMENT, 1);
+		glReadPixels(0, 0, width, height, GL_RGBA, GL_FLOAT, data);
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+	}
+
+	void Delete() {
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		glDeleteFramebuffers(2, framebuffer);
+		glDeleteTextures(2, texture);
+	}
+private:
+	unsigned int framebuffer[2];
+	unsigned int texture[2];
+};
+
 class RenderBuffer {
 public:
 	void Init(int SCR_WIDTH, int SCR_HEIGHT) {
@@ -197,18 +362,44 @@ public:
 		fbo[1].configuration(SCR_WIDTH, SCR_HEIGHT);
 		currentIndex = 0;
 	}
-	// fbo[0]ΪȾǰ֡
-	void setCurrentBuffer(int LoopNum) {
-		int histIndex = LoopNum % 2;
-		int curIndex = (histIndex == 0 ? 1 : 0);
-		
+	// Starts a frame: the last frame becomes the history, bound as textures 0-5,
+	// and the other buffer the render target. The buffers alternate every frame,
+	// also when the camera moves, so that the history is always the last frame.
+	void setCurrentBuffer() {
+		int histIndex = currentIndex;
+		currentIndex = 1 - currentIndex;
 		fbo[histIndex].BindAsTexture();
-		fbo[curIndex].Bind();
+		fbo[currentIndex].Bind();
+	}
+	void setCurrentAsTexture() {
+		fbo[currentIndex].BindAsTexture();
+	}
+	// Render target of a frame the temporal denoiser resolves, after setCurrentBuffer()
+	void setCurrentSample() {
+		fbo[currentIndex].BindSample();
+	}
+	// Target of the temporal resolve, with the sample, depth and normal of the
+	// current frame at units unit to unit + 2 and the history still at 0-5
+	void setCurrentResolve(int unit) {
+		fbo[currentIndex].BindSampleAsTexture(unit);
+		fbo[currentIndex].BindResolve();
+	}
+	// Framebuffer written by the current frame
+	unsigned int getCurrentFramebuffer() const {
+		return fbo[currentIndex].getFramebuffer();
+	}
+	// Color attachment index written by the current frame
+	void readAttachment(int index, GLenum format, GLenum type, void *data, int width, int height) {
+		fbo[currentIndex].readAttachment(index, format, type, data, width, height);
+	}
+	// Same from the last frame, the history of the current one
+	void readHistoryAttachment(int index, GLenum format, GLenum type, void *data, int width, int height) {
+		fbo[1 - currentIndex].readAttachment(index, format, type, data, width, height);
 	}
-	void setCurrentAsTexture(int LoopNum) {
-		int histIndex = LoopNum % 2;
-		int curIndex = (histIndex == 0 ? 1 : 0);
-		fbo[curIndex].BindAsTexture();
+	// Luminance moments written by the current frame, width * height floats each
+	void readLuminance(int width, int height, float *luminance1, float *luminance2) {
+		readAttachment(4, GL_RED, GL_FLOAT, luminance1, width, height);
+		readAttachment(5, GL_RED, GL_FLOAT, luminance2, width, height);
 	}
 
 	void Delete() {
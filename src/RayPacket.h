@@ -0,0 +1,405 @@
+#pragma once
+#ifndef RAYPACKET_H
+#define RAYPACKET_H
+
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+
+#include <glm/glm.hpp>
+
+#include "CompactBVH.h"
+#include "Geometry.h"
+#include "Simd.h"
+#include "TriangleKernel.h"
+
+// Rays tested together by one SIMD instruction
+#if defined(SIMD_AVX)
+const int PacketSimdWidth = 8;
+#else
+const int PacketSimdWidth = 4;
+#endif
+
+/**
+ * K coherent rays, such as the primary rays of a 4x2 or 4x4 pixel block or
+ * their mirror bounces, stored as structure of arrays. A packet walks the
+ * BVH once for all its rays. Results are left in tMax and primId, exactly
+ * as IntersectCompactBVH returns them for each ray.
+ */
+template<int K>
+struct alignas(32) RayPacket {
+	static_assert(K % PacketSimdWidth == 0, "K should be a multiple of the SIMD width");
+
+	float org[3][K];
+	float dir[3][K];
+	float invDir[3][K];
+	float tMax[K];
+	int32_t primId[K];
+	int activeMask; // lanes holding a ray
+
+	RayPacket() { clear(); }
+
+	void clear() {
+		for (int i = 0; i < K; ++i) {
+			for (int a = 0; a < 3; ++a) {
+				org[a][i] = 0.0f;
+				dir[a][i] = 1.0f;
+				invDir[a][i] = 1.0f;
+			}
+			tMax[i] = 0.0f;
+			primId[i] = -1;
+		}
+		activeMask = 0;
+	}
+	void setRay(int lane, const Ray &ray) {
+		for (int a = 0; a < 3; ++a) {
+			org[a][lane] = ray.origin[a];
+			dir[a][lane] = ray.direction[a];
+			invDir[a][lane] = 1 / ray.direction[a];
+		}
+		tMax[lane] = FLT_MAX;
+		primId[lane] = -1;
+		activeMask |= 1 << lane;
+	}
+	Ray getRay(int lane) const {
+		Ray ray;
+		ray.origin = glm::vec3(org[0][lane], org[1][lane], org[2][lane]);
+		ray.direction = glm::vec3(dir[0][lane], dir[1][lane], dir[2][lane]);
+		return ray;
+	}
+};
+
+inline int popCount(unsigned int mask) {
+	int n = 0;
+	for (; mask; mask &= mask - 1)
+		n++;
+	return n;
+}
+
+// Slab test of the rays in mask, same arithmetic as IntersectBox. Returns the rays that hit.
+template<int K>
+inline int IntersectPacketBox(const CompactBVHNode &node, const RayPacket<K> &p, const int dirIsNeg[3], int mask) {
+	float nearX = dirIsNeg[0] ? node.pMax.x : node.pMin.x, farX = dirIsNeg[0] ? node.pMin.x : node.pMax.x;
+	float nearY = dirIsNeg[1] ? node.pMax.y : node.pMin.y, farY = dirIsNeg[1] ? node.pMin.y : node.pMax.y;
+	float nearZ = dirIsNeg[2] ? node.pMax.z : node.pMin.z, farZ = dirIsNeg[2] ? node.pMin.z : node.pMax.z;
+	int hitMask = 0;
+	if constexpr (SimdFloat<PacketSimdWidth>::enabled) {
+		typedef SimdFloat<PacketSimdWidth> S;
+		typedef typename S::type F;
+		const int W = PacketSimdWidth;
+		for (int c = 0; c < K; c += W) {
+			if (!((mask >> c) & ((1 << W) - 1))) continue;
+			F ox = S::load(&p.org[0][c]), oy = S::load(&p.org[1][c]), oz = S::load(&p.org[2][c]);
+			F ix = S::load(&p.invDir[0][c]), iy = S::load(&p.invDir[1][c]), iz = S::load(&p.invDir[2][c]);
+			F t0 = S::mul(S::sub(S::set1(nearX), ox), ix);
+			F t1 = S::mul(S::sub(S::set1(farX), ox), ix);
+			t0 = S::max(t0, S::max(S::mul(S::sub(S::set1(nearY), oy), iy), S::mul(S::sub(S::set1(nearZ), oz), iz)));
+			t1 = S::min(t1, S::min(S::mul(S::sub(S::set1(farY), oy), iy), S::mul(S::sub(S::set1(farZ), oz), iz)));
+			t1 = S::mul(t1, S::set1(BoxFarScale));
+			F hit = S::andv(S::le(t0, t1), S::andv(S::gt(t1, S::zero()), S::lt(t0, S::load(&p.tMax[c]))));
+			hitMask |= S::movemask(hit) << c;
+		}
+	}
+	else {
+		for (int i = 0; i < K; ++i) {
+			if (!(mask & (1 << i))) continue;
+			float t0 = (nearX - p.org[0][i]) * p.invDir[0][i];
+			float t1 = (farX - p.org[0][i]) * p.invDir[0][i];
+			t0 = glm::max(t0, glm::max((nearY - p.org[1][i]) * p.invDir[1][i], (nearZ - p.org[2][i]) * p.invDir[2][i]));
+			t1 = glm::min(t1, glm::min((farY - p.org[1][i]) * p.invDir[1][i], (farZ - p.org[2][i]) * p.invDir[2][i])) * BoxFarScale;
+			if (t0 <= t1 && t1 > 0.0f && t0 < p.tMax[i]) hitMask |= 1 << i;
+		}
+	}
+	return hitMask & mask;
+}
+
+// Moller-Trumbore on the rays in mask, same arithmetic as hitTriangle
+template<int K>
+inline void IntersectPacketTriangle(RayPacket<K> &p, int mask, const glm::vec3 &v0, const glm::vec3 &v1,
+	const glm::vec3 &v2, int primId) {
+	glm::vec3 e1 = v1 - v0;
+	glm::vec3 e2 = v2 - v0;
+	if constexpr (SimdFloat<PacketSimdWidth>::enabled) {
+		typedef SimdFloat<PacketSimdWidth> S;
+		typedef typename S::type F;
+		const int W = PacketSimdWidth;
+		F e1x = S::set1(e1.x), e1y = S::set1(e1.y), e1z = S::set1(e1.z);
+		F e2x = S::set1(e2.x), e2y = S::set1(e2.y), e2z = S::set1(e2.z);
+		F zero = S::zero(), one = S::set1(1.0f);
+		for (int c = 0; c < K; c += W) {
+			int laneMask = (mask >> c) & ((1 << W) - 1);
+			if (!laneMask) continue;
+			F dx = S::load(&p.dir[0][c]), dy = S::load(&p.dir[1][c]), dz = S::load(&p.dir[2][c]);
+			F px = S::sub(S::mul(dy, e2z), S::mul(dz, e2y));
+			F py = S::sub(S::mul(dz, e2x), S::mul(dx, e2z));
+			F pz = S::sub(S::mul(dx, e2y), S::mul(dy, e2x));
+			F det = S::add(S::add(S::mul(e1x, px), S::mul(e1y, py)), S::mul(e1z, pz));
+			F absDet = S::andnot(S::set1(-0.0f), det);
+			F invDet = S::div(one, det);
+			F sx = S::sub(S::load(&p.org[0][c]), S::set1(v0.x));
+			F sy = S::sub(S::load(&p.org[1][c]), S::set1(v0.y));
+			F sz = S::sub(S::load(&p.org[2][c]), S::set1(v0.z));
+			F u = S::mul(S::add(S::add(S::mul(sx, px), S::mul(sy, py)), S::mul(sz, pz)), invDet);
+			F qx = S::sub(S::mul(sy, e1z), S::mul(sz, e1y));
+			F qy = S::sub(S::mul(sz, e1x), S::mul(sx, e1z));
+			F qz = S::sub(S::mul(sx, e1y), S::mul(sy, e1x));
+			F v = S::mul(S::add(S::add(S::mul(dx, qx), S::mul(dy, qy)), S::mul(dz, qz)), invDet);
+			F t = S::mul(S::add(S::add(S::mul(e2x, qx), S::mul(e2y, qy)), S::mul(e2z, qz)), invDet);
+			F tMax = S::load(&p.tMax[c]);
+			F hit = S::andnot(S::lt(absDet, S::set1(1e-8f)), S::andv(S::le(zero, u), S::le(u, one)));
+			hit = S::andv(hit, S::andv(S::le(zero, v), S::le(S::add(u, v), one)));
+			hit = S::andv(hit, S::andv(S::gt(t, zero), S::lt(t, tMax)));
+			int hitMask = S::movemask(hit) & laneMask;
+			if (!hitMask) continue;
+			S::store(&p.tMax[c], S::select(hit, t, tMax));
+			for (int i = 0; i < W; ++i) {
+				if (hitMask & (1 << i)) p.primId[c + i] = primId;
+			}
+		}
+	}
+	else {
+		for (int i = 0; i < K; ++i) {
+			if (!(mask & (1 << i))) continue;
+			float t = hitTriangle(v0, v1, v2, p.getRay(i));
+			if (t > 0.0f && t < p.tMax[i]) {
+				p.tMax[i] = t;
+				p.primId[i] = primId;
+			}
+		}
+	}
+}
+
+// Shear constants of the watertight test for every ray of a packet. The rays
+// share the axis permutation, so that the triangle is projected once per axis.
+template<int K>
+struct alignas(32) WatertightPacket {
+	float Sx[K], Sy[K], Sz[K];
+	int kx, ky, kz;
+
+	// Returns false if the rays in mask do not share the axis permutation
+	bool init(const RayPacket<K> &p, int mask) {
+		bool first = true;
+		for (int i = 0; i < K; ++i) {
+			if (!(mask & (1 << i))) continue;
+			WatertightRay r = makeWatertightRay(p.getRay(i));
+			if (first) {
+				kx = r.kx;
+				ky = r.ky;
+				kz = r.kz;
+				first = false;
+			}
+			else if (r.kx != kx || r.ky != ky || r.kz != kz) {
+				return false;
+			}
+			Sx[i] = r.Sx;
+			Sy[i] = r.Sy;
+			Sz[i] = r.Sz;
+		}
+		return true;
+	}
+	WatertightRay getRay(const RayPacket<K> &p, int lane) const {
+		WatertightRay r;
+		for (int a = 0; a < 3; ++a)
+			r.org[a] = p.org[a][lane];
+		r.kx = kx;
+		r.ky = ky;
+		r.kz = kz;
+		r.Sx = Sx[lane];
+		r.Sy = Sy[lane];
+		r.Sz = Sz[lane];
+		return r;
+	}
+};
+
+// Watertight test on the rays in mask, same arithmetic as hitTriangleWatertight
+template<int K>
+inline void IntersectPacketTriangleWatertight(RayPacket<K> &p, const WatertightPacket<K> &w, int mask,
+	const glm::vec3 &v0, const glm::vec3 &v1, const glm::vec3 &v2, int primId) {
+	if constexpr (SimdFloat<PacketSimdWidth>::enabled) {
+		typedef SimdFloat<PacketSimdWidth> S;
+		typedef typename S::type F;
+		const int W = PacketSimdWidth;
+		F zero = S::zero(), one = S::set1(1.0f), signMask = S::set1(-0.0f);
+		for (int c = 0; c < K; c += W) {
+			int laneMask = (mask >> c) & ((1 << W) - 1);
+			if (!laneMask) continue;
+			F ox = S::load(&p.org[w.kx][c]), oy = S::load(&p.org[w.ky][c]), oz = S::load(&p.org[w.kz][c]);
+			F sx = S::load(&w.Sx[c]), sy = S::load(&w.Sy[c]), sz = S::load(&w.Sz[c]);
+			F Az = S::sub(S::set1(v0[w.kz]), oz);
+			F Bz = S::sub(S::set1(v1[w.kz]), oz);
+			F Cz = S::sub(S::set1(v2[w.kz]), oz);
+			F Ax = S::sub(S::sub(S::set1(v0[w.kx]), ox), S::mul(sx, Az));
+			F Ay = S::sub(S::sub(S::set1(v0[w.ky]), oy), S::mul(sy, Az));
+			F Bx = S::sub(S::sub(S::set1(v1[w.kx]), ox), S::mul(sx, Bz));
+			F By = S::sub(S::sub(S::set1(v1[w.ky]), oy), S::mul(sy, Bz));
+			F Cx = S::sub(S::sub(S::set1(v2[w.kx]), ox), S::mul(sx, Cz));
+			F Cy = S::sub(S::sub(S::set1(v2[w.ky]), oy), S::mul(sy, Cz));
+			F U = S::sub(S::mul(Cx, By), S::mul(Cy, Bx));
+			F V = S::sub(S::mul(Ax, Cy), S::mul(Ay, Cx));
+			F Wf = S::sub(S::mul(Bx, Ay), S::mul(By, Ax));
+
+			F anyNeg = S::orv(S::lt(U, zero), S::orv(S::lt(V, zero), S::lt(Wf, zero)));
+			F anyPos = S::orv(S::gt(U, zero), S::orv(S::gt(V, zero), S::gt(Wf, zero)));
+			F det = S::add(S::add(U, V), Wf);
+			F T = S::add(S::add(S::mul(S::mul(U, sz), Az), S::mul(S::mul(V, sz), Bz)), S::mul(S::mul(Wf, sz), Cz));
+			// Flip T and det to det > 0 with the sign bit of det
+			F detSign = S::andv(det, signMask);
+			F absDet = S::xorv(det, detSign);
+			F signedT = S::xorv(T, detSign);
+			F tMax = S::load(&p.tMax[c]);
+			F hit = S::andv(S::gt(signedT, zero), S::lt(signedT, S::mul(tMax, absDet)));
+			hit = S::andnot(S::andv(anyNeg, anyPos), S::andv(hit, S::gt(absDet, zero)));
+			// Rays with an edge function of exactly zero go through the scalar test
+			int edgeMask = S::movemask(S::orv(S::eq(U, zero), S::orv(S::eq(V, zero), S::eq(Wf, zero)))) & laneMask;
+			int hitMask = S::movemask(hit) & laneMask & ~edgeMask;
+			if (hitMask) {
+				alignas(32) float ts[W];
+				S::store(ts, S::mul(T, S::div(one, det)));
+				for (int i = 0; i < W; ++i) {
+					if (hitMask & (1 << i)) {
+						p.tMax[c + i] = ts[i];
+						p.primId[c + i] = primId;
+					}
+				}
+			}
+			for (int i = 0; i < W && edgeMask; ++i) {
+				if (!(edgeMask & (1 << i))) continue;
+				edgeMask &= ~(1 << i);
+				float t, u, v;
+				if (hitTriangleWatertight(v0, v1, v2, w.getRay(p, c + i), p.tMax[c + i], t, u, v)) {
+					p.tMax[c + i] = t;
+					p.primId[c + i] = primId;
+				}
+			}
+		}
+	}
+	else {
+		for (int i = 0; i < K; ++i) {
+			if (!(mask & (1 << i))) continue;
+			float t, u, v;
+			if (hitTriangleWatertight(v0, v1, v2, w.getRay(p, i), p.tMax[i], t, u, v)) {
+				p.tMax[i] = t;
+				p.primId[i] = primId;
+			}
+		}
+	}
+}
+
+/**
+ * Closest hits of a packet. Nodes are first culled against the interval
+ * bounds of all the rays (a frustum for rays sharing an origin), then tested
+ * ray by ray with SIMD. Packets whose directions differ in sign on an axis,
+ * or for the watertight kernel in their dominant axis, and subtrees reached
+ * by at most singleRayThreshold rays, fall back to single ray traversal.
+ * nodesVisited counts the nodes tested by the packet, singleRays the rays
+ * that fell back, once per subtree.
+ */
+template<int K, TriangleKernel kernel = KERNEL_SCALAR>
+inline void IntersectPacketCompactBVH(const CompactBVH &bvh, RayPacket<K> &p, int singleRayThreshold = K / 4,
+	long long *nodesVisited = nullptr, long long *singleRays = nullptr) {
+	int active = p.activeMask;
+	if (!active || bvh.nodes.empty()) return;
+	long long visited = 0, singleVisited = 0;
+
+	// Ordered traversal and the interval test need one direction sign per axis
+	int dirIsNeg[3];
+	bool coherent = true;
+	float oMin[3], oMax[3], iMin[3], iMax[3];
+	bool intervalValid = true;
+	for (int a = 0; a < 3; ++a) {
+		int neg = 0;
+		oMin[a] = iMin[a] = FLT_MAX;
+		oMax[a] = iMax[a] = -FLT_MAX;
+		for (int i = 0; i < K; ++i) {
+			if (!(active & (1 << i))) continue;
+			if (p.invDir[a][i] < 0) neg |= 1 << i;
+			oMin[a] = glm::min(oMin[a], p.org[a][i]);
+			oMax[a] = glm::max(oMax[a], p.org[a][i]);
+			iMin[a] = glm::min(iMin[a], p.invDir[a][i]);
+			iMax[a] = glm::max(iMax[a], p.invDir[a][i]);
+		}
+		if (neg != 0 && neg != active) coherent = false;
+		dirIsNeg[a] = neg != 0;
+		if (!std::isfinite(iMin[a]) || !std::isfinite(iMax[a])) intervalValid = false;
+	}
+	WatertightPacket<K> wp;
+	if constexpr (kernel == KERNEL_WATERTIGHT) {
+		if (coherent && !wp.init(p, active)) coherent = false;
+	}
+	if (!coherent) {
+		for (int i = 0; i < K; ++i) {
+			if (active & (1 << i))
+				traverseCompactBVH<kernel>(bvh, p.getRay(i), 0, p.tMax[i], p.primId[i], singleVisited);
+		}
+		if (singleRays) *singleRays += popCount(active);
+		if (nodesVisited) *nodesVisited += visited;
+		return;
+	}
+
+	const CompactBVHNode *nodes = bvh.nodes.data();
+	const glm::vec3 *vertices = bvh.vertices.data();
+	const uint32_t *indices = bvh.indices.data();
+	struct StackEntry {
+		int node;
+		int mask;
+	};
+	StackEntry stack[64 + 1];
+	int stackSize = 0;
+	stack[stackSize++] = { 0, active };
+	while (stackSize > 0) {
+		StackEntry entry = stack[--stackSize];
+		const CompactBVHNode &node = nodes[entry.node];
+		visited++;
+
+		if (intervalValid) {
+			// Interval arithmetic bounds of the slab distances over all rays
+			float tNearLo = -FLT_MAX, tFarHi = FLT_MAX;
+			for (int a = 0; a < 3; ++a) {
+				float nearP = dirIsNeg[a] ? node.pMax[a] : node.pMin[a];
+				float farP = dirIsNeg[a] ? node.pMin[a] : node.pMax[a];
+				float n0 = (nearP - oMax[a]) * iMin[a], n1 = (nearP - oMax[a]) * iMax[a];
+				float n2 = (nearP - oMin[a]) * iMin[a], n3 = (nearP - oMin[a]) * iMax[a];
+				float f0 = (farP - oMax[a]) * iMin[a], f1 = (farP - oMax[a]) * iMax[a];
+				float f2 = (farP - oMin[a]) * iMin[a], f3 = (farP - oMin[a]) * iMax[a];
+				tNearLo = glm::max(tNearLo, glm::min(glm::min(n0, n1), glm::min(n2, n3)));
+				tFarHi = glm::min(tFarHi, glm::max(glm::max(f0, f1), glm::max(f2, f3)));
+			}
+			tFarHi *= BoxFarScale;
+			if (tNearLo > tFarHi || tFarHi <= 0.0f) continue;
+		}
+
+		int hitMask = IntersectPacketBox(node, p, dirIsNeg, entry.mask);
+		if (!hitMask) continue;
+
+		// Too few rays left to pay for the packet tests
+		if (popCount(hitMask) <= singleRayThreshold) {
+			for (int i = 0; i < K; ++i) {
+				if (hitMask & (1 << i))
+					traverseCompactBVH<kernel>(bvh, p.getRay(i), entry.node, p.tMax[i], p.primId[i], singleVisited);
+			}
+			if (singleRays) *singleRays += popCount(hitMask);
+			continue;
+		}
+
+		if (node.nPrimitives > 0) {
+			for (int i = 0; i < node.nPrimitives; ++i) {
+				const uint32_t *tri = &indices[3 * (node.offset + i)];
+				if constexpr (kernel == KERNEL_WATERTIGHT)
+					IntersectPacketTriangleWatertight(p, wp, hitMask, vertices[tri[0]], vertices[tri[1]], vertices[tri[2]], node.offset + i);
+				else
+					IntersectPacketTriangle(p, hitMask, vertices[tri[0]], vertices[tri[1]], vertices[tri[2]], node.offset + i);
+			}
+		}
+		else if (dirIsNeg[node.axis]) {
+			stack[stackSize++] = { entry.node + 1, hitMask };
+			stack[stackSize++] = { node.offset, hitMask };
+		}
+		else {
+			stack[stackSize++] = { node.offset, hitMask };
+			stack[stackSize++] = { entry.node + 1, hitMask };
+		}
+	}
+	if (nodesVisited) *nodesVisited += visited;
+}
+
+#endif
@@ -0,0 +1,145 @@
+#pragma once
+#ifndef READBACKRING_H
+#define READBACKRING_H
+
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#define GLEW_STATIC
+#include <GL/glew.h>
+
+#include "ImageWriter.h"
+
+/**
+ * Asynchronous glReadPixels through a ring of pixel buffer objects. read()
+ * starts the copy of a color buffer into the next PBO and puts a fence
+ * behind it; the pixels are mapped and handed to the ImageWriter only once
+ * the fence has passed, normally a frame or more later. The render thread
+ * only waits when every PBO of the ring is still in flight.
+ */
+class ReadbackRing {
+public:
+	ReadbackRing() : writer(NULL), next(0), capacity(0), stallTime(0.0), readNum(0) {}
+
+	void Init(int ringSize, ImageWriter *imageWriter) {
+		writer = imageWriter;
+		slots.assign(ringSize > 0 ? ringSize : 1, Slot());
+		for (Slot &slot : slots) {
+			glGenBuffers(1, &slot.pbo);
+		}
+		next = 0;
+		capacity = 0;
+	}
+
+	// Starts reading color buffer readBuffer of framebuffer, 0 for the window,
+	// as 8 bit RGB or, with hdr, float RGB. The image is saved to path.
+	void read(GLuint framebuffer, GLenum readBuffer, int width, int height, bool hdr, const std::string &path) {
+		// The buffers grow with the image, after the reads in flight are done
+		size_t size = (size_t)width * height * 3 * (hdr ? sizeof(float) : 1);
+		if (size > capacity) {
+			flush();
+			for (Slot &s : slots) {
+				glBindBuffer(GL_PIXEL_PACK_BUFFER, s.pbo);
+				glBufferData(GL_PIXEL_PACK_BUFFER, size, NULL, GL_STREAM_READ);
+			}
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+			capacity = size;
+		}
+		Slot &slot = slots[next];
+		if (slot.fence) {
+			auto start = std::chrono::steady_clock::now();
+			finish(slot, true);
+			stallTime += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		}
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+		glReadBuffer(readBuffer);
+		glPixelStorei(GL_PACK_ALIGNMENT, 1);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+		glReadPixels(0, 0, width, height, GL_RGB, hdr ? GL_FLOAT : GL_UNSIGNED_BYTE, (void*)0);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+		slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		slot.width = width;
+		slot.height = height;
+		slot.hdr = hdr;
+		slot.path = path;
+		next = (next + 1) % (int)slots.size();
+		readNum++;
+		poll();
+	}
+
+	// Hands every finished read to the writer, without waiting
+	void poll() {
+		for (Slot &slot : slots) {
+			if (slot.fence) finish(slot, false);
+		}
+	}
+
+	// Waits for every read in flight
+	void flush() {
+		// Oldest first, so that the images are queued in order
+		for (int i = 0; i < (int)slots.size(); ++i) {
+			Slot &slot = slots[(next + i) % slots.size()];
+			if (slot.fence) finish(slot, true);
+		}
+	}
+
+	void Delete() {
+		for (Slot &slot : slots) {
+			if (slot.fence) glDeleteSync(slot.fence);
+			glDeleteBuffers(1, &slot.pbo);
+		}
+		slots.clear();
+	}
+
+	int getReadNum() const { return readNum; }
+	double getStallTime() const { return stallTime; }
+
+private:
+	struct Slot {
+		GLuint pbo = 0;
+		GLsync fence = 0;
+		int width = 0;
+		int height = 0;
+		bool hdr = false;
+		std::string path;
+	};
+
+	void finish(Slot &slot, bool block) {
+		GLenum state = glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, block ? GL_TIMEOUT_IGNORED : 0);
+		if (state == GL_TIMEOUT_EXPIRED) return;
+		glDeleteSync(slot.fence);
+		slot.fence = 0;
+		if (state == GL_WAIT_FAILED) return;
+
+		size_t pixelNum = (size_t)slot.width * slot.height * 3;
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+		size_t size = pixelNum * (slot.hdr ? sizeof(float) : 1);
+		void *data = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size, GL_MAP_READ_BIT);
+		if (data) {
+			if (slot.hdr) {
+				std::vector<float> pixels(pixelNum);
+				std::memcpy(pixels.data(), data, size);
+				writer->writeHDR(slot.path, slot.width, slot.height, std::move(pixels));
+			}
+			else {
+				std::vector<unsigned char> pixels(pixelNum);
+				std::memcpy(pixels.data(), data, size);
+				writer->writePNG(slot.path, slot.width, slot.height, std::move(pixels));
+			}
+			glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	}
+
+	ImageWriter *writer;
+	std::vector<Slot> slots;
+	int next;
+	size_t capacity; // bytes of each buffer
+	double stallTime;
+	int readNum;
+};
+
+#endif
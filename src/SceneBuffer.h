@@ -0,0 +1,133 @@
+#pragma once
+#ifndef SCENEBUFFER_H
+#define SCENEBUFFER_H
+
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+#define GLEW_STATIC
+#include <GL/glew.h>
+
+#include "BVHTree.h"
+#include "Sphere.h"
+
+/**
+ * Spheres and light of the ray tracer. The SceneBlock uniform block holds
+ * the sphere count and the global light in std140 layout; the spheres are
+ * a BVH, BVHTree::BVHBuildSpheres, in two buffer textures: the nodes as
+ * GL_R32F like BVHBuffer, the spheres as two GL_RGBA32F texels each,
+ * (center, radius) and (albedo, materialIndex). update() compares the scene
+ * with the last upload and only rebuilds the BVH when a sphere changed, so a
+ * static scene costs no uploads per frame.
+ */
+class SceneBuffer {
+public:
+	SceneBuffer() : uniformBuffer(0), nodeBuffer(0), sphereBuffer(0), nodeTexture(0), sphereTexture(0),
+		lastLight(-1.0f), uploadNum(0) {}
+
+	void Init() {
+		glGenBuffers(1, &uniformBuffer);
+		glBindBuffer(GL_UNIFORM_BUFFER, uniformBuffer);
+		glBufferData(GL_UNIFORM_BUFFER, sizeof(Header), NULL, GL_DYNAMIC_DRAW);
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+		glGenBuffers(1, &nodeBuffer);
+		glGenBuffers(1, &sphereBuffer);
+		glGenTextures(1, &nodeTexture);
+		glGenTextures(1, &sphereTexture);
+		uploaded.clear();
+		lastLight = -1.0f;
+	}
+
+	// Uploads what differs from the last upload. Returns false and keeps the
+	// last upload if the sphere BVH does not fit in a buffer texture.
+	bool update(const std::vector<std::shared_ptr<Sphere>> &spheres, float globalLight) {
+		std::vector<Sphere> scene;
+		scene.reserve(spheres.size());
+		for (const auto &s : spheres) {
+			scene.push_back(*s);
+		}
+		bool sphereChanged = scene.size() != uploaded.size();
+		for (size_t i = 0; !sphereChanged && i < scene.size(); ++i) {
+			sphereChanged = scene[i].center != uploaded[i].center || scene[i].radius != uploaded[i].radius
+				|| scene[i].albedo != uploaded[i].albedo || scene[i].materialIndex != uploaded[i].materialIndex;
+		}
+		if (sphereChanged) {
+			BVHTree tree;
+			tree.BVHBuildSpheres(scene);
+			GLint maxTexels = 0;
+			glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &maxTexels);
+			if ((GLint)tree.NodeArray.size() > maxTexels || (GLint)tree.MeshArray.size() / 4 > maxTexels) {
+				std::cerr << "Sphere BVH does not fit in a buffer texture of " << maxTexels << " texels" << std::endl;
+				return false;
+			}
+			upload(tree.NodeArray, nodeBuffer, nodeTexture, GL_R32F);
+			upload(tree.MeshArray, sphereBuffer, sphereTexture, GL_RGBA32F);
+			uploaded.swap(scene);
+			uploadNum++;
+		}
+		if (sphereChanged || globalLight != lastLight) {
+			Header header = {};
+			header.sphereNum = (GLint)uploaded.size();
+			header.globalLight = globalLight;
+			glBindBuffer(GL_UNIFORM_BUFFER, uniformBuffer);
+			glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(Header), &header);
+			glBindBuffer(GL_UNIFORM_BUFFER, 0);
+			lastLight = globalLight;
+		}
+		return true;
+	}
+
+	void BindBase(GLuint binding) {
+		glBindBufferBase(GL_UNIFORM_BUFFER, binding, uniformBuffer);
+	}
+
+	// Binds the node texture to texture unit nodeUnit and the spheres to sphereUnit
+	void BindAsTexture(int nodeUnit, int sphereUnit) {
+		glActiveTexture(GL_TEXTURE0 + nodeUnit);
+		glBindTexture(GL_TEXTURE_BUFFER, nodeTexture);
+		glActiveTexture(GL_TEXTURE0 + sphereUnit);
+		glBindTexture(GL_TEXTURE_BUFFER, sphereTexture);
+		glActiveTexture(GL_TEXTURE0);
+	}
+
+	void Delete() {
+		glDeleteTextures(1, &nodeTexture);
+		glDeleteTextures(1, &sphereTexture);
+		glDeleteBuffers(1, &nodeBuffer);
+		glDeleteBuffers(1, &sphereBuffer);
+		glDeleteBuffers(1, &uniformBuffer);
+	}
+
+	int getUploadNum() const { return uploadNum; }
+
+private:
+	// std140 SceneBlock { int sphereNum; float globalLight; }
+	struct Header {
+		GLint sphereNum;
+		GLfloat globalLight;
+		GLfloat padding[2];
+	};
+
+	// An empty scene still gets one texel, a buffer texture needs storage
+	void upload(const std::vector<float> &data, GLuint buffer, GLuint texture, GLenum format) {
+		const float empty[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+		glBindBuffer(GL_TEXTURE_BUFFER, buffer);
+		glBufferData(GL_TEXTURE_BUFFER, data.empty() ? sizeof(empty) : data.size() * sizeof(float),
+			data.empty() ? empty : data.data(), GL_DYNAMIC_DRAW);
+		glBindTexture(GL_TEXTURE_BUFFER, texture);
+		glTexBuffer(GL_TEXTURE_BUFFER, format, buffer);
+		glBindTexture(GL_TEXTURE_BUFFER, 0);
+		glBindBuffer(GL_TEXTURE_BUFFER, 0);
+	}
+
+	GLuint uniformBuffer;
+	GLuint nodeBuffer, sphereBuffer;
+	GLuint nodeTexture, sphereTexture;
+	std::vector<Sphere> uploaded;
+	float lastLight;
+	int uploadNum;
+};
+
+#endif
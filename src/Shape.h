@@ -24,7 +24,9 @@ public:
 	void fitToUnitBox();
 	void init();
 	void draw(const std::shared_ptr<Program> prog) const;
-	
+	const std::vector<float> &getPosBuf() const { return posBuf; }
+	const std::vector<float> &getNorBuf() const { return norBuf; }
+
 private:
 	std::vector<float> posBuf;
 	std::vector<float> norBuf;
@@ -0,0 +1,161 @@
+#pragma once
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * A fixed size pool of worker threads. Every worker owns a task deque: it
+ * pops its own tasks from the back and, when that runs dry, steals from the
+ * front of the other workers' deques.
+ */
+class ThreadPool
+{
+public:
+	explicit ThreadPool(int threadNum = 0) : stop(false), queued(0), nextQueue(0) {
+		if (threadNum <= 0)
+			threadNum = std::max(1, (int)std::thread::hardware_concurrency());
+		for (int i = 0; i < threadNum; ++i)
+			queues.push_back(std::make_unique<TaskQueue>());
+		for (int i = 0; i < threadNum; ++i)
+			workers.emplace_back(&ThreadPool::workerLoop, this, i);
+	}
+	~ThreadPool() {
+		{
+			std::lock_guard<std::mutex> lock(sleepMutex);
+			stop = true;
+		}
+		sleepCond.notify_all();
+		for (auto &worker : workers)
+			worker.join();
+	}
+	ThreadPool(const ThreadPool &) = delete;
+	ThreadPool &operator=(const ThreadPool &) = delete;
+
+	int size() const { return (int)workers.size(); }
+
+	// Tasks submitted from a worker go to its own deque, others are spread round robin
+	void submit(std::function<void()> task) {
+		int index = (workerOwner() == this) ? workerIndex() : (int)(nextQueue++ % queues.size());
+		{
+			std::lock_guard<std::mutex> lock(queues[index]->mutex);
+			queues[index]->tasks.push_back(std::move(task));
+		}
+		queued++;
+		{
+			std::lock_guard<std::mutex> lock(sleepMutex);
+		}
+		sleepCond.notify_one();
+	}
+
+	// Runs one pending task on the calling thread, returns false if there was none
+	bool runPendingTask() {
+		std::function<void()> task;
+		int self = (workerOwner() == this) ? workerIndex() : -1;
+		if (self >= 0 && popBack(self, task)) {
+			task();
+			return true;
+		}
+		int n = (int)queues.size();
+		int first = (self >= 0) ? self + 1 : 0;
+		for (int i = 0; i < n; ++i) {
+			int victim = (first + i) % n;
+			if (victim != self && popFront(victim, task)) {
+				task();
+				return true;
+			}
+		}
+		return false;
+	}
+
+private:
+	struct TaskQueue {
+		std::mutex mutex;
+		std::deque<std::function<void()>> tasks;
+	};
+
+	bool popBack(int index, std::function<void()> &task) {
+		std::lock_guard<std::mutex> lock(queues[index]->mutex);
+		if (queues[index]->tasks.empty()) return false;
+		task = std::move(queues[index]->tasks.back());
+		queues[index]->tasks.pop_back();
+		queued--;
+		return true;
+	}
+	bool popFront(int index, std::function<void()> &task) {
+		std::lock_guard<std::mutex> lock(queues[index]->mutex);
+		if (queues[index]->tasks.empty()) return false;
+		task = std::move(queues[index]->tasks.front());
+		queues[index]->tasks.pop_front();
+		queued--;
+		return true;
+	}
+
+	void workerLoop(int index) {
+		workerOwner() = this;
+		workerIndex() = index;
+		while (true) {
+			if (runPendingTask()) continue;
+			std::unique_lock<std::mutex> lock(sleepMutex);
+			sleepCond.wait(lock, [this] { return stop || queued.load() > 0; });
+			if (stop) break;
+		}
+	}
+
+	static ThreadPool *&workerOwner() {
+		static thread_local ThreadPool *owner = nullptr;
+		return owner;
+	}
+	static int &workerIndex() {
+		static thread_local int index = -1;
+		return index;
+	}
+
+	std::vector<std::unique_ptr<TaskQueue>> queues;
+	std::vector<std::thread> workers;
+	std::mutex sleepMutex;
+	std::condition_variable sleepCond;
+	bool stop;
+	std::atomic<int> queued;
+	std::atomic<unsigned> nextQueue;
+};
+
+/**
+ * A set of tasks that can be waited on. The waiting thread keeps executing
+ * pending tasks of the pool instead of blocking, so groups may be nested.
+ */
+class TaskGroup
+{
+public:
+	explicit TaskGroup(ThreadPool &p) : pool(p), pending(0) {}
+	~TaskGroup() { wait(); }
+
+	template<typename F>
+	void run(F f) {
+		pending++;
+		pool.submit([this, f]() mutable {
+			f();
+			pending--;
+		});
+	}
+	void wait() {
+		while (pending.load() > 0) {
+			if (!pool.runPendingTask())
+				std::this_thread::yield();
+		}
+	}
+
+private:
+	ThreadPool &pool;
+	std::atomic<int> pending;
+};
+
+#endif
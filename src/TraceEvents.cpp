@@ -0,0 +1,115 @@
+#include "TraceEvents.h"
+
+#ifdef ENABLE_TRACE
+
+#include <atomic>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+
+namespace {
+	struct Event {
+		const char *name;
+		chrono::steady_clock::time_point begin;
+		chrono::steady_clock::time_point end;
+	};
+
+	// Events of one thread. The buffers belong to the recorder, so that the
+	// events of a pool thread outlive the thread.
+	struct ThreadBuffer {
+		int tid;
+		string name;
+		mutex lock; // only taken by write() and setThreadName()
+		vector<Event> events;
+	};
+
+	atomic<bool> recording(false);
+	chrono::steady_clock::time_point origin;
+	mutex buffersMutex;
+	vector<unique_ptr<ThreadBuffer>> buffers;
+	thread_local ThreadBuffer *threadBuffer = nullptr;
+
+	ThreadBuffer &getThreadBuffer() {
+		if (!threadBuffer) {
+			lock_guard<mutex> lock(buffersMutex);
+			buffers.push_back(make_unique<ThreadBuffer>());
+			threadBuffer = buffers.back().get();
+			threadBuffer->tid = (int)buffers.size();
+			threadBuffer->name = "thread " + to_string(threadBuffer->tid);
+			threadBuffer->events.reserve(4096);
+		}
+		return *threadBuffer;
+	}
+
+	// Escapes a string for JSON
+	string escape(const string &s) {
+		string out;
+		for (char c : s) {
+			if (c == '"' || c == '\\') out += '\\';
+			out += c;
+		}
+		return out;
+	}
+}
+
+void Trace::start()
+{
+	origin = chrono::steady_clock::now();
+	recording = true;
+}
+
+bool Trace::isRecording()
+{
+	return recording.load(memory_order_relaxed);
+}
+
+void Trace::setThreadName(const char *name)
+{
+	ThreadBuffer &buffer = getThreadBuffer();
+	lock_guard<mutex> lock(buffer.lock);
+	buffer.name = name;
+}
+
+void Trace::record(const char *name, chrono::steady_clock::time_point begin, chrono::steady_clock::time_point end)
+{
+	ThreadBuffer &buffer = getThreadBuffer();
+	// A write() in progress is the only reader
+	lock_guard<mutex> lock(buffer.lock);
+	buffer.events.push_back({ name, begin, end });
+}
+
+bool Trace::write(const string &filepath)
+{
+	FILE *file = fopen(filepath.c_str(), "w");
+	if (!file) {
+		cerr << "Couldn't write to " << filepath << endl;
+		return false;
+	}
+	size_t eventNum = 0;
+	fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"RayTracingWithDenoiser\"}}");
+	lock_guard<mutex> lock(buffersMutex);
+	for (const auto &buffer : buffers) {
+		lock_guard<mutex> bufferLock(buffer->lock);
+		fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+			buffer->tid, escape(buffer->name).c_str());
+		for (const Event &e : buffer->events) {
+			// Complete events, in microseconds since start()
+			double ts = chrono::duration<double, micro>(e.begin - origin).count();
+			double dur = chrono::duration<double, micro>(e.end - e.begin).count();
+			fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d}",
+				escape(e.name).c_str(), ts, dur, buffer->tid);
+		}
+		eventNum += buffer->events.size();
+	}
+	fprintf(file, "\n]}\n");
+	bool ok = fclose(file) == 0;
+	cout << "Wrote " << eventNum << " trace events to " << filepath << endl;
+	return ok;
+}
+
+#endif
@@ -0,0 +1,62 @@
+#pragma once
+#ifndef TRACEEVENTS_H
+#define TRACEEVENTS_H
+
+#include <string>
+
+/**
+ * Scoped timeline events written as a Chrome trace (chrome://tracing or
+ * ui.perfetto.dev). TRACE_SCOPE("name") records the time from the macro to
+ * the end of the enclosing scope on the calling thread; names must be string
+ * literals. Every thread appends to its own buffer, so threads never wait
+ * on each other while recording. Nothing is recorded until TRACE_START()
+ * and the file is written by TRACE_WRITE(). Without ENABLE_TRACE, the CMake
+ * option of the same name, every macro expands to nothing.
+ */
+#ifdef ENABLE_TRACE
+
+#include <chrono>
+
+namespace Trace {
+	// Starts recording the events
+	void start();
+	bool isRecording();
+	// Name of the calling thread in the trace
+	void setThreadName(const char *name);
+	void record(const char *name, std::chrono::steady_clock::time_point begin, std::chrono::steady_clock::time_point end);
+	// Writes the events recorded so far, returns false if the file can't be written
+	bool write(const std::string &filepath);
+
+	class Scope {
+	public:
+		explicit Scope(const char *name) : name(isRecording() ? name : nullptr) {
+			if (this->name) begin = std::chrono::steady_clock::now();
+		}
+		~Scope() {
+			if (name) record(name, begin, std::chrono::steady_clock::now());
+		}
+		Scope(const Scope &) = delete;
+		Scope &operator=(const Scope &) = delete;
+	private:
+		const char *name;
+		std::chrono::steady_clock::time_point begin;
+	};
+}
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(name) Trace::Scope TRACE_CONCAT(traceScope, __LINE__)(name)
+#define TRACE_START() Trace::start()
+#define TRACE_THREAD_NAME(name) Trace::setThreadName(name)
+#define TRACE_WRITE(filepath) Trace::write(filepath)
+
+#else
+
+#define TRACE_SCOPE(name) ((void)0)
+#define TRACE_START() ((void)0)
+#define TRACE_THREAD_NAME(name) ((void)0)
+#define TRACE_WRITE(filepath) (false)
+
+#endif
+
+#endif
@@ -0,0 +1,173 @@
+#pragma once
+#ifndef TRIANGLEKERNEL_H
+#define TRIANGLEKERNEL_H
+
+#include <cmath>
+#include <cstdint>
+
+#include <glm/glm.hpp>
+
+#include "Geometry.h"
+#include "Simd.h"
+
+// Triangle test used in the leaves: Moller-Trumbore, or the watertight test
+// below. Wide BVH leaves run the watertight test on a whole triangle packet.
+enum TriangleKernel { KERNEL_SCALAR, KERNEL_WATERTIGHT };
+
+/**
+ * Per ray constants of the watertight ray/triangle test (Woop, Benthin and
+ * Wald 2013). The triangle is translated to the ray origin and sheared so
+ * that the ray points down +z; the edge functions are then evaluated in 2D,
+ * which gives the same result for an edge shared by two triangles.
+ */
+struct WatertightRay {
+	float org[3];
+	int kx, ky, kz;
+	float Sx, Sy, Sz;
+};
+
+inline WatertightRay makeWatertightRay(const Ray &ray) {
+	WatertightRay r;
+	for (int a = 0; a < 3; ++a)
+		r.org[a] = ray.origin[a];
+	glm::vec3 d = ray.direction;
+	float ax = fabsf(d.x), ay = fabsf(d.y), az = fabsf(d.z);
+	r.kz = (ax > ay) ? (ax > az ? 0 : 2) : (ay > az ? 1 : 2);
+	r.kx = (r.kz + 1) % 3;
+	r.ky = (r.kx + 1) % 3;
+	// Keep the winding of the triangle
+	if (d[r.kz] < 0.0f) {
+		int tmp = r.kx;
+		r.kx = r.ky;
+		r.ky = tmp;
+	}
+	r.Sx = d[r.kx] / d[r.kz];
+	r.Sy = d[r.ky] / d[r.kz];
+	r.Sz = 1.0f / d[r.kz];
+	return r;
+}
+
+// Scalar watertight test, with the same outputs as the Moller-Trumbore hitTriangle
+inline bool hitTriangleWatertight(const glm::vec3 &v0, const glm::vec3 &v1, const glm::vec3 &v2,
+	const WatertightRay &r, float tMax, float &t, float &u, float &v) {
+	glm::vec3 org(r.org[0], r.org[1], r.org[2]);
+	glm::vec3 A = v0 - org, B = v1 - org, C = v2 - org;
+	float Ax = A[r.kx] - r.Sx * A[r.kz], Ay = A[r.ky] - r.Sy * A[r.kz];
+	float Bx = B[r.kx] - r.Sx * B[r.kz], By = B[r.ky] - r.Sy * B[r.kz];
+	float Cx = C[r.kx] - r.Sx * C[r.kz], Cy = C[r.ky] - r.Sy * C[r.kz];
+	float U = Cx * By - Cy * Bx;
+	float V = Ax * Cy - Ay * Cx;
+	float W = Bx * Ay - By * Ax;
+	// Exactly on an edge in single precision, decide in double precision
+	if (U == 0.0f || V == 0.0f || W == 0.0f) {
+		U = (float)((double)Cx * By - (double)Cy * Bx);
+		V = (float)((double)Ax * Cy - (double)Ay * Cx);
+		W = (float)((double)Bx * Ay - (double)By * Ax);
+	}
+	if ((U < 0.0f || V < 0.0f || W < 0.0f) && (U > 0.0f || V > 0.0f || W > 0.0f)) return false;
+	float det = U + V + W;
+	if (det == 0.0f) return false;
+	float T = U * r.Sz * A[r.kz] + V * r.Sz * B[r.kz] + W * r.Sz * C[r.kz];
+	// t = T / det must lie in (0, tMax), compared without dividing
+	if (det < 0.0f ? (T >= 0.0f || T <= tMax * det) : (T <= 0.0f || T >= tMax * det)) return false;
+	float invDet = 1.0f / det;
+	t = T * invDet;
+	u = V * invDet;
+	v = W * invDet;
+	return true;
+}
+
+/**
+ * K triangles stored as structure of arrays, so that the watertight test runs
+ * on all of them at once. Unused lanes have primId -1 and are masked out.
+ */
+template<int K>
+struct alignas(32) TrianglePacket {
+	float v[3][3][K]; // vertex, axis, lane
+	int32_t primId[K];
+	int32_t validMask;
+};
+
+// Closest hit among the lanes of the packet closer than tMax. Returns the lane, or -1 if none.
+template<int K>
+inline int IntersectPacket(const TrianglePacket<K> &p, const WatertightRay &r, float tMax,
+	float &t, float &u, float &v) {
+	int best = -1;
+	if constexpr (SimdFloat<K>::enabled) {
+		typedef SimdFloat<K> S;
+		typedef typename S::type F;
+		F ox = S::set1(r.org[r.kx]), oy = S::set1(r.org[r.ky]), oz = S::set1(r.org[r.kz]);
+		F sx = S::set1(r.Sx), sy = S::set1(r.Sy), sz = S::set1(r.Sz);
+		F Az = S::sub(S::load(p.v[0][r.kz]), oz);
+		F Bz = S::sub(S::load(p.v[1][r.kz]), oz);
+		F Cz = S::sub(S::load(p.v[2][r.kz]), oz);
+		F Ax = S::sub(S::sub(S::load(p.v[0][r.kx]), ox), S::mul(sx, Az));
+		F Ay = S::sub(S::sub(S::load(p.v[0][r.ky]), oy), S::mul(sy, Az));
+		F Bx = S::sub(S::sub(S::load(p.v[1][r.kx]), ox), S::mul(sx, Bz));
+		F By = S::sub(S::sub(S::load(p.v[1][r.ky]), oy), S::mul(sy, Bz));
+		F Cx = S::sub(S::sub(S::load(p.v[2][r.kx]), ox), S::mul(sx, Cz));
+		F Cy = S::sub(S::sub(S::load(p.v[2][r.ky]), oy), S::mul(sy, Cz));
+		F U = S::sub(S::mul(Cx, By), S::mul(Cy, Bx));
+		F V = S::sub(S::mul(Ax, Cy), S::mul(Ay, Cx));
+		F W = S::sub(S::mul(Bx, Ay), S::mul(By, Ax));
+
+		F zero = S::zero();
+		F anyNeg = S::orv(S::lt(U, zero), S::orv(S::lt(V, zero), S::lt(W, zero)));
+		F anyPos = S::orv(S::gt(U, zero), S::orv(S::gt(V, zero), S::gt(W, zero)));
+		F det = S::add(U, S::add(V, W));
+		F T = S::mul(sz, S::add(S::mul(U, Az), S::add(S::mul(V, Bz), S::mul(W, Cz))));
+		// Flip T and det to det > 0 with the sign bit of det
+		F signMask = S::set1(-0.0f);
+		F detSign = S::andv(det, signMask);
+		F absDet = S::xorv(det, detSign);
+		F signedT = S::xorv(T, detSign);
+		F hit = S::andv(S::gt(signedT, zero), S::lt(signedT, S::mul(S::set1(tMax), absDet)));
+		hit = S::andv(hit, S::gt(absDet, zero));
+		int hitMask = S::movemask(hit) & ~S::movemask(S::andv(anyNeg, anyPos)) & p.validMask;
+		// Lanes with an edge function of exactly zero go through the scalar test
+		int edgeMask = S::movemask(S::orv(S::eq(U, zero), S::orv(S::eq(V, zero), S::eq(W, zero)))) & p.validMask;
+		hitMask &= ~edgeMask;
+
+		if (hitMask) {
+			alignas(32) float ts[K], us[K], vs[K];
+			S::store(ts, S::div(T, det));
+			S::store(us, S::div(V, det));
+			S::store(vs, S::div(W, det));
+			for (int i = 0; i < K; ++i) {
+				if ((hitMask & (1 << i)) && ts[i] < tMax) {
+					tMax = ts[i];
+					t = ts[i];
+					u = us[i];
+					v = vs[i];
+					best = i;
+				}
+			}
+		}
+		for (int i = 0; i < K && edgeMask; ++i) {
+			if (!(edgeMask & (1 << i))) continue;
+			edgeMask &= ~(1 << i);
+			glm::vec3 v0(p.v[0][0][i], p.v[0][1][i], p.v[0][2][i]);
+			glm::vec3 v1(p.v[1][0][i], p.v[1][1][i], p.v[1][2][i]);
+			glm::vec3 v2(p.v[2][0][i], p.v[2][1][i], p.v[2][2][i]);
+			if (hitTriangleWatertight(v0, v1, v2, r, tMax, t, u, v)) {
+				tMax = t;
+				best = i;
+			}
+		}
+	}
+	else {
+		for (int i = 0; i < K; ++i) {
+			if (!(p.validMask & (1 << i))) continue;
+			glm::vec3 v0(p.v[0][0][i], p.v[0][1][i], p.v[0][2][i]);
+			glm::vec3 v1(p.v[1][0][i], p.v[1][1][i], p.v[1][2][i]);
+			glm::vec3 v2(p.v[2][0][i], p.v[2][1][i], p.v[2][2][i]);
+			if (hitTriangleWatertight(v0, v1, v2, r, tMax, t, u, v)) {
+				tMax = t;
+				best = i;
+			}
+		}
+	}
+	return best;
+}
+
+#endif
@@ -0,0 +1,331 @@
+#pragma once
+#ifndef WIDEBVH_H
+#define WIDEBVH_H
+
+#include <cfloat>
+#include <cstdint>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "CompactBVH.h"
+#include "Geometry.h"
+#include "Simd.h"
+#include "TriangleKernel.h"
+
+// Branching factor of the CPU BVH, set by the BVH_WIDTH CMake cache variable
+#ifndef BVH_WIDTH
+#define BVH_WIDTH 4
+#endif
+static_assert(BVH_WIDTH == 4 || BVH_WIDTH == 8, "BVH_WIDTH should be 4 or 8");
+
+/**
+ * Node of an N-wide BVH. The bounds of the N children are stored as
+ * structure of arrays so that a single SSE (N = 4) or AVX (N = 8) sequence
+ * tests all of them against a ray. Unused slots keep an empty box, which
+ * never passes the slab test.
+ */
+template<int N>
+struct alignas(32) WideBVHNode {
+	float bMin[3][N];
+	float bMax[3][N];
+	int32_t child[N]; // node index of an interior child, first packet of a leaf
+	int32_t count[N]; // packets of a leaf child, 0 for an interior child
+};
+
+template<int N>
+class WideBVH {
+public:
+	std::vector<WideBVHNode<N>> nodes;
+	// Same triangles and order as the CompactBVH the tree was collapsed from
+	std::vector<glm::vec3> vertices;
+	std::vector<uint32_t> indices;
+	// Leaf triangles, N per packet
+	std::vector<TrianglePacket<N>> packets;
+
+	// Collapses the binary tree, pulling up grandchildren until every node has
+	// N children. Subtrees of at most N triangles become a single leaf packet.
+	void build(const CompactBVH &bvh) {
+		nodes.clear();
+		packets.clear();
+		vertices = bvh.vertices;
+		indices = bvh.indices;
+		if (bvh.nodes.empty()) return;
+
+		// Children come after their parent in the depth first order, and the
+		// primitives of a subtree are contiguous
+		int binaryNum = (int)bvh.nodes.size();
+		primStart.assign(binaryNum, 0);
+		primCount.assign(binaryNum, 0);
+		for (int i = binaryNum - 1; i >= 0; --i) {
+			const CompactBVHNode &node = bvh.nodes[i];
+			if (node.nPrimitives > 0) {
+				primStart[i] = node.offset;
+				primCount[i] = node.nPrimitives;
+			}
+			else {
+				primStart[i] = primStart[i + 1];
+				primCount[i] = primCount[i + 1] + primCount[node.offset];
+			}
+		}
+		nodes.reserve(binaryNum / 2 + 1);
+		collapse(bvh, 0);
+		primStart.clear();
+		primCount.clear();
+	}
+
+	size_t memoryUsage() const {
+		return nodes.size() * sizeof(WideBVHNode<N>) + vertices.size() * sizeof(glm::vec3)
+			+ indices.size() * sizeof(uint32_t) + packets.size() * sizeof(TrianglePacket<N>);
+	}
+
+private:
+	bool isLeaf(const CompactBVH &bvh, int binaryIndex) const {
+		return bvh.nodes[binaryIndex].nPrimitives > 0 || primCount[binaryIndex] <= N;
+	}
+
+	// Packs the primitives of a subtree, returns the index of the first packet
+	int addPackets(int start, int count) {
+		int first = (int)packets.size();
+		for (int i = 0; i < count; i += N) {
+			TrianglePacket<N> packet;
+			packet.validMask = 0;
+			for (int lane = 0; lane < N; ++lane) {
+				int prim = start + i + lane;
+				bool valid = i + lane < count;
+				packet.primId[lane] = valid ? prim : -1;
+				if (valid) packet.validMask |= 1 << lane;
+				for (int k = 0; k < 3; ++k) {
+					glm::vec3 p = valid ? vertices[indices[3 * prim + k]] : glm::vec3(0.0f);
+					for (int a = 0; a < 3; ++a)
+						packet.v[k][a][lane] = p[a];
+				}
+			}
+			packets.push_back(packet);
+		}
+		return first;
+	}
+
+	int collapse(const CompactBVH &bvh, int binaryIndex) {
+		const CompactBVHNode *binary = bvh.nodes.data();
+		int slots[N];
+		int slotNum = 0;
+		if (isLeaf(bvh, binaryIndex)) {
+			slots[slotNum++] = binaryIndex;
+		}
+		else {
+			slots[slotNum++] = binaryIndex + 1;
+			slots[slotNum++] = binary[binaryIndex].offset;
+		}
+		// Open the interior child with the largest surface area
+		while (slotNum < N) {
+			int best = -1;
+			float bestArea = -1.0f;
+			for (int i = 0; i < slotNum; ++i) {
+				if (isLeaf(bvh, slots[i])) continue;
+				const CompactBVHNode &node = binary[slots[i]];
+				float area = Bound3f(node.pMin, node.pMax).SurfaceArea();
+				if (area > bestArea) {
+					bestArea = area;
+					best = i;
+				}
+			}
+			if (best < 0) break;
+			int index = slots[best];
+			slots[best] = index + 1;
+			slots[slotNum++] = binary[index].offset;
+		}
+
+		int wideIndex = (int)nodes.size();
+		nodes.emplace_back();
+		WideBVHNode<N> node;
+		for (int i = 0; i < N; ++i) {
+			for (int a = 0; a < 3; ++a) {
+				node.bMin[a][i] = FLT_MAX;
+				node.bMax[a][i] = -FLT_MAX;
+			}
+			node.child[i] = 0;
+			node.count[i] = 0;
+		}
+		for (int i = 0; i < slotNum; ++i) {
+			const CompactBVHNode &b = binary[slots[i]];
+			for (int a = 0; a < 3; ++a) {
+				node.bMin[a][i] = b.pMin[a];
+				node.bMax[a][i] = b.pMax[a];
+			}
+			if (isLeaf(bvh, slots[i])) {
+				int count = primCount[slots[i]];
+				node.child[i] = addPackets(primStart[slots[i]], count);
+				node.count[i] = (count + N - 1) / N;
+			}
+			else {
+				node.child[i] = collapse(bvh, slots[i]);
+			}
+		}
+		nodes[wideIndex] = node;
+		return wideIndex;
+	}
+
+	// Primitive range of every binary node, only valid during build()
+	std::vector<int> primStart;
+	std::vector<int> primCount;
+};
+
+// Ray data shared by all node tests of one traversal
+struct WideRay {
+	float org[3];
+	float invDir[3];
+	int dirIsNeg[3];
+};
+
+inline WideRay makeWideRay(const Ray &ray) {
+	WideRay r;
+	for (int a = 0; a < 3; ++a) {
+		r.org[a] = ray.origin[a];
+		r.invDir[a] = 1 / ray.direction[a];
+		r.dirIsNeg[a] = r.invDir[a] < 0;
+	}
+	return r;
+}
+
+// Slab test of all children, returns a bit mask of the hit ones and their entry distances
+template<int N>
+inline int IntersectChildren(const WideBVHNode<N> &node, const WideRay &r, float tMax, float tNear[N]) {
+	const float *nearX = r.dirIsNeg[0] ? node.bMax[0] : node.bMin[0];
+	const float *farX = r.dirIsNeg[0] ? node.bMin[0] : node.bMax[0];
+	const float *nearY = r.dirIsNeg[1] ? node.bMax[1] : node.bMin[1];
+	const float *farY = r.dirIsNeg[1] ? node.bMin[1] : node.bMax[1];
+	const float *nearZ = r.dirIsNeg[2] ? node.bMax[2] : node.bMin[2];
+	const float *farZ = r.dirIsNeg[2] ? node.bMin[2] : node.bMax[2];
+#if defined(SIMD_AVX)
+	if constexpr (N == 8) {
+		__m256 ox = _mm256_set1_ps(r.org[0]), oy = _mm256_set1_ps(r.org[1]), oz = _mm256_set1_ps(r.org[2]);
+		__m256 ix = _mm256_set1_ps(r.invDir[0]), iy = _mm256_set1_ps(r.invDir[1]), iz = _mm256_set1_ps(r.invDir[2]);
+		__m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(nearX), ox), ix);
+		__m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(farX), ox), ix);
+		t0 = _mm256_max_ps(t0, _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(nearY), oy), iy));
+		t1 = _mm256_min_ps(t1, _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(farY), oy), iy));
+		t0 = _mm256_max_ps(t0, _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(nearZ), oz), iz));
+		t1 = _mm256_min_ps(t1, _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(farZ), oz), iz));
+		t1 = _mm256_mul_ps(t1, _mm256_set1_ps(BoxFarScale));
+		__m256 hit = _mm256_and_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ),
+			_mm256_and_ps(_mm256_cmp_ps(t1, _mm256_setzero_ps(), _CMP_GT_OQ),
+				_mm256_cmp_ps(t0, _mm256_set1_ps(tMax), _CMP_LT_OQ)));
+		_mm256_storeu_ps(tNear, t0);
+		return _mm256_movemask_ps(hit);
+	}
+#endif
+#if defined(SIMD_SSE)
+	if constexpr (N == 4) {
+		__m128 ox = _mm_set1_ps(r.org[0]), oy = _mm_set1_ps(r.org[1]), oz = _mm_set1_ps(r.org[2]);
+		__m128 ix = _mm_set1_ps(r.invDir[0]), iy = _mm_set1_ps(r.invDir[1]), iz = _mm_set1_ps(r.invDir[2]);
+		__m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(nearX), ox), ix);
+		__m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(farX), ox), ix);
+		t0 = _mm_max_ps(t0, _mm_mul_ps(_mm_sub_ps(_mm_load_ps(nearY), oy), iy));
+		t1 = _mm_min_ps(t1, _mm_mul_ps(_mm_sub_ps(_mm_load_ps(farY), oy), iy));
+		t0 = _mm_max_ps(t0, _mm_mul_ps(_mm_sub_ps(_mm_load_ps(nearZ), oz), iz));
+		t1 = _mm_min_ps(t1, _mm_mul_ps(_mm_sub_ps(_mm_load_ps(farZ), oz), iz));
+		t1 = _mm_mul_ps(t1, _mm_set1_ps(BoxFarScale));
+		__m128 hit = _mm_and_ps(_mm_cmple_ps(t0, t1),
+			_mm_and_ps(_mm_cmpgt_ps(t1, _mm_setzero_ps()), _mm_cmplt_ps(t0, _mm_set1_ps(tMax))));
+		_mm_storeu_ps(tNear, t0);
+		return _mm_movemask_ps(hit);
+	}
+#endif
+	// Portable fallback, the same arithmetic one child at a time
+	int mask = 0;
+	for (int i = 0; i < N; ++i) {
+		float t0 = (nearX[i] - r.org[0]) * r.invDir[0];
+		float t1 = (farX[i] - r.org[0]) * r.invDir[0];
+		t0 = glm::max(t0, (nearY[i] - r.org[1]) * r.invDir[1]);
+		t1 = glm::min(t1, (farY[i] - r.org[1]) * r.invDir[1]);
+		t0 = glm::max(t0, (nearZ[i] - r.org[2]) * r.invDir[2]);
+		t1 = glm::min(t1, (farZ[i] - r.org[2]) * r.invDir[2]) * BoxFarScale;
+		tNear[i] = t0;
+		if (t0 <= t1 && t1 > 0.0f && t0 < tMax) mask |= 1 << i;
+	}
+	return mask;
+}
+
+// Closest hit, same interface as IntersectCompactBVH. Hit children are
+// visited nearest first, and stacked entries beyond the closest hit are skipped.
+template<int N, TriangleKernel kernel = KERNEL_WATERTIGHT>
+inline bool IntersectWideBVH(const WideBVH<N> &bvh, const Ray &ray, float &tHit, int &primId,
+	long long *nodesVisited = nullptr) {
+	if (bvh.nodes.empty()) return false;
+	struct StackEntry {
+		int32_t child;
+		int32_t count;
+		float tNear;
+	};
+	WideRay r = makeWideRay(ray);
+	WatertightRay wr{};
+	if constexpr (kernel == KERNEL_WATERTIGHT)
+		wr = makeWatertightRay(ray);
+	const WideBVHNode<N> *nodes = bvh.nodes.data();
+	const TrianglePacket<N> *packets = bvh.packets.data();
+	const glm::vec3 *vertices = bvh.vertices.data();
+	const uint32_t *indices = bvh.indices.data();
+
+	float tMax = FLT_MAX;
+	primId = -1;
+	long long visited = 0;
+	StackEntry stack[64 * N];
+	int stackSize = 0;
+	stack[stackSize++] = { 0, 0, 0.0f };
+	while (stackSize > 0) {
+		StackEntry entry = stack[--stackSize];
+		if (entry.tNear >= tMax) continue;
+		if (entry.count > 0) {
+			for (int i = 0; i < entry.count; ++i) {
+				const TrianglePacket<N> &packet = packets[entry.child + i];
+				if constexpr (kernel == KERNEL_WATERTIGHT) {
+					float t, u, v;
+					int lane = IntersectPacket<N>(packet, wr, tMax, t, u, v);
+					if (lane >= 0) {
+						tMax = t;
+						primId = packet.primId[lane];
+					}
+				}
+				else {
+					for (int lane = 0; lane < N && packet.primId[lane] >= 0; ++lane) {
+						const uint32_t *tri = &indices[3 * packet.primId[lane]];
+						float t = hitTriangle(vertices[tri[0]], vertices[tri[1]], vertices[tri[2]], ray);
+						if (t > 0.0f && t < tMax) {
+							tMax = t;
+							primId = packet.primId[lane];
+						}
+					}
+				}
+			}
+			continue;
+		}
+
+		const WideBVHNode<N> &node = nodes[entry.child];
+		visited++;
+		alignas(32) float tNear[N];
+		int mask = IntersectChildren<N>(node, r, tMax, tNear);
+		if (mask == 0) continue;
+
+		// Sort the hit children far to near so that the nearest is popped first
+		StackEntry hits[N];
+		int hitNum = 0;
+		for (int i = 0; i < N; ++i) {
+			if (!(mask & (1 << i))) continue;
+			StackEntry e = { node.child[i], node.count[i], tNear[i] };
+			int j = hitNum++;
+			while (j > 0 && hits[j - 1].tNear < e.tNear) {
+				hits[j] = hits[j - 1];
+				--j;
+			}
+			hits[j] = e;
+		}
+		for (int i = 0; i < hitNum; ++i)
+			stack[stackSize++] = hits[i];
+	}
+	if (nodesVisited) *nodesVisited += visited;
+	tHit = tMax;
+	return primId >= 0;
+}
+
+#endif
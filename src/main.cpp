@@ -1,8 +1,11 @@
 #include <cassert>
+#include <chrono>
+#include <climits>
 #include <cstring>
 #define _USE_MATH_DEFINES
 #include <cmath>
 #include <iostream>
+#include <random>
 
 #define GLEW_STATIC
 #include <GL/glew.h>
@@ -14,6 +17,7 @@
 
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
+#undef STB_IMAGE_WRITE_IMPLEMENTATION
 
 #include "Camera.h"
 #include "GLSL.h"
@@ -26,6 +30,20 @@
 #include "TimeRecord.h"
 #include "Tool.h"
 #include "Sphere.h"
+#include "CPURenderer.h"
+#include "CPUDenoiser.h"
+#include "BVHTree.h"
+#include "CompactBVH.h"
+#include "WideBVH.h"
+#include "RayPacket.h"
+#include "BVHBenchmark.h"
+#include "BVHBuffer.h"
+#include "SceneBuffer.h"
+#include "ImageWriter.h"
+#include "ReadbackRing.h"
+#include "CameraPath.h"
+#include "GPUProfiler.h"
+#include "TraceEvents.h"
 
 #define MAX_LIGHTS 3
 #define KEY_COUNT 349
@@ -34,24 +52,100 @@ using namespace std;
 GLFWwindow *window; // Main application window
 string RESOURCE_DIR = "./"; // Where the resources are loaded from
 bool OFFLINE = false;
+bool CPU_RENDER = false; // Render with the CPU path tracer, no window or OpenGL needed
+bool HEADLESS = false; // Render offscreen with no window, on the CPU if there is no OpenGL context
+// Frames rendered before the image is saved in OFFLINE, headless and CPU mode. If 0,
+// one frame, or as many as needed to reach TIME_BUDGET or VARIANCE_TARGET.
+int FRAME_NUM = 0;
+bool ACCUMULATE = false; // Average the frames of OFFLINE, headless and CPU mode into one image
+double TIME_BUDGET = 0.0; // Stop rendering frames after this many seconds, if > 0
+double VARIANCE_TARGET = 0.0; // Stop once the mean variance of the accumulated pixels is below this, if > 0
+int VARIANCE_INTERVAL = 16; // Frames between two variance checks, each one reads back the luminance moments
+int SPP = 0; // Samples per pixel if > 0, instead of the first spp setting
+string OUTPUT_PATH = "output.png"; // Image saved in OFFLINE, headless and CPU mode
+string CAMERA_PATH = ""; // Keyframe file of a fly-through rendered frame by frame in headless or CPU mode
+float PATH_FPS = 24.0f; // Frames per second of the CAMERA_PATH fly-through
+bool AOV = false; // Also save the float color, depth, normal and variance of each saved image as PFM
+bool VSYNC = true; // Swap interval 1 in the window, frames are capped at the display refresh
+bool BENCHMARK = false; // Time every spp setting on a fixed scene and camera and exit
+bool DENOISE_TEST = false; // Check the CPU denoisers against the OpenGL ones and exit
+int WARMUP_NUM = 20; // Frames rendered before BENCHMARK starts timing an spp setting
+bool PROFILE = false; // Time the passes of every frame with GPU timer queries
+string PROFILE_CSV = ""; // CSV file of the per frame pass times, implies PROFILE
+string TRACE_PATH = ""; // Chrome trace of the frame phases written on exit, needs the ENABLE_TRACE build
+bool BVH_TEST = false; // Print the BVH quality of the shipped meshes and exit
+bool BVH_BENCH = false; // Time the CPU BVH traversals on the shipped meshes and exit
+int THREAD_NUM = 0; // Threads of the CPU renderer, 0 means all cores
+float RAND_ORIGIN = 0.0f; // Fixed random seed of the ray tracer if > 0, for comparing renders
+int PARTICLE_NUM = 0; // Small spheres scattered on the ground in addition to the 8 of the scene
+string MESH_NAME = ""; // Triangle mesh added to the scene, such as bunny.obj
+int ATROUS_NUM = 5; // A-trous iterations of the spatial denoiser, of step width 1, 2, 4, ...
+// Passes of an a-trous iteration in OpenGL: the 5x5 taps at once, a horizontal
+// and a vertical pass of 5 taps, or those with the bilinear variance prefilter
+enum Spatial_Filter {
+	FILTER_ATROUS,
+	FILTER_SEPARABLE,
+	FILTER_LINEAR
+};
+int SPATIAL_FILTER = FILTER_ATROUS;
+int MAX_HISTORY = 32; // Frames of history the temporal denoiser averages at most, then a moving average
+float HISTORY_CLAMP = 1.5f; // History is clamped to this many standard deviations around the new samples
 
 shared_ptr<Camera> camera;
+shared_ptr<Camera> prevCamera; // camera of the last frame, which the temporal denoiser reprojects into
 shared_ptr<Program> prog;
 shared_ptr<Shape> shape;
 shared_ptr<Material> material;
 shared_ptr<Light> light;
 shared_ptr<RT_Screen> screen;
 shared_ptr<RenderBuffer> screenBuffer;
+shared_ptr<OutputFBO> outputBuffer; // target of the screen pass in headless mode
+shared_ptr<DenoiseBuffer> denoiseBuffer; // ping-pong targets of the spatial denoiser
+shared_ptr<ImageWriter> imageWriter; // encodes the saved images in the background
+shared_ptr<ReadbackRing> readback; // reads the saved images back from OpenGL
 shared_ptr<timeRecord> tRecord;
 shared_ptr<Sphere> sphere;
+shared_ptr<BVHTree> meshTree;
+shared_ptr<BVHBuffer> meshBuffer;
 
 bool keyToggles[KEY_COUNT] = {false}; // only for English keyboards!
-char uniformName[50];
 
 int programIndex;
 int programNum;
 vector<shared_ptr<Program>> programs;
 
+// Uniform locations of the ray tracer program, looked up once in init()
+struct RayTracerUniforms {
+	GLint historyTexture;
+	GLint historyluminance1Texture, historyluminance2Texture;
+	GLint accumulate;
+	GLint camPos, front, right, up, halfH, halfW, leftbottom, LoopNum;
+	GLint randOrigin, spp;
+	GLint sphereNodeTexture, sphereTexture;
+	GLint bvhNodeTexture, bvhMeshTexture, meshNum, meshAlbedo, meshMaterialIndex;
+} rtUniforms;
+// Uniform locations of the screen program
+struct ScreenUniforms {
+	GLint screenTexture;
+} screenUniforms;
+// Uniform locations of the a-trous program of the spatial denoiser
+struct ATrousUniforms {
+	GLint estimateVariance, stepWidth, direction, linearVariance, sigmaDepth, sigmaNormal, sigmaLuminance;
+	GLint screenTexture, depthTexture, normalTexture, countTexture, luminance1Texture, luminance2Texture;
+	GLint inputTexture;
+} atrousUniforms;
+// Uniform locations of the temporal resolve program of the temporal denoiser
+struct TemporalUniforms {
+	GLint camPos, front, right, up, halfH, halfW, leftbottom;
+	GLint prevCamPos, prevFront, prevRight, prevUp, prevHalfH, prevHalfW;
+	GLint historyValid, maxHistory, clampGamma;
+	GLint sampleTexture, depthTexture, normalTexture;
+	GLint historyTexture, historyDepthTexture, historyNormalTexture, historyCountTexture;
+	GLint historyluminance1Texture, historyluminance2Texture;
+} temporalUniforms;
+const GLuint SCENE_BLOCK_BINDING = 0;
+shared_ptr<SceneBuffer> sceneBuffer; // spheres and light of the ray tracer, uploaded when they change
+
 int materialIndex;
 int materialNum;
 vector<shared_ptr<Material>> materials;
@@ -78,8 +172,30 @@ unsigned int SCR_HEIGHT = 800;
 bool temporalDenoiser = false;
 bool spatialDenoiser = false;
 
+chrono::steady_clock::time_point offlineStart; // first frame of the OFFLINE render
+CameraPath cameraPath; // loaded from CAMERA_PATH
+
+// Passes timed by the profiler
+enum Profile_Pass {
+	PASS_TRACE,
+	PASS_TEMPORAL,
+	PASS_DENOISE,
+	PASS_SCREEN,
+	PASS_READBACK
+};
+enum Profile_CPUPass {
+	PASS_SWAP
+};
+shared_ptr<GPUProfiler> profiler;
+
 float globalLight;
 
+// The mesh is fitted to the unit box, scaled and stood on the ground at meshPosition
+glm::vec3 meshPosition(0.0f, -0.5f, -0.1f);
+float meshScale = 0.6f;
+glm::vec3 meshAlbedo(0.8f, 0.6f, 0.2f);
+int meshMaterialIndex = DIFFUSE;
+
 // This function is called when a GLFW error occurs
 static void error_callback(int error, const char *description)
 {
@@ -91,95 +207,547 @@ void processInput(GLFWwindow* window);
 void mouse_callback(GLFWwindow* window, double xpos, double ypos);
 void scroll_callback(GLFWwindow* window, double xoffset, double yoffset);
 
-// https://lencerf.github.io/post/2019-09-21-save-the-opengl-rendering-to-image-file/
-static void saveImage(const char *filepath, GLFWwindow *w)
+// Size of the image rendered by OpenGL, the window or the headless output
+static void getFramebufferSize(int &width, int &height)
 {
-	int width, height;
-	glfwGetFramebufferSize(w, &width, &height);
-	GLsizei nrChannels = 3;
-	GLsizei stride = nrChannels * width;
-	stride += (stride % 4) ? (4 - stride % 4) : 0;
-	GLsizei bufferSize = stride * height;
-	std::vector<char> buffer(bufferSize);
-	glPixelStorei(GL_PACK_ALIGNMENT, 4);
-	glReadBuffer(GL_BACK);
-	glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, buffer.data());
-	stbi_flip_vertically_on_write(true);
-	int rc = stbi_write_png(filepath, width, height, nrChannels, buffer.data(), stride);
-	if(rc) {
-		cout << "Wrote to " << filepath << endl;
-	} else {
-		cout << "Couldn't write to " << filepath << endl;
+	if (HEADLESS) {
+		width = SCR_WIDTH;
+		height = SCR_HEIGHT;
+	}
+	else {
+		glfwGetFramebufferSize(window, &width, &height);
 	}
 }
 
-// This function is called once to initialize the scene and OpenGL
-static void init()
+// An OUTPUT_PATH with a printf pattern such as frame%04d.png saves every frame
+static bool isSequence()
 {
-	// Initial programs
-	programNum = 2;
-	for (int i = 0; i < programNum; ++i) {
-		programs.push_back(make_shared<Program>());
+	return OUTPUT_PATH.find('%') != string::npos;
+}
+
+static string getOutputPath(int frame)
+{
+	if (!isSequence()) {
+		return OUTPUT_PATH;
 	}
+	char path[1024];
+	snprintf(path, sizeof(path), OUTPUT_PATH.c_str(), frame);
+	return path;
+}
 
-	prog = programs[0];
-	prog->setShaderNames(RESOURCE_DIR + "RayTracerVertexShader.glsl", RESOURCE_DIR + "RayTracerFragmentShader.glsl");
-	prog->setVerbose(true);
-	prog->init();
-	prog->addUniform("historyTexture");
-	prog->addUniform("historyDepthTexture");
-	prog->addUniform("historyNormalTexture");
-	prog->addUniform("historyCountTexture");
-	prog->addUniform("historyluminance1Texture");
-	prog->addUniform("historyluminance2Texture");
-	prog->addUniform("temporalDenoiser");
-	prog->addUniform("spatialDenoiser");
-	prog->addUniform("sphereNum");
-	prog->addUniform("globalLight");
+// A camera path renders a batch of shots, each is one image of the sequence
+static bool isBatch()
+{
+	return !cameraPath.empty();
+}
+
+static int getShotNum()
+{
+	return isBatch() ? cameraPath.getFrameNum(PATH_FPS) : 1;
+}
+
+// Moves the camera to shot of the camera path. The scene, its BVH and the
+// GPU buffers stay as they are, only the accumulation restarts.
+static void setShot(int shot)
+{
+	if (isBatch()) {
+		CameraKey key = cameraPath.getFrame(shot, PATH_FPS);
+		camera->setView(key.position, key.yaw, key.pitch, key.fov);
+	}
+}
+
+// Index of the image of a frame: one per shot in batch mode, else one per
+// frame of a sequence
+static int getImageIndex(int shot, int frame)
+{
+	return isBatch() ? shot : frame;
+}
+
+// Whether the frame, done if it is the last of its shot, is saved
+static bool isSavedFrame(bool done)
+{
+	return done || (isSequence() && !isBatch());
+}
+
+// A .hdr path saves the float radiance instead of the 8 bit screen
+static bool isHDRPath(const string &path)
+{
+	return path.size() >= 4 && path.compare(path.size() - 4, 4, ".hdr") == 0;
+}
+
+// Path of the AOV name saved with the image at path: out.png gives out.depth.pfm
+static string getAOVPath(const string &path, const string &name)
+{
+	size_t dot = path.find_last_of('.');
+	size_t slash = path.find_last_of("/\\");
+	string stem = (dot != string::npos && (slash == string::npos || dot > slash)) ? path.substr(0, dot) : path;
+	return stem + "." + name + ".pfm";
+}
+
+// Luminance variance of the mean of count frames, per pixel
+static vector<float> getPixelVariance(const vector<float> &luminance1, const vector<float> &luminance2, const vector<int> &count)
+{
+	vector<float> variance(luminance1.size());
+	for (size_t i = 0; i < variance.size(); ++i) {
+		float m1 = luminance1[i];
+		variance[i] = max(0.0f, luminance2[i] - m1 * m1) / max(1, count[i]);
+	}
+	return variance;
+}
+
+// Saves the float attachments of the frame just rendered by OpenGL next to
+// the image at path. The reads are synchronous, they only follow saved frames.
+static void saveAOVs(const string &path)
+{
+	int width, height;
+	getFramebufferSize(width, height);
+	size_t pixelNum = (size_t)width * height;
+	vector<float> color(3 * pixelNum), depth(pixelNum), normal(3 * pixelNum);
+	vector<float> luminance1(pixelNum), luminance2(pixelNum);
+	vector<int> count(pixelNum);
+	screenBuffer->readAttachment(0, GL_RGB, GL_FLOAT, color.data(), width, height);
+	screenBuffer->readAttachment(1, GL_RED, GL_FLOAT, depth.data(), width, height);
+	screenBuffer->readAttachment(2, GL_RGB, GL_FLOAT, normal.data(), width, height);
+	screenBuffer->readAttachment(3, GL_RED_INTEGER, GL_INT, count.data(), width, height);
+	screenBuffer->readLuminance(width, height, luminance1.data(), luminance2.data());
 	GLSL::checkError(GET_FILE_LINE);
-	//camera
-	prog->addUniform("camera.camPos");
-	prog->addUniform("camera.front");
-	prog->addUniform("camera.right");
-	prog->addUniform("camera.up");
-	prog->addUniform("camera.halfH");
-	prog->addUniform("camera.halfW");
-	prog->addUniform("camera.leftbottom");
-	prog->addUniform("camera.LoopNum");
-	//random
-	prog->addUniform("randOrigin");
+	imageWriter->writePFM(getAOVPath(path, "color"), width, height, 3, move(color));
+	imageWriter->writePFM(getAOVPath(path, "depth"), width, height, 1, move(depth));
+	imageWriter->writePFM(getAOVPath(path, "normal"), width, height, 3, move(normal));
+	imageWriter->writePFM(getAOVPath(path, "variance"), width, height, 1, getPixelVariance(luminance1, luminance2, count));
+}
 
-	//sphere
-	sphereNum = 8;
-	for (int i = 0; i < sphereNum; ++i) {
-		sprintf(uniformName, "sphere[%d].radius", i);
-		prog->addUniform(string(uniformName));
+// Last pass of the spatial denoiser, whose denoiseBuffer target is its output
+static int getDenoiseOutputPass()
+{
+	return SPATIAL_FILTER == FILTER_ATROUS ? ATROUS_NUM : 2 * ATROUS_NUM;
+}
 
-		sprintf(uniformName, "sphere[%d].center", i);
-		prog->addUniform(string(uniformName));
+// Starts the asynchronous save of the frame just rendered by OpenGL. PNG is
+// read from the screen pass output, HDR from the accumulated radiance.
+static void saveFrame(const string &path)
+{
+	TRACE_SCOPE("save frame");
+	if (profiler) {
+		profiler->begin(PASS_READBACK);
+	}
+	int width, height;
+	getFramebufferSize(width, height);
+	if (isHDRPath(path)) {
+		GLuint framebuffer = spatialDenoiser ? denoiseBuffer->getFramebuffer(getDenoiseOutputPass()) : screenBuffer->getCurrentFramebuffer();
+		readback->read(framebuffer, GL_COLOR_ATTACHMENT0, width, height, true, path);
+	}
+	else if (outputBuffer) {
+		readback->read(outputBuffer->getFramebuffer(), GL_COLOR_ATTACHMENT0, width, height, false, path);
+	}
+	else {
+		readback->read(0, GL_BACK, width, height, false, path);
+	}
+	GLSL::checkError(GET_FILE_LINE);
+	if (AOV) {
+		saveAOVs(path);
+	}
+	if (profiler) {
+		profiler->end(PASS_READBACK);
+	}
+}
 
-		sprintf(uniformName, "sphere[%d].materialIndex", i);
-		prog->addUniform(string(uniformName));
+// Seed of the ray tracer random numbers for one frame. A fixed seed still
+// changes from frame to frame, so that accumulated frames differ.
+static float getRandOrigin(int frame)
+{
+	if (RAND_ORIGIN > 0.0f) {
+		return RAND_ORIGIN + 7919.0f * frame;
+	}
+	return 674764.0f * (GetCPURandom() + 1.0f);
+}
 
-		sprintf(uniformName, "sphere[%d].albedo", i);
-		prog->addUniform(string(uniformName));
+// Returns true once an offline render has all its frames: FRAME_NUM frames, or
+// TIME_BUDGET seconds, or a mean pixel variance below VARIANCE_TARGET. The
+// variance, from meanVariance(), is only checked every VARIANCE_INTERVAL frames.
+template<typename F>
+static bool offlineDone(int frames, double elapsed, F meanVariance)
+{
+	bool hasTarget = TIME_BUDGET > 0.0 || VARIANCE_TARGET > 0.0;
+	int maxFrames = FRAME_NUM > 0 ? FRAME_NUM : (hasTarget ? INT_MAX : 1);
+	if (frames >= maxFrames) {
+		return true;
+	}
+	if (TIME_BUDGET > 0.0 && elapsed >= TIME_BUDGET) {
+		return true;
 	}
+	if (VARIANCE_TARGET > 0.0 && frames % VARIANCE_INTERVAL == 0) {
+		double variance = meanVariance();
+		cout << frames << " frames, mean variance " << variance << endl;
+		return variance <= VARIANCE_TARGET;
+	}
+	return false;
+}
 
+// Returns true if arg is "--name=value" and stores value
+static bool getOption(const string &arg, const string &name, string &value)
+{
+	string prefix = "--" + name + "=";
+	if (arg.compare(0, prefix.size(), prefix) != 0) {
+		return false;
+	}
+	value = arg.substr(prefix.size());
+	return true;
+}
 
-	prog->addUniform("spp");
-	prog->setVerbose(false);
-	
-	prog = programs[1];
-	prog->setShaderNames(RESOURCE_DIR + "ScreenVertexShader.glsl", RESOURCE_DIR + "ScreenFragmentShader.glsl");
-	prog->setVerbose(true);
-	prog->init();
-	prog->addUniform("spatialDenoiser");
-	prog->addUniform("screenTexture");
-	prog->addUniform("historyluminance1Texture");
-	prog->addUniform("historyluminance2Texture");
-	prog->addUniform("texelWidth");
-	prog->addUniform("texelHeight");
-	prog->setVerbose(false);
+// Renders the frames of the scene on the CPU and saves the last one, or their
+// average with ACCUMULATE, to OUTPUT_PATH
+static int renderCPU()
+{
+	camera = make_shared<Camera>(SCR_WIDTH, SCR_HEIGHT);
+
+	CPURenderer renderer(THREAD_NUM);
+	renderer.setScene(spheres, globalLight);
+	renderer.setMesh(meshTree, meshAlbedo, meshMaterialIndex);
+	// The denoisers of OpenGL, with the history of the last frame and its camera
+	bool temporalResolve = temporalDenoiser && !ACCUMULATE;
+	CPUDenoiser denoiser(THREAD_NUM);
+	DenoiseFrame sample, resolved, history, denoised;
+	Camera historyCamera = *camera;
+	bool historyValid = false;
+	const DenoiseFrame *output = nullptr; // the denoised frame, if any
+	auto denoiseFrame = [&]() {
+		renderer.getDenoiseFrame(sample);
+		output = &sample;
+		if (temporalResolve) {
+			denoiser.resolveTemporal(sample, *camera, historyValid ? &history : nullptr, &historyCamera,
+				MAX_HISTORY, HISTORY_CLAMP, resolved);
+			swap(history, resolved);
+			historyCamera = *camera;
+			historyValid = true;
+			output = &history;
+		}
+		if (spatialDenoiser) {
+			denoiser.filter(*output, ATROUS_NUM, denoised);
+			output = &denoised;
+		}
+	};
+	ImageWriter writer;
+	auto saveFrame = [&](int frame) {
+		TRACE_SCOPE("save frame");
+		string path = getOutputPath(frame);
+		if (isHDRPath(path)) {
+			vector<float> pixels;
+			if (output) {
+				pixels = output->getColorRGB();
+			}
+			else {
+				pixels.resize(3 * renderer.getColor().size());
+				memcpy(pixels.data(), renderer.getColor().data(), pixels.size() * sizeof(float));
+			}
+			writer.writeHDR(path, SCR_WIDTH, SCR_HEIGHT, move(pixels));
+		}
+		else {
+			writer.writePNG(path, SCR_WIDTH, SCR_HEIGHT, output ? output->getImageBytes() : renderer.getImageBytes());
+		}
+		if (AOV) {
+			size_t pixelNum = renderer.getDepth().size();
+			vector<float> color(3 * pixelNum), normal(3 * pixelNum);
+			memcpy(color.data(), renderer.getColor().data(), color.size() * sizeof(float));
+			memcpy(normal.data(), renderer.getNormal().data(), normal.size() * sizeof(float));
+			writer.writePFM(getAOVPath(path, "color"), SCR_WIDTH, SCR_HEIGHT, 3, move(color));
+			writer.writePFM(getAOVPath(path, "depth"), SCR_WIDTH, SCR_HEIGHT, 1, renderer.getDepth());
+			writer.writePFM(getAOVPath(path, "normal"), SCR_WIDTH, SCR_HEIGHT, 3, move(normal));
+			writer.writePFM(getAOVPath(path, "variance"), SCR_WIDTH, SCR_HEIGHT, 1, renderer.getVariance());
+		}
+	};
+	// The workers of the writer encode a shot while the next one renders
+	auto batchStart = chrono::steady_clock::now();
+	int shotNum = getShotNum();
+	for (int shot = 0; shot < shotNum; ++shot) {
+		setShot(shot);
+		historyValid = false;
+		auto start = chrono::steady_clock::now();
+		double elapsed = 0.0;
+		int frame = 0;
+		bool done = false;
+		do {
+			renderer.render(*camera, SCR_WIDTH, SCR_HEIGHT, *spps[sppIndex], getRandOrigin(frame), ACCUMULATE && frame > 0);
+			if (temporalResolve || spatialDenoiser) {
+				denoiseFrame();
+			}
+			if (!ACCUMULATE) {
+				renderer.printStats();
+				if (temporalResolve || spatialDenoiser) {
+					cout << "CPU denoise: temporal " << denoiser.getTemporalTime() * 1000.0 << " ms, a-trous "
+						<< denoiser.getFilterTime() * 1000.0 << " ms" << endl;
+				}
+			}
+			frame++;
+			elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+			done = offlineDone(frame, elapsed, [&]() { return renderer.getMeanVariance(); });
+			if (isSavedFrame(done)) {
+				saveFrame(getImageIndex(shot, frame - 1));
+			}
+		} while (!done);
+		if (isBatch()) {
+			cout << "Shot " << shot + 1 << "/" << shotNum << ": ";
+		}
+		if (ACCUMULATE) {
+			cout << "CPU render " << SCR_WIDTH << "x" << SCR_HEIGHT << ", " << *spps[sppIndex] << " spp: accumulated "
+				<< frame << " frames in " << elapsed << " s, " << elapsed / frame * 1000.0 << " ms per frame, mean variance "
+				<< renderer.getMeanVariance() << endl;
+		}
+		else if (isBatch()) {
+			cout << frame << " frames in " << elapsed << " s" << endl;
+		}
+	}
+	if (isBatch()) {
+		double batchTime = chrono::duration<double>(chrono::steady_clock::now() - batchStart).count();
+		cout << "Rendered " << shotNum << " shots in " << batchTime << " s, " << shotNum / batchTime << " shots/s" << endl;
+	}
+	writer.wait();
+	writer.printStats();
+	return writer.getFailNum() == 0 ? 0 : -1;
+}
+
+// Number of frames timed by the benchmark
+static int getBenchFrameNum()
+{
+	return FRAME_NUM > 0 ? FRAME_NUM : 100;
+}
+
+static void printBench(const char *renderer, int spp, int frames, double seconds, long long rays)
+{
+	double pixels = (double)SCR_WIDTH * SCR_HEIGHT;
+	double fps = frames / seconds;
+	cout << renderer << " " << SCR_WIDTH << "x" << SCR_HEIGHT << ", spp " << spp << ": " << frames << " frames in "
+		<< seconds << " s, " << fps << " fps, " << pixels * spp * fps / 1.0e6 << " Msamples/s = primary Mrays/s";
+	if (rays > 0) {
+		cout << ", " << rays / seconds / 1.0e6 << " Mrays/s in total";
+	}
+	cout << endl;
+}
+
+// Times every spp setting on the CPU: WARMUP_NUM frames, then the timed frames
+static int benchCPU()
+{
+	camera = make_shared<Camera>(SCR_WIDTH, SCR_HEIGHT);
+	CPURenderer renderer(THREAD_NUM);
+	renderer.setScene(spheres, globalLight);
+	renderer.setMesh(meshTree, meshAlbedo, meshMaterialIndex);
+	int frameNum = getBenchFrameNum();
+	for (const auto &spp : spps) {
+		for (int i = 0; i < WARMUP_NUM; ++i) {
+			renderer.render(*camera, SCR_WIDTH, SCR_HEIGHT, *spp, getRandOrigin(i));
+		}
+		long long rays = 0;
+		auto start = chrono::steady_clock::now();
+		for (int i = 0; i < frameNum; ++i) {
+			renderer.render(*camera, SCR_WIDTH, SCR_HEIGHT, *spp, getRandOrigin(i));
+			rays += renderer.getRayCount();
+		}
+		double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		printBench("CPU", *spp, frameNum, seconds, rays);
+	}
+	return 0;
+}
+
+// Builds the BVH of the shipped meshes with each split method and prints the tree quality
+static int testBVH()
+{
+	const char *meshes[] = { "bunny.obj", "teapot.obj" };
+	for (const char *mesh : meshes) {
+		Shape meshShape;
+		meshShape.loadMesh(RESOURCE_DIR + mesh);
+		meshShape.fitToUnitBox();
+		for (BVH_SplitMethod method : { SPLIT_MEDIAN, SPLIT_SAH }) {
+			BVHTree bvhTree;
+			bvhTree.splitMethod = method;
+			bvhTree.BVHBuildTree(getShapeTriangles(meshShape));
+			cout << mesh << ": ";
+			bvhTree.printStats();
+
+			// The parallel build must give exactly the serial tree
+			BVHTree parallelTree;
+			parallelTree.splitMethod = method;
+			parallelTree.parallelBuild = true;
+			parallelTree.parallelThreshold = 256;
+			parallelTree.buildThreadNum = THREAD_NUM;
+			parallelTree.BVHBuildTree(getShapeTriangles(meshShape));
+			cout << mesh << ": parallel build in " << parallelTree.stats.buildTime * 1000.0 << " ms, "
+				<< (parallelTree.sameTree(bvhTree) ? "identical to" : "DIFFERENT from") << " the serial tree" << endl;
+		}
+	}
+	return 0;
+}
+
+// Times one traversal over a ray set and prints its throughput. trace(ray, nodes)
+// returns true on a hit and, if nodes is not null, adds the nodes it visited.
+template<typename F>
+static void benchTraversal(const char *name, const vector<Ray> &rays, F trace)
+{
+	long long nodes = 0;
+	int hits = 0;
+	for (const Ray &ray : rays)
+		hits += trace(ray, &nodes);
+	int checksum = 0;
+	double time = timePass([&]() {
+		for (const Ray &ray : rays) checksum += trace(ray, nullptr);
+	});
+	double rayNum = (double)rays.size();
+	cout << "    " << name << ": " << nodes / time / 1.0e6 << " Mnodes/s, "
+		<< rayNum / time / 1.0e6 << " Mrays/s, " << nodes / rayNum << " nodes/ray, "
+		<< hits << " hits (checksum " << checksum << ")" << endl;
+}
+
+// Traces rays in packets of K consecutive rays, checks that every ray gets the
+// same closest hit as single ray compact traversal with the same triangle
+// kernel and prints the throughput
+template<int K, TriangleKernel kernel = KERNEL_SCALAR>
+static void benchPacket(const char *name, const CompactBVH &bvh, const vector<Ray> &rays)
+{
+	long long nodes = 0, singleRays = 0;
+	int hits = 0, mismatches = 0;
+	RayPacket<K> packet;
+	for (size_t start = 0; start < rays.size(); start += K) {
+		int count = (int)min(rays.size() - start, (size_t)K);
+		packet.clear();
+		for (int i = 0; i < count; ++i)
+			packet.setRay(i, rays[start + i]);
+		IntersectPacketCompactBVH<K, kernel>(bvh, packet, K / 4, &nodes, &singleRays);
+		for (int i = 0; i < count; ++i) {
+			float tHit;
+			int primId;
+			bool hit = IntersectCompactBVH<kernel>(bvh, rays[start + i], tHit, primId);
+			hits += packet.primId[i] >= 0;
+			if (hit != (packet.primId[i] >= 0) || primId != packet.primId[i] || (hit && tHit != packet.tMax[i]))
+				mismatches++;
+		}
+	}
+	double time = timePass([&]() {
+		for (size_t start = 0; start < rays.size(); start += K) {
+			int count = (int)min(rays.size() - start, (size_t)K);
+			packet.clear();
+			for (int i = 0; i < count; ++i)
+				packet.setRay(i, rays[start + i]);
+			IntersectPacketCompactBVH<K, kernel>(bvh, packet);
+		}
+	});
+	double rayNum = (double)rays.size();
+	cout << "    " << name << ": " << rayNum / time / 1.0e6 << " Mrays/s, "
+		<< nodes / (rayNum / K) << " nodes/packet, " << singleRays / rayNum
+		<< " single ray fallbacks/ray, " << hits << " hits, " << mismatches << " mismatches" << endl;
+}
+
+// Compares the float encoded NodeArray traversal with the compact binary and
+// the BVH_WIDTH wide CPU layouts
+static int benchBVH()
+{
+	const char *meshes[] = { "bunny.obj", "teapot.obj" };
+	for (const char *mesh : meshes) {
+		Shape meshShape;
+		meshShape.loadMesh(RESOURCE_DIR + mesh);
+		meshShape.fitToUnitBox();
+		BVHTree bvhTree;
+		bvhTree.BVHBuildTree(getShapeTriangles(meshShape));
+		CompactBVH compact;
+		compact.build(bvhTree);
+		WideBVH<BVH_WIDTH> wide;
+		wide.build(compact);
+		cout << mesh << ": " << compact.triangleNum() << " triangles, NodeArray + MeshArray "
+			<< (bvhTree.NodeArray.size() + bvhTree.MeshArray.size()) * sizeof(float) / 1024 << " KB, compact "
+			<< compact.memoryUsage() / 1024 << " KB (" << compact.nodes.size() << " nodes, "
+			<< compact.vertices.size() << " vertices), BVH" << BVH_WIDTH << " "
+			<< wide.memoryUsage() / 1024 << " KB (" << wide.nodes.size() << " nodes)" << endl;
+
+		Bound3f rootBound(compact.nodes[0].pMin, compact.nodes[0].pMax);
+		struct RaySet { const char *name; vector<Ray> rays; };
+		RaySet raySets[] = {
+			{ "primary", makePrimaryRays(rootBound, 512) },
+			{ "random", makeRandomRays(rootBound, 512 * 512) },
+			{ "edge", makeEdgeRays(compact.vertices, compact.indices, 512 * 512) },
+			{ "mirror", vector<Ray>() },
+		};
+		raySets[3].rays = makeMirrorRays(compact, raySets[0].rays);
+		for (const RaySet &set : raySets) {
+			// Every layout must find the same closest hit as the float encoded one. The
+			// watertight kernel rounds differently and also catches rays through cracks.
+			int mismatches = 0, watertightDiffs = 0;
+			for (const Ray &ray : set.rays) {
+				hitRecord rec;
+				float t1 = FLT_MAX, t2 = FLT_MAX, t3 = FLT_MAX;
+				int prim1 = -1, prim2 = -1, prim3 = -1;
+				bool hit0 = IntersectBVH(bvhTree, ray, rec);
+				bool hit1 = IntersectCompactBVH(compact, ray, t1, prim1);
+				bool hit2 = IntersectWideBVH<BVH_WIDTH, KERNEL_SCALAR>(wide, ray, t2, prim2);
+				bool hit3 = IntersectWideBVH<BVH_WIDTH, KERNEL_WATERTIGHT>(wide, ray, t3, prim3);
+				// The wide tree has other boxes, which may cull another one of two grazing
+				// triangles whose distances are only accurate to about 1e-4
+				if (hit0 != hit1 || hit0 != hit2 || hit0 != OccludedBVH(bvhTree, ray)
+					|| (hit0 && (rec.t != t1 || fabsf(rec.t - t2) > 1e-4f * rec.t))) mismatches++;
+				if (hit0 != hit3 || (hit0 && fabsf(rec.t - t3) > 1e-4f * rec.t)) watertightDiffs++;
+			}
+			cout << "  " << set.name << " rays, " << set.rays.size() << " rays, "
+				<< mismatches << " mismatches, " << watertightDiffs << " watertight differences" << endl;
+
+			hitRecord rec;
+			float tHit;
+			int primId;
+			benchTraversal("float          ", set.rays, [&](const Ray &ray, long long *nodes) {
+				return IntersectBVH(bvhTree, ray, rec, FLT_MAX, nodes);
+			});
+			benchTraversal("any hit        ", set.rays, [&](const Ray &ray, long long *nodes) {
+				return OccludedBVH(bvhTree, ray, FLT_MAX, nodes);
+			});
+			benchTraversal("compact        ", set.rays, [&](const Ray &ray, long long *nodes) {
+				return IntersectCompactBVH(compact, ray, tHit, primId, nodes);
+			});
+			string wideName = "BVH" + to_string(BVH_WIDTH) + " scalar    ";
+			benchTraversal(wideName.c_str(), set.rays, [&](const Ray &ray, long long *nodes) {
+				return IntersectWideBVH<BVH_WIDTH, KERNEL_SCALAR>(wide, ray, tHit, primId, nodes);
+			});
+			wideName = "BVH" + to_string(BVH_WIDTH) + " watertight";
+			benchTraversal(wideName.c_str(), set.rays, [&](const Ray &ray, long long *nodes) {
+				return IntersectWideBVH<BVH_WIDTH, KERNEL_WATERTIGHT>(wide, ray, tHit, primId, nodes);
+			});
+			benchPacket<8>("packet 8       ", compact, set.rays);
+			benchPacket<16>("packet 16      ", compact, set.rays);
+			benchPacket<8, KERNEL_WATERTIGHT>("packet 8 wt    ", compact, set.rays);
+			benchPacket<16, KERNEL_WATERTIGHT>("packet 16 wt   ", compact, set.rays);
+		}
+	}
+	return 0;
+}
+
+// Loads a mesh from RESOURCE_DIR, places it in the scene and builds its BVH
+static shared_ptr<BVHTree> loadSceneMesh(const string &meshName)
+{
+	TRACE_SCOPE("load mesh");
+	Shape meshShape;
+	meshShape.loadMesh(RESOURCE_DIR + meshName);
+	meshShape.fitToUnitBox();
+	vector<shared_ptr<Triangle>> triangles = getShapeTriangles(meshShape);
+	if (triangles.empty()) {
+		cerr << "No triangles in " << meshName << endl;
+		return nullptr;
+	}
+	float bottom = FLT_MAX;
+	for (const auto &tri : triangles) {
+		bottom = min(bottom, min(tri->v0.y, min(tri->v1.y, tri->v2.y)));
+	}
+	glm::vec3 offset = meshPosition - glm::vec3(0.0f, meshScale * bottom, 0.0f);
+	for (auto &tri : triangles) {
+		tri->v0 = meshScale * tri->v0 + offset;
+		tri->v1 = meshScale * tri->v1 + offset;
+		tri->v2 = meshScale * tri->v2 + offset;
+	}
+	auto tree = make_shared<BVHTree>();
+	tree->BVHBuildTree(triangles);
+	cout << meshName << ": ";
+	tree->printStats();
+	return tree;
+}
+
+// This function is called once to initialize the scene shared by the OpenGL
+// and the CPU renderer
+static void initScene()
+{
 	// Initial materials
 	materialIndex = 0;
 	materialNum = 3;
@@ -232,6 +800,7 @@ static void init()
 	shape->init();*/
 
 	// Initial sphere
+	sphereNum = 8;
 	sphereIndex = 0;
 	for (int i = 0; i < sphereNum; ++i) {
 		spheres.push_back(make_shared<Sphere>());
@@ -285,6 +854,20 @@ static void init()
 	sphere->materialIndex = 0;
 	sphere->albedo = glm::vec3(1.0, 1.0, 1.0);
 
+	// Particles, always the same ones so that renders can be compared
+	mt19937 rng(12345);
+	uniform_real_distribution<float> uniform(0.0f, 1.0f);
+	for (int i = 0; i < PARTICLE_NUM; ++i) {
+		float radius = 0.01f + 0.03f * uniform(rng);
+		sphere = make_shared<Sphere>();
+		sphere->center = glm::vec3(-3.0f + 6.0f * uniform(rng), -0.5f + radius, -4.0f + 5.0f * uniform(rng));
+		sphere->radius = radius;
+		sphere->materialIndex = DIFFUSE + (int)(3.0f * uniform(rng)) % 3;
+		sphere->albedo = glm::vec3(uniform(rng), uniform(rng), uniform(rng));
+		spheres.push_back(sphere);
+	}
+	sphereNum = (int)spheres.size();
+
 	// Initial spp
 	sppNum = 5;
 	spps.push_back(make_shared<int>(1));
@@ -293,10 +876,128 @@ static void init()
 	spps.push_back(make_shared<int>(10));
 	spps.push_back(make_shared<int>(20));
 	sppIndex = 0;
+	if (SPP > 0) {
+		spps.insert(spps.begin(), make_shared<int>(SPP));
+		sppNum++;
+	}
+
+	CPURandomInit();
 
+	globalLight = 1.0;
+
+	// Initial mesh
+	if (!MESH_NAME.empty()) {
+		meshTree = loadSceneMesh(MESH_NAME);
+	}
+}
+
+// This function is called once to initialize the scene and OpenGL
+// Returns false if the scene does not fit in the buffer textures
+static bool init()
+{
+	// Initial programs
+	programNum = 4;
+	for (int i = 0; i < programNum; ++i) {
+		programs.push_back(make_shared<Program>());
+	}
+
+	prog = programs[0];
+	prog->setShaderNames(RESOURCE_DIR + "RayTracerVertexShader.glsl", RESOURCE_DIR + "RayTracerFragmentShader.glsl");
+	prog->setVerbose(true);
+	prog->init();
+	RayTracerUniforms &rt = rtUniforms;
+	rt.historyTexture = prog->getUniform("historyTexture");
+	rt.historyluminance1Texture = prog->getUniform("historyluminance1Texture");
+	rt.historyluminance2Texture = prog->getUniform("historyluminance2Texture");
+	rt.accumulate = prog->getUniform("accumulate");
+	GLSL::checkError(GET_FILE_LINE);
+	//camera
+	rt.camPos = prog->getUniform("camera.camPos");
+	rt.front = prog->getUniform("camera.front");
+	rt.right = prog->getUniform("camera.right");
+	rt.up = prog->getUniform("camera.up");
+	rt.halfH = prog->getUniform("camera.halfH");
+	rt.halfW = prog->getUniform("camera.halfW");
+	rt.leftbottom = prog->getUniform("camera.leftbottom");
+	rt.LoopNum = prog->getUniform("camera.LoopNum");
+	//random
+	rt.randOrigin = prog->getUniform("randOrigin");
+	rt.spp = prog->getUniform("spp");
+	//sphere
+	prog->addUniformBlock("SceneBlock", SCENE_BLOCK_BINDING);
+	rt.sphereNodeTexture = prog->getUniform("sphereNodeTexture");
+	rt.sphereTexture = prog->getUniform("sphereTexture");
+	//mesh
+	rt.bvhNodeTexture = prog->getUniform("bvhNodeTexture");
+	rt.bvhMeshTexture = prog->getUniform("bvhMeshTexture");
+	rt.meshNum = prog->getUniform("meshNum");
+	rt.meshAlbedo = prog->getUniform("meshAlbedo");
+	rt.meshMaterialIndex = prog->getUniform("meshMaterialIndex");
+	prog->setVerbose(false);
+	
+	prog = programs[1];
+	prog->setShaderNames(RESOURCE_DIR + "ScreenVertexShader.glsl", RESOURCE_DIR + "ScreenFragmentShader.glsl");
+	prog->setVerbose(true);
+	prog->init();
+	screenUniforms.screenTexture = prog->getUniform("screenTexture");
+	prog->setVerbose(false);
+
+	prog = programs[2];
+	prog->setShaderNames(RESOURCE_DIR + "ScreenVertexShader.glsl", RESOURCE_DIR + "ATrousFragmentShader.glsl");
+	prog->setVerbose(true);
+	prog->init();
+	ATrousUniforms &at = atrousUniforms;
+	at.estimateVariance = prog->getUniform("estimateVariance");
+	at.stepWidth = prog->getUniform("stepWidth");
+	at.direction = prog->getUniform("direction");
+	at.linearVariance = prog->getUniform("linearVariance");
+	at.sigmaDepth = prog->getUniform("sigmaDepth");
+	at.sigmaNormal = prog->getUniform("sigmaNormal");
+	at.sigmaLuminance = prog->getUniform("sigmaLuminance");
+	at.screenTexture = prog->getUniform("screenTexture");
+	at.depthTexture = prog->getUniform("depthTexture");
+	at.normalTexture = prog->getUniform("normalTexture");
+	at.countTexture = prog->getUniform("countTexture");
+	at.luminance1Texture = prog->getUniform("luminance1Texture");
+	at.luminance2Texture = prog->getUniform("luminance2Texture");
+	at.inputTexture = prog->getUniform("inputTexture");
+	prog->setVerbose(false);
+
+	prog = programs[3];
+	prog->setShaderNames(RESOURCE_DIR + "ScreenVertexShader.glsl", RESOURCE_DIR + "TemporalFragmentShader.glsl");
+	prog->setVerbose(true);
+	prog->init();
+	TemporalUniforms &tu = temporalUniforms;
+	tu.camPos = prog->getUniform("camera.camPos");
+	tu.front = prog->getUniform("camera.front");
+	tu.right = prog->getUniform("camera.right");
+	tu.up = prog->getUniform("camera.up");
+	tu.halfH = prog->getUniform("camera.halfH");
+	tu.halfW = prog->getUniform("camera.halfW");
+	tu.leftbottom = prog->getUniform("camera.leftbottom");
+	tu.prevCamPos = prog->getUniform("prevCamera.camPos");
+	tu.prevFront = prog->getUniform("prevCamera.front");
+	tu.prevRight = prog->getUniform("prevCamera.right");
+	tu.prevUp = prog->getUniform("prevCamera.up");
+	tu.prevHalfH = prog->getUniform("prevCamera.halfH");
+	tu.prevHalfW = prog->getUniform("prevCamera.halfW");
+	tu.historyValid = prog->getUniform("historyValid");
+	tu.maxHistory = prog->getUniform("maxHistory");
+	tu.clampGamma = prog->getUniform("clampGamma");
+	tu.sampleTexture = prog->getUniform("sampleTexture");
+	tu.depthTexture = prog->getUniform("depthTexture");
+	tu.normalTexture = prog->getUniform("normalTexture");
+	tu.historyTexture = prog->getUniform("historyTexture");
+	tu.historyDepthTexture = prog->getUniform("historyDepthTexture");
+	tu.historyNormalTexture = prog->getUniform("historyNormalTexture");
+	tu.historyCountTexture = prog->getUniform("historyCountTexture");
+	tu.historyluminance1Texture = prog->getUniform("historyluminance1Texture");
+	tu.historyluminance2Texture = prog->getUniform("historyluminance2Texture");
+	prog->setVerbose(false);
 	// Initial screen
 	int width, height;
-	glfwGetFramebufferSize(window, &width, &height);
+	getFramebufferSize(width, height);
+	glViewport(0, 0, width, height);
 	camera = make_shared<Camera>(width, height);
 	
 	screen = make_shared<RT_Screen>();
@@ -304,143 +1005,772 @@ static void init()
 
 	screenBuffer = make_shared<RenderBuffer>();
 	screenBuffer->Init(width, height);
-	CPURandomInit();
+	denoiseBuffer = make_shared<DenoiseBuffer>();
+	denoiseBuffer->Init(width, height);
+	if (HEADLESS) {
+		outputBuffer = make_shared<OutputFBO>();
+		outputBuffer->configuration(width, height);
+	}
+	if (OFFLINE || HEADLESS) {
+		imageWriter = make_shared<ImageWriter>();
+		readback = make_shared<ReadbackRing>();
+		readback->Init(3, imageWriter.get());
+	}
 
 	tRecord = make_shared<timeRecord>();
 
-	globalLight = 1.0;
+	if (PROFILE) {
+		profiler = make_shared<GPUProfiler>();
+		profiler->Init({ "trace", "temporal", "denoise", "screen", "readback" }, { "swap" });
+		if (!PROFILE_CSV.empty()) {
+			profiler->openCSV(PROFILE_CSV);
+		}
+	}
+
+	sceneBuffer = make_shared<SceneBuffer>();
+	sceneBuffer->Init();
+	if (!sceneBuffer->update(spheres, globalLight)) {
+		return false;
+	}
+
+	// Mesh BVH as buffer textures 6 and 7
+	if (meshTree) {
+		meshBuffer = make_shared<BVHBuffer>();
+		if (!meshBuffer->Init(*meshTree)) {
+			return false;
+		}
+	}
 
 	GLSL::checkError(GET_FILE_LINE);
+	return true;
+}
+
+// Mean pixel variance of the frames accumulated by OpenGL, from the luminance
+// moments of the last frame
+static double getMeanVariance()
+{
+	int width, height;
+	getFramebufferSize(width, height);
+	vector<float> luminance1(width * height), luminance2(width * height);
+	screenBuffer->readLuminance(width, height, luminance1.data(), luminance2.data());
+	return CPURenderer::meanVariance(luminance1, luminance2, camera->LoopNum);
+}
+
+// Temporal denoiser of the frame just traced: blends the samples of the
+// frame with the history reprojected from the last frame
+static void resolveTemporal()
+{
+	TRACE_SCOPE("temporal pass");
+	if (profiler) {
+		profiler->begin(PASS_TEMPORAL);
+	}
+	prog = programs[3];
+	prog->bind();
+	// The history is still bound to units 0-5 by setCurrentBuffer()
+	screenBuffer->setCurrentResolve(11);
+	const TemporalUniforms &tu = temporalUniforms;
+	glUniform1i(tu.historyTexture, 0);
+	glUniform1i(tu.historyDepthTexture, 1);
+	glUniform1i(tu.historyNormalTexture, 2);
+	glUniform1i(tu.historyCountTexture, 3);
+	glUniform1i(tu.historyluminance1Texture, 4);
+	glUniform1i(tu.historyluminance2Texture, 5);
+	glUniform1i(tu.sampleTexture, 11);
+	glUniform1i(tu.depthTexture, 12);
+	glUniform1i(tu.normalTexture, 13);
+	glUniform3fv(tu.camPos, 1, &camera->cameraPos[0]);
+	glUniform3fv(tu.front, 1, &camera->cameraFront[0]);
+	glUniform3fv(tu.right, 1, &camera->cameraRight[0]);
+	glUniform3fv(tu.up, 1, &camera->cameraUp[0]);
+	glUniform1f(tu.halfH, camera->halfH);
+	glUniform1f(tu.halfW, camera->halfW);
+	glUniform3fv(tu.leftbottom, 1, &camera->LeftBottomCorner[0]);
+	glUniform1i(tu.historyValid, prevCamera != nullptr);
+	if (prevCamera) {
+		glUniform3fv(tu.prevCamPos, 1, &prevCamera->cameraPos[0]);
+		glUniform3fv(tu.prevFront, 1, &prevCamera->cameraFront[0]);
+		glUniform3fv(tu.prevRight, 1, &prevCamera->cameraRight[0]);
+		glUniform3fv(tu.prevUp, 1, &prevCamera->cameraUp[0]);
+		glUniform1f(tu.prevHalfH, prevCamera->halfH);
+		glUniform1f(tu.prevHalfW, prevCamera->halfW);
+	}
+	glUniform1i(tu.maxHistory, MAX_HISTORY);
+	glUniform1f(tu.clampGamma, HISTORY_CLAMP);
+	screen->DrawScreen();
+	prog->unbind();
+	if (profiler) {
+		profiler->end(PASS_TEMPORAL);
+	}
+}
+
+// Spatial denoiser of the frame just traced: a variance estimate, then
+// ATROUS_NUM a-trous iterations of one or two passes each, ending in
+// denoiseBuffer pass getDenoiseOutputPass()
+static void denoise()
+{
+	TRACE_SCOPE("denoise pass");
+	if (profiler) {
+		profiler->begin(PASS_DENOISE);
+	}
+	prog = programs[2];
+	prog->bind();
+	screenBuffer->setCurrentAsTexture();
+	const ATrousUniforms &at = atrousUniforms;
+	glUniform1i(at.screenTexture, 0);
+	glUniform1i(at.depthTexture, 1);
+	glUniform1i(at.normalTexture, 2);
+	glUniform1i(at.countTexture, 3);
+	glUniform1i(at.luminance1Texture, 4);
+	glUniform1i(at.luminance2Texture, 5);
+	glUniform1i(at.inputTexture, 10);
+	glUniform1f(at.sigmaDepth, 1.0f);
+	glUniform1f(at.sigmaNormal, 128.0f);
+	glUniform1f(at.sigmaLuminance, 4.0f);
+	glUniform1i(at.linearVariance, SPATIAL_FILTER == FILTER_LINEAR);
+	int passesPerIteration = SPATIAL_FILTER == FILTER_ATROUS ? 1 : 2;
+	for (int pass = 0; pass <= getDenoiseOutputPass(); ++pass) {
+		int iteration = (pass + passesPerIteration - 1) / passesPerIteration;
+		denoiseBuffer->BindPass(pass, 10);
+		glUniform1i(at.estimateVariance, pass == 0);
+		glUniform1i(at.stepWidth, pass > 0 ? 1 << (iteration - 1) : 0);
+		// A separable iteration is horizontal, then vertical
+		glUniform1i(at.direction, passesPerIteration == 1 ? 0 : 2 - pass % 2);
+		screen->DrawScreen();
+	}
+	prog->unbind();
+	if (profiler) {
+		profiler->end(PASS_DENOISE);
+	}
 }
 
 // This function is called every frame to draw the scene.
 static void render()
 {
+	TRACE_SCOPE("frame");
 	// compute time
 	tRecord->updateTime();
 
-	// input by keyboard
-	processInput(window);
+	// input by keyboard, the benchmark camera stays put
+	if (!HEADLESS && !BENCHMARK) {
+		TRACE_SCOPE("process input");
+		processInput(window);
+	}
 
 	// camera loop add 1
 	camera->LoopIncrease();
 
-	screenBuffer->setCurrentBuffer(camera->LoopNum);
+	screenBuffer->setCurrentBuffer();
+	// The accumulation of the ray tracer takes precedence
+	bool temporalResolve = temporalDenoiser && !ACCUMULATE;
+	if (temporalResolve) {
+		screenBuffer->setCurrentSample();
+	}
 
 	prog = programs[0];
 	prog->bind();
-	glUniform1i(prog->getUniform("historyTexture"), 0);
-	glUniform1i(prog->getUniform("historyDepthTexture"), 1);
-	glUniform1i(prog->getUniform("historyNormalTexture"), 2);
-	glUniform1i(prog->getUniform("historyCountTexture"), 3);
-	glUniform1i(prog->getUniform("historyluminance1Texture"), 4);
-	glUniform1i(prog->getUniform("historyluminance2Texture"), 5);
-	glUniform1i(prog->getUniform("temporalDenoiser"), temporalDenoiser);
-	glUniform1i(prog->getUniform("spatialDenoiser"), spatialDenoiser);
-	glUniform1i(prog->getUniform("sphereNum"), sphereNum);
-	glUniform1f(prog->getUniform("globalLight"), globalLight);
-	//camera
-	glUniform3fv(prog->getUniform("camera.camPos"), 1, &camera->cameraPos[0]);
-	glUniform3fv(prog->getUniform("camera.front"), 1, &camera->cameraFront[0]);
-	glUniform3fv(prog->getUniform("camera.right"), 1, &camera->cameraRight[0]);
-	glUniform3fv(prog->getUniform("camera.up"), 1, &camera->cameraUp[0]);
-	glUniform1f(prog->getUniform("camera.halfH"), camera->halfH);
-	glUniform1f(prog->getUniform("camera.halfW"), camera->halfW);
-	glUniform3fv(prog->getUniform("camera.leftbottom"), 1, &camera->LeftBottomCorner[0]);
-	glUniform1i(prog->getUniform("camera.LoopNum"), camera->LoopNum);
-
-	//random
-	glUniform1f(prog->getUniform("randOrigin"), 674764.0f * (GetCPURandom() + 1.0f));
-	glUniform1i(prog->getUniform("spp"), *spps[sppIndex]);
-
-	//sphere
-	for (int i = 0; i < sphereNum; ++i) {
-		sprintf(uniformName, "sphere[%d].radius", i);
-		glUniform1f(prog->getUniform(uniformName), spheres[i]->radius);
-
-		sprintf(uniformName, "sphere[%d].center", i);
-		glUniform3fv(prog->getUniform(uniformName), 1, &spheres[i]->center[0]);
-
-		sprintf(uniformName, "sphere[%d].materialIndex", i);
-		glUniform1i(prog->getUniform(uniformName), spheres[i]->materialIndex);
-
-		sprintf(uniformName, "sphere[%d].albedo", i);
-		glUniform3fv(prog->getUniform(uniformName), 1, &spheres[i]->albedo[0]);
+	{
+		TRACE_SCOPE("upload uniforms");
+		const RayTracerUniforms &rt = rtUniforms;
+		glUniform1i(rt.historyTexture, 0);
+		glUniform1i(rt.historyluminance1Texture, 4);
+		glUniform1i(rt.historyluminance2Texture, 5);
+		glUniform1i(rt.accumulate, ACCUMULATE);
+		//camera
+		glUniform3fv(rt.camPos, 1, &camera->cameraPos[0]);
+		glUniform3fv(rt.front, 1, &camera->cameraFront[0]);
+		glUniform3fv(rt.right, 1, &camera->cameraRight[0]);
+		glUniform3fv(rt.up, 1, &camera->cameraUp[0]);
+		glUniform1f(rt.halfH, camera->halfH);
+		glUniform1f(rt.halfW, camera->halfW);
+		glUniform3fv(rt.leftbottom, 1, &camera->LeftBottomCorner[0]);
+		glUniform1i(rt.LoopNum, camera->LoopNum);
+
+		//random
+		glUniform1f(rt.randOrigin, getRandOrigin(camera->LoopNum));
+		glUniform1i(rt.spp, *spps[sppIndex]);
+
+		//sphere
+		sceneBuffer->update(spheres, globalLight);
+		sceneBuffer->BindBase(SCENE_BLOCK_BINDING);
+		sceneBuffer->BindAsTexture(8, 9);
+		glUniform1i(rt.sphereNodeTexture, 8);
+		glUniform1i(rt.sphereTexture, 9);
+
+		//mesh
+		if (meshBuffer) {
+			meshBuffer->BindAsTexture(6, 7);
+		}
+		glUniform1i(rt.bvhNodeTexture, 6);
+		glUniform1i(rt.bvhMeshTexture, 7);
+		glUniform1i(rt.meshNum, meshBuffer ? meshBuffer->getMeshNum() : 0);
+		glUniform3fv(rt.meshAlbedo, 1, &meshAlbedo[0]);
+		glUniform1i(rt.meshMaterialIndex, meshMaterialIndex);
 	}
 
-	screen->DrawScreen();
+	{
+		TRACE_SCOPE("trace pass");
+		if (profiler) {
+			profiler->begin(PASS_TRACE);
+		}
+		screen->DrawScreen();
+		if (profiler) {
+			profiler->end(PASS_TRACE);
+		}
+	}
 	prog->unbind();
 
-	int width, height;
-	glfwGetFramebufferSize(window, &width, &height);
+	if (temporalResolve) {
+		resolveTemporal();
+	}
+	// The frame just traced is the history of the next one
+	if (prevCamera) {
+		*prevCamera = *camera;
+	}
+	else {
+		prevCamera = make_shared<Camera>(*camera);
+	}
+
+	if (spatialDenoiser) {
+		denoise();
+	}
 
 	prog = programs[1];
 	// 󶨵Ĭϻ
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	if (outputBuffer) {
+		outputBuffer->Bind();
+	}
+	else {
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	}
 	// 
 	glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
 	glClear(GL_COLOR_BUFFER_BIT);
 
 	prog->bind();
-	screenBuffer->setCurrentAsTexture(camera->LoopNum);
+	screenBuffer->setCurrentAsTexture();
+	if (spatialDenoiser) {
+		denoiseBuffer->BindAsTexture(getDenoiseOutputPass(), 0);
+	}
 	// screenBuffer󶨵Ϊ0ƬɫеscreenTextureΪ0
-	glUniform1i(prog->getUniform("spatialDenoiser"), spatialDenoiser);
-	glUniform1i(prog->getUniform("screenTexture"), 0);
-	glUniform1i(prog->getUniform("historyluminance1Texture"), 4);
-	glUniform1i(prog->getUniform("historyluminance2Texture"), 5);
-	glUniform1f(prog->getUniform("texelWidth"), 1.0f / width);
-	glUniform1f(prog->getUniform("texelHeight"), 1.0f / height);
+	glUniform1i(screenUniforms.screenTexture, 0);
 
 	// Ļ
-	screen->DrawScreen();
+	{
+		TRACE_SCOPE("screen pass");
+		if (profiler) {
+			profiler->begin(PASS_SCREEN);
+		}
+		screen->DrawScreen();
+		if (profiler) {
+			profiler->end(PASS_SCREEN);
+		}
+	}
 	
 	GLSL::checkError(GET_FILE_LINE);
 	
-	if(OFFLINE) {
-		saveImage("output.png", window);
-		GLSL::checkError(GET_FILE_LINE);
-		glfwSetWindowShouldClose(window, true);
+	if(OFFLINE && !HEADLESS) {
+		double elapsed = chrono::duration<double>(chrono::steady_clock::now() - offlineStart).count();
+		bool done = offlineDone(camera->LoopNum, elapsed, getMeanVariance);
+		if (done || isSequence()) {
+			saveFrame(getOutputPath(camera->LoopNum - 1));
+		}
+		if (done) {
+			glfwSetWindowShouldClose(window, true);
+		}
+	}
+}
+
+// Sets the context hints shared by the windowed and the headless mode
+static void setContextHints()
+{
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+}
+
+// Initializes GLFW and creates the OpenGL context of the headless mode. With
+// GLFW 3.4 a surfaceless EGL or OSMesa context of the null platform is tried
+// first, which needs no display server; otherwise, or if that fails, the
+// context of a hidden window. Returns null if there is no context at all.
+static GLFWwindow *createHeadlessWindow()
+{
+#ifdef GLFW_PLATFORM_NULL
+	glfwInitHint(GLFW_PLATFORM, GLFW_PLATFORM_NULL);
+	if (glfwInit()) {
+		for (int api : { GLFW_EGL_CONTEXT_API, GLFW_OSMESA_CONTEXT_API }) {
+			glfwDefaultWindowHints();
+			setContextHints();
+			glfwWindowHint(GLFW_CONTEXT_CREATION_API, api);
+			GLFWwindow *w = glfwCreateWindow(SCR_WIDTH, SCR_HEIGHT, "headless", NULL, NULL);
+			if (w) {
+				return w;
+			}
+		}
+		glfwTerminate();
+	}
+	glfwInitHint(GLFW_PLATFORM, GLFW_ANY_PLATFORM);
+#endif
+	if (!glfwInit()) {
+		return NULL;
+	}
+	glfwDefaultWindowHints();
+	setContextHints();
+	glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+	GLFWwindow *w = glfwCreateWindow(SCR_WIDTH, SCR_HEIGHT, "headless", NULL, NULL);
+	if (!w) {
+		glfwTerminate();
+	}
+	return w;
+}
+
+// Times every spp setting with OpenGL: WARMUP_NUM frames, then the timed
+// frames, with no vsync. The GPU is only waited for at both ends of the timed
+// frames, so that they pipeline as in normal rendering.
+static void benchGL()
+{
+	int frameNum = getBenchFrameNum();
+	for (sppIndex = 0; sppIndex < (int)spps.size(); ++sppIndex) {
+		auto frame = [&]() {
+			render();
+			if (!HEADLESS) {
+				glfwSwapBuffers(window);
+				glfwPollEvents();
+			}
+			if (profiler) {
+				profiler->endFrame();
+			}
+		};
+		for (int i = 0; i < WARMUP_NUM; ++i) {
+			frame();
+		}
+		glFinish();
+		auto start = chrono::steady_clock::now();
+		for (int i = 0; i < frameNum; ++i) {
+			frame();
+		}
+		glFinish();
+		double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		printBench(HEADLESS ? "Headless" : "Window", *spps[sppIndex], frameNum, seconds, 0);
 	}
+	sppIndex = 0;
+}
+
+// Renders frames into the offscreen buffers until offlineDone(), prints the
+// wall time of each frame and saves the last one to OUTPUT_PATH. With
+// ACCUMULATE the last frame is the average of all of them.
+static void renderHeadless()
+{
+	// The readback ring and the writer save a shot while the next one renders
+	auto batchStart = chrono::steady_clock::now();
+	int shotNum = getShotNum();
+	for (int shot = 0; shot < shotNum; ++shot) {
+		setShot(shot);
+		double totalTime = 0.0;
+		int frame = 0;
+		bool done = false;
+		do {
+			auto start = chrono::steady_clock::now();
+			render();
+			// A sequence is timed with its readback, which overlaps the next frames
+			if (!isSequence()) {
+				glFinish();
+			}
+			double frameTime = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+			totalTime += frameTime;
+			if (!ACCUMULATE && !isBatch()) {
+				cout << "Frame " << frame << ": " << frameTime * 1000.0 << " ms" << endl;
+			}
+			frame++;
+			done = offlineDone(frame, totalTime, getMeanVariance);
+			if (isSavedFrame(done)) {
+				saveFrame(getOutputPath(getImageIndex(shot, frame - 1)));
+			}
+			if (profiler) {
+				profiler->endFrame();
+			}
+		} while (!done);
+		if (isBatch()) {
+			cout << "Shot " << shot + 1 << "/" << shotNum << ": ";
+		}
+		cout << "Headless render " << SCR_WIDTH << "x" << SCR_HEIGHT << ", " << *spps[sppIndex] << " spp: "
+			<< frame << (ACCUMULATE ? " frames accumulated, " : " frames, ") << totalTime / frame * 1000.0 << " ms per frame";
+		if (ACCUMULATE) {
+			cout << ", mean variance " << getMeanVariance();
+		}
+		cout << endl;
+	}
+	if (isBatch()) {
+		double batchTime = chrono::duration<double>(chrono::steady_clock::now() - batchStart).count();
+		cout << "Rendered " << shotNum << " shots in " << batchTime << " s, " << shotNum / batchTime << " shots/s" << endl;
+	}
+}
+
+// Reads a frame of the OpenGL denoisers into the planes of CPUDenoiser: the
+// current frame, or with history the last one. colorIndex is the attachment
+// of the color, 6 for the sample the temporal resolve reads, 0 for its output.
+static void readDenoiseFrame(bool history, int colorIndex, DenoiseFrame &frame)
+{
+	int width, height;
+	getFramebufferSize(width, height);
+	frame.resize(width, height);
+	size_t pixelNum = (size_t)width * height;
+	vector<float> rgb(3 * pixelNum);
+	vector<int> count(pixelNum);
+	auto read = [&](int index, GLenum format, GLenum type, void *data) {
+		if (history) {
+			screenBuffer->readHistoryAttachment(index, format, type, data, width, height);
+		}
+		else {
+			screenBuffer->readAttachment(index, format, type, data, width, height);
+		}
+	};
+	read(colorIndex, GL_RGB, GL_FLOAT, rgb.data());
+	for (size_t i = 0; i < pixelNum; ++i) {
+		for (int c = 0; c < 3; ++c) frame.color[c][i] = rgb[3 * i + c];
+	}
+	read(2, GL_RGB, GL_FLOAT, rgb.data());
+	for (size_t i = 0; i < pixelNum; ++i) {
+		for (int c = 0; c < 3; ++c) frame.normal[c][i] = rgb[3 * i + c];
+	}
+	read(1, GL_RED, GL_FLOAT, frame.depth.data());
+	read(3, GL_RED_INTEGER, GL_INT, count.data());
+	for (size_t i = 0; i < pixelNum; ++i) {
+		frame.count[i] = (float)count[i];
+	}
+	read(4, GL_RED, GL_FLOAT, frame.luminance1.data());
+	read(5, GL_RED, GL_FLOAT, frame.luminance2.data());
+	GLSL::checkError(GET_FILE_LINE);
+}
+
+// Reads the color and variance the spatial denoiser wrote last
+static void readFilteredFrame(DenoiseFrame &frame)
+{
+	int width, height;
+	getFramebufferSize(width, height);
+	frame.resize(width, height);
+	size_t pixelNum = (size_t)width * height;
+	frame.variance.resize(pixelNum);
+	vector<float> rgba(4 * pixelNum);
+	denoiseBuffer->read(getDenoiseOutputPass(), rgba.data(), width, height);
+	GLSL::checkError(GET_FILE_LINE);
+	for (size_t i = 0; i < pixelNum; ++i) {
+		for (int c = 0; c < 3; ++c) frame.color[c][i] = rgba[4 * i + c];
+		frame.variance[i] = rgba[4 * i + 3];
+	}
+}
+
+// Prints how far the planes of the CPU denoiser, or of another filter, are
+// from those of OpenGL. A pixel differs if one of its planes is off by more
+// than absTolerance + relTolerance of the OpenGL value; returns true if
+// fewer than 0.1% of the pixels differ.
+static bool compareDenoised(const char *name, const vector<const vector<float> *> &cpu, const vector<const vector<float> *> &gl,
+	double absTolerance = 1e-3, double relTolerance = 1e-2)
+{
+	size_t pixelNum = gl[0]->size();
+	size_t differ = 0;
+	double maxError = 0.0, errorSum = 0.0;
+	for (size_t i = 0; i < pixelNum; ++i) {
+		bool same = true;
+		for (size_t p = 0; p < gl.size(); ++p) {
+			double a = (*cpu[p])[i], b = (*gl[p])[i];
+			double error = fabs(a - b);
+			maxError = max(maxError, error);
+			errorSum += error;
+			same = same && error <= absTolerance + relTolerance * fabs(b);
+		}
+		differ += !same;
+	}
+	bool pass = differ * 1000 < pixelNum;
+	cout << name << ": max error " << maxError << ", mean error " << errorSum / (pixelNum * gl.size()) << ", "
+		<< differ << " of " << pixelNum << " pixels differ: " << (pass ? "ok" : "FAILED") << endl;
+	return pass;
+}
+
+// Renders FRAME_NUM frames, at least 2, with both denoisers while the camera
+// moves sideways, then denoises the last one on the CPU from the same
+// OpenGL inputs and compares the temporal resolve and the a-trous output.
+// The separable filter, which has no CPU version, is compared with the 5x5
+// one in OpenGL and the bilinear variance prefilter with the separable one.
+static int testDenoiser()
+{
+	temporalDenoiser = true;
+	spatialDenoiser = true;
+	ACCUMULATE = false;
+	// The CPU filter is the 5x5 a-trous one
+	SPATIAL_FILTER = FILTER_ATROUS;
+	int frames = max(2, FRAME_NUM);
+	glm::vec3 start = camera->cameraPos;
+	Camera historyCamera = *camera;
+	for (int frame = 0; frame < frames; ++frame) {
+		// A few pixels a frame, so that the history is reprojected and partly disoccluded
+		camera->setView(start + (0.01f * frame) * camera->cameraRight, camera->Yaw, camera->Pitch, camera->fov);
+		if (prevCamera) {
+			historyCamera = *prevCamera;
+		}
+		render();
+	}
+	glFinish();
+
+	DenoiseFrame sample, resolved, history;
+	readDenoiseFrame(false, 6, sample);
+	readDenoiseFrame(false, 0, resolved);
+	readDenoiseFrame(true, 0, history);
+	int width = resolved.width, height = resolved.height;
+	DenoiseFrame filtered;
+	readFilteredFrame(filtered);
+
+	CPUDenoiser denoiser(THREAD_NUM);
+	DenoiseFrame cpuResolved, cpuFiltered;
+	denoiser.resolveTemporal(sample, *camera, &history, &historyCamera, MAX_HISTORY, HISTORY_CLAMP, cpuResolved);
+	denoiser.filter(resolved, ATROUS_NUM, cpuFiltered);
+	cout << "CPU denoise " << width << "x" << height << " on " << denoiser.getThreadNum() << " threads: temporal "
+		<< denoiser.getTemporalTime() * 1000.0 << " ms, estimate and " << ATROUS_NUM << " a-trous iterations "
+		<< denoiser.getFilterTime() * 1000.0 << " ms" << endl;
+	bool pass = compareDenoised("Temporal color",
+		{ &cpuResolved.color[0], &cpuResolved.color[1], &cpuResolved.color[2] },
+		{ &resolved.color[0], &resolved.color[1], &resolved.color[2] });
+	pass = compareDenoised("Temporal count and moments",
+		{ &cpuResolved.count, &cpuResolved.luminance1, &cpuResolved.luminance2 },
+		{ &resolved.count, &resolved.luminance1, &resolved.luminance2 }) && pass;
+	pass = compareDenoised("A-trous color",
+		{ &cpuFiltered.color[0], &cpuFiltered.color[1], &cpuFiltered.color[2] },
+		{ &filtered.color[0], &filtered.color[1], &filtered.color[2] }) && pass;
+	pass = compareDenoised("A-trous variance", { &cpuFiltered.variance }, { &filtered.variance }) && pass;
+
+	// The split iteration stops diagonal taps at other edges, which moves
+	// the odd pixel by a few percent; the prefilter is the same 3x3 Gaussian
+	DenoiseFrame separable, linear;
+	SPATIAL_FILTER = FILTER_SEPARABLE;
+	denoise();
+	readFilteredFrame(separable);
+	SPATIAL_FILTER = FILTER_LINEAR;
+	denoise();
+	readFilteredFrame(linear);
+	SPATIAL_FILTER = FILTER_ATROUS;
+	GLSL::checkError(GET_FILE_LINE);
+	pass = compareDenoised("Separable color against 5x5",
+		{ &separable.color[0], &separable.color[1], &separable.color[2] },
+		{ &filtered.color[0], &filtered.color[1], &filtered.color[2] }, 5e-2, 1e-1) && pass;
+	pass = compareDenoised("Linear variance color against separable",
+		{ &linear.color[0], &linear.color[1], &linear.color[2] },
+		{ &separable.color[0], &separable.color[1], &separable.color[2] }) && pass;
+	pass = compareDenoised("Linear variance against separable", { &linear.variance }, { &separable.variance }) && pass;
+	return pass ? 0 : -1;
 }
 
 int main(int argc, char **argv)
 {
 	if(argc < 2) {
-		cout << "Usage: A3 RESOURCE_DIR" << endl;
+		cout << "Usage: A3 RESOURCE_DIR [OFFLINE] [--cpu] [--headless] [--width=W] [--height=H] [--frames=N] [--spp=N]" << endl;
+		cout << "          [--accumulate] [--time=SECONDS] [--variance=V] [--output=FILE|PATTERN] [--aov]" << endl;
+		cout << "          [--temporal] [--history=N] [--clamp=G] [--denoise] [--atrous=N] [--filter=atrous|separable|linear]" << endl;
+		cout << "          [--denoisetest]" << endl;
+		cout << "          [--path=FILE] [--fps=F] [--profile] [--csv=FILE]" << endl;
+		cout << "          [--novsync] [--bench] [--warmup=N] [--trace=FILE]" << endl;
+		cout << "          [--threads=N] [--seed=S] [--mesh=FILE] [--spheres=N] [--bvhtest] [--bvhbench]" << endl;
 		return 0;
 	}
 	RESOURCE_DIR = argv[1] + string("/");
 	
-	// Optional argument
-	if(argc >= 3) {
-		OFFLINE = atoi(argv[2]) != 0;
+	// Optional arguments
+	for (int i = 2; i < argc; ++i) {
+		string arg = argv[i];
+		string value;
+		if (arg == "--cpu") {
+			CPU_RENDER = true;
+		}
+		else if (arg == "--headless") {
+			HEADLESS = true;
+		}
+		else if (arg == "--accumulate") {
+			ACCUMULATE = true;
+		}
+		else if (arg == "--temporal") {
+			temporalDenoiser = true;
+		}
+		else if (getOption(arg, "history", value)) {
+			MAX_HISTORY = max(1, atoi(value.c_str()));
+		}
+		else if (getOption(arg, "clamp", value)) {
+			HISTORY_CLAMP = (float)atof(value.c_str());
+		}
+		else if (arg == "--denoise") {
+			spatialDenoiser = true;
+		}
+		else if (getOption(arg, "atrous", value)) {
+			ATROUS_NUM = max(0, atoi(value.c_str()));
+		}
+		else if (getOption(arg, "filter", value)) {
+			if (value == "separable") {
+				SPATIAL_FILTER = FILTER_SEPARABLE;
+			}
+			else if (value == "linear") {
+				SPATIAL_FILTER = FILTER_LINEAR;
+			}
+			else if (value == "atrous") {
+				SPATIAL_FILTER = FILTER_ATROUS;
+			}
+			else {
+				cerr << "Unknown filter " << value << ", one of atrous, separable and linear" << endl;
+				return -1;
+			}
+		}
+		else if (arg == "--denoisetest") {
+			// Needs OpenGL, rendered offscreen
+			DENOISE_TEST = true;
+			HEADLESS = true;
+		}
+		else if (arg == "--aov") {
+			AOV = true;
+		}
+		else if (arg == "--novsync") {
+			VSYNC = false;
+		}
+		else if (arg == "--bench") {
+			BENCHMARK = true;
+			VSYNC = false;
+		}
+		else if (getOption(arg, "warmup", value)) {
+			WARMUP_NUM = max(0, atoi(value.c_str()));
+		}
+		else if (getOption(arg, "trace", value)) {
+			TRACE_PATH = value;
+		}
+		else if (arg == "--profile") {
+			PROFILE = true;
+		}
+		else if (getOption(arg, "csv", value)) {
+			PROFILE_CSV = value;
+			PROFILE = true;
+		}
+		else if (arg == "--bvhtest") {
+			BVH_TEST = true;
+		}
+		else if (arg == "--bvhbench") {
+			BVH_BENCH = true;
+		}
+		else if (getOption(arg, "threads", value)) {
+			THREAD_NUM = atoi(value.c_str());
+		}
+		else if (getOption(arg, "seed", value)) {
+			RAND_ORIGIN = (float)atof(value.c_str());
+		}
+		else if (getOption(arg, "spheres", value)) {
+			PARTICLE_NUM = max(0, atoi(value.c_str()));
+		}
+		else if (getOption(arg, "mesh", value)) {
+			MESH_NAME = value;
+		}
+		else if (getOption(arg, "width", value)) {
+			SCR_WIDTH = max(1, atoi(value.c_str()));
+		}
+		else if (getOption(arg, "height", value)) {
+			SCR_HEIGHT = max(1, atoi(value.c_str()));
+		}
+		else if (getOption(arg, "frames", value)) {
+			FRAME_NUM = max(1, atoi(value.c_str()));
+		}
+		else if (getOption(arg, "spp", value)) {
+			SPP = max(1, atoi(value.c_str()));
+		}
+		else if (getOption(arg, "time", value)) {
+			TIME_BUDGET = atof(value.c_str());
+		}
+		else if (getOption(arg, "variance", value)) {
+			// Only an accumulated image converges
+			VARIANCE_TARGET = atof(value.c_str());
+			ACCUMULATE = true;
+		}
+		else if (getOption(arg, "output", value)) {
+			OUTPUT_PATH = value;
+		}
+		else if (getOption(arg, "path", value)) {
+			CAMERA_PATH = value;
+		}
+		else if (getOption(arg, "fps", value)) {
+			PATH_FPS = max(0.001f, (float)atof(value.c_str()));
+		}
+		else {
+			OFFLINE = atoi(arg.c_str()) != 0;
+		}
+	}
+
+	if (!TRACE_PATH.empty()) {
+#ifdef ENABLE_TRACE
+		TRACE_THREAD_NAME("main");
+		TRACE_START();
+		// Also covers the early returns of the CPU modes
+		atexit([]() { TRACE_WRITE(TRACE_PATH); });
+#else
+		cerr << "--trace needs a build with ENABLE_TRACE" << endl;
+#endif
+	}
+
+	if (!CAMERA_PATH.empty()) {
+		if (!cameraPath.load(CAMERA_PATH)) {
+			return -1;
+		}
+		// A batch saves one image per shot, numbered before the extension
+		if (!isSequence()) {
+			size_t dot = OUTPUT_PATH.find_last_of('.');
+			size_t slash = OUTPUT_PATH.find_last_of("/\\");
+			if (dot == string::npos || (slash != string::npos && dot < slash)) dot = OUTPUT_PATH.size();
+			OUTPUT_PATH.insert(dot, "%04d");
+		}
+		if (!CPU_RENDER) {
+			HEADLESS = true;
+		}
+	}
+
+	if (BVH_TEST) {
+		return testBVH();
+	}
+	if (BVH_BENCH) {
+		return benchBVH();
+	}
+
+	initScene();
+	if (CPU_RENDER && !DENOISE_TEST) {
+		return BENCHMARK ? benchCPU() : renderCPU();
 	}
 
 	// Set error callback.
 	glfwSetErrorCallback(error_callback);
-	// Initialize the library.
-	if(!glfwInit()) {
-		return -1;
+	if (HEADLESS) {
+		window = createHeadlessWindow();
+		if (!window && DENOISE_TEST) {
+			cout << "No OpenGL context to test the denoisers against" << endl;
+			return -1;
+		}
+		if (!window) {
+			cout << "No OpenGL context, rendering on the CPU" << endl;
+			return BENCHMARK ? benchCPU() : renderCPU();
+		}
+		glfwMakeContextCurrent(window);
 	}
+	else {
+		// Initialize the library.
+		if(!glfwInit()) {
+			return -1;
+		}
 
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
-	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+		setContextHints();
 
-	// Create a windowed mode window and its OpenGL context.
-	window = glfwCreateWindow(SCR_WIDTH, SCR_HEIGHT, "YOUR NAME", NULL, NULL);
-	if(!window) {
-		glfwTerminate();
-		return -1;
+		// Create a windowed mode window and its OpenGL context.
+		window = glfwCreateWindow(SCR_WIDTH, SCR_HEIGHT, "YOUR NAME", NULL, NULL);
+		if(!window) {
+			glfwTerminate();
+			return -1;
+		}
+		// Make the window's context current.
+		glfwMakeContextCurrent(window);
+		glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
+		glfwSetCursorPosCallback(window, mouse_callback);
+		glfwSetScrollCallback(window, scroll_callback);
+
+		// ڲ꣬ʾ
+		glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
 	}
-	// Make the window's context current.
-	glfwMakeContextCurrent(window);
-	glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
-	glfwSetCursorPosCallback(window, mouse_callback);
-	glfwSetScrollCallback(window, scroll_callback);
-
-	// ڲ꣬ʾ
-	glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
 
 	// Initialize GLEW.
 	glewExperimental = true;
@@ -452,28 +1782,79 @@ int main(int argc, char **argv)
 	cout << "OpenGL version: " << glGetString(GL_VERSION) << endl;
 	cout << "GLSL version: " << glGetString(GL_SHADING_LANGUAGE_VERSION) << endl;
 	GLSL::checkVersion();
-	// Set vsync.
-	glfwSwapInterval(1);
+	// Set vsync, off without a window so that frames are timed at full speed.
+	glfwSwapInterval(HEADLESS || !VSYNC ? 0 : 1);
 
 	// Initialize scene.
-	init();
+	if (!init()) {
+		glfwTerminate();
+		return -1;
+	}
+	offlineStart = chrono::steady_clock::now();
+	int exitCode = 0;
+	if (DENOISE_TEST) {
+		exitCode = testDenoiser();
+		glfwSetWindowShouldClose(window, true);
+	}
+	else if (BENCHMARK) {
+		benchGL();
+		glfwSetWindowShouldClose(window, true);
+	}
+	else if (HEADLESS) {
+		renderHeadless();
+		glfwSetWindowShouldClose(window, true);
+	}
 	// Loop until the user closes the window.
+	double titleTime = 0.0;
 	while(!glfwWindowShouldClose(window)) {
 		// Render scene.
 		render();
-		// Swap front and back buffers.
-		glfwSwapBuffers(window);
+		// Swap front and back buffers, with the vsync wait.
+		auto swapStart = chrono::steady_clock::now();
+		{
+			TRACE_SCOPE("swap buffers");
+			glfwSwapBuffers(window);
+		}
+		if (profiler) {
+			profiler->setCPUTime(PASS_SWAP, chrono::duration<double>(chrono::steady_clock::now() - swapStart).count());
+			profiler->endFrame();
+			// The pass times in the title bar, twice a second
+			if (glfwGetTime() - titleTime > 0.5) {
+				titleTime = glfwGetTime();
+				glfwSetWindowTitle(window, profiler->getSummary().c_str());
+			}
+		}
 		// Poll for and process events.
 		glfwPollEvents();
 	}
+	if (profiler) {
+		profiler->Delete();
+		profiler->printStats();
+	}
+	// Save the images still in flight
+	if (readback) {
+		readback->flush();
+		imageWriter->wait();
+		cout << "Readback waited " << readback->getStallTime() * 1000.0 << " ms for " << readback->getReadNum() << " images. ";
+		imageWriter->printStats();
+		readback->Delete();
+	}
+	// delete resources while the context is still current
+	if (outputBuffer) {
+		outputBuffer->Delete();
+	}
+	if (meshBuffer) {
+		meshBuffer->Delete();
+	}
+	sceneBuffer->Delete();
+	screenBuffer->Delete();
+	denoiseBuffer->Delete();
+	screen->Delete();
 	// Quit program.
 	glfwDestroyWindow(window);
 	glfwTerminate();
-	// delete resources
-	screenBuffer->Delete();
-	screen->Delete();
 
-	return 0;
+	return exitCode;
 }
 
 // 